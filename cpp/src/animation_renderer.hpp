@@ -0,0 +1,62 @@
+#pragma once
+
+#include "gif_encoder.hpp"
+#include "indexed_image.hpp"
+#include "parallel_for.hpp"
+#include "png_encoder.hpp"
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Renders a sequence of frames into an animated GIF or PNG.
+ * Each frame is rendered and then compressed straight away by the same
+ * thread, with the threads taking frames in order as they free up, so
+ * reading, rendering and compressing of different frames all overlap.
+ * Only assembling the compressed frames into the file happens in order
+ * at the end.  The frames must all be the same size and share a palette
+ * (eg a contour_plot with a fixed range) since both formats are written
+ * with one palette for the whole animation.
+ */
+class animation_renderer {
+public:
+  enum class format { gif, apng };
+
+  static std::string render(
+      std::size_t frame_count,
+      const std::function<indexed_image(std::size_t)>& render_frame,
+      format f,
+      unsigned delay_ms,
+      std::size_t thread_count) {
+    if (frame_count == 0) {
+      throw std::invalid_argument("An animation needs at least one frame");
+    }
+
+    std::vector<std::string> compressed(frame_count);
+    // Everything about each frame but its pixels, to check they match
+    std::vector<indexed_image> headers(frame_count);
+    parallel_for(frame_count, thread_count,
+      [&](std::size_t, std::size_t i) {
+        indexed_image frame = render_frame(i);
+        compressed[i] = f == format::gif ?
+          gif_encoder::compress(frame) :
+          png_encoder::deflate_scanlines(frame, Z_BEST_SPEED);
+        frame.pixels.clear();
+        headers[i] = std::move(frame);
+      });
+
+    const indexed_image& first = headers[0];
+    for (auto& h: headers) {
+      if (h.width != first.width || h.height != first.height ||
+          h.palette != first.palette || h.alpha != first.alpha) {
+        throw std::logic_error(
+          "animation_renderer: every frame must have the same size and palette");
+      }
+    }
+    return f == format::gif ?
+      gif_encoder::encode_animation(first, compressed, delay_ms) :
+      png_encoder::encode_animation(first, compressed, delay_ms);
+  }
+};
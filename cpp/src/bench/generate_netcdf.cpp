@@ -0,0 +1,216 @@
+#include <netcdf>
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace netCDF;
+
+/**
+ * Writes a synthetic file shaped like the sample file, ie a
+ * concentration(time, z, y, x) variable with coordinate variables, but
+ * of any size so that the server can be benchmarked against files much
+ * bigger than the sample.  The values are a plume drifting across the
+ * grid over time, with a good share of exact zeros away from it, which
+ * is roughly what the concentration data looks like.
+ *
+ * Usage: generate_netcdf <output file>
+ *   [--format classic|64bit|netcdf4]    (default netcdf4)
+ *   [--shape <time>,<z>,<y>,<x>]        (default 24,4,400,400)
+ *   [--type double|float|int|short]     (default double, short is packed
+ *                                        with scale_factor/add_offset)
+ *   [--chunks <time>,<z>,<y>,<x>]       (netcdf4 only, default 1,1,y,x)
+ *   [--deflate <level 0-9>] [--shuffle] (netcdf4 only, default none)
+ */
+
+static std::vector<std::size_t> parse_sizes(const std::string& list) {
+  std::vector<std::size_t> result;
+  std::stringstream items(list);
+  std::string item;
+  while (std::getline(items, item, ',')) {
+    result.push_back(std::stoul(item));
+  }
+  if (result.size() != 4) {
+    throw std::invalid_argument("Expected 4 comma separated sizes: " + list);
+  }
+  return result;
+}
+
+static void add_coordinate(
+    NcFile& file, const NcDim& dim, const char* units, double step) {
+  NcVar var = file.addVar(dim.getName(), ncDouble, dim);
+  var.putAtt("units", units);
+  std::vector<double> values(dim.isUnlimited() ? 0 : dim.getSize());
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    values[i] = i * step;
+  }
+  if (!values.empty()) {
+    var.putVar(values.data());
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    printf("Usage: %s <output file> [--format classic|64bit|netcdf4] "
+      "[--shape t,z,y,x] [--type double|float|int|short] "
+      "[--chunks t,z,y,x] [--deflate <level>] [--shuffle]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string format = "netcdf4";
+  std::vector<std::size_t> shape = {24, 4, 400, 400};
+  std::string type = "double";
+  std::vector<std::size_t> chunks;
+  int deflate = 0;
+  bool shuffle = false;
+  try {
+    for (int i = 2; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--format" && i + 1 < argc) {
+        format = argv[++i];
+      }
+      else if (arg == "--shape" && i + 1 < argc) {
+        shape = parse_sizes(argv[++i]);
+      }
+      else if (arg == "--type" && i + 1 < argc) {
+        type = argv[++i];
+      }
+      else if (arg == "--chunks" && i + 1 < argc) {
+        chunks = parse_sizes(argv[++i]);
+      }
+      else if (arg == "--deflate" && i + 1 < argc) {
+        deflate = std::stoi(argv[++i]);
+      }
+      else if (arg == "--shuffle") {
+        shuffle = true;
+      }
+      else {
+        printf("Unrecognized option %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  catch (std::exception& e) {
+    printf("%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+
+  NcFile::FileFormat file_format;
+  if (format == "classic") {
+    file_format = NcFile::classic;
+  }
+  else if (format == "64bit") {
+    file_format = NcFile::classic64;
+  }
+  else if (format == "netcdf4") {
+    file_format = NcFile::nc4;
+  }
+  else {
+    printf("Unrecognized format %s\n", format.c_str());
+    return EXIT_FAILURE;
+  }
+
+  NcType var_type;
+  if (type == "double") {
+    var_type = ncDouble;
+  }
+  else if (type == "float") {
+    var_type = ncFloat;
+  }
+  else if (type == "int") {
+    var_type = ncInt;
+  }
+  else if (type == "short") {
+    var_type = ncShort;
+  }
+  else {
+    printf("Unrecognized type %s\n", type.c_str());
+    return EXIT_FAILURE;
+  }
+  const bool packed = type == "short";
+
+  const std::size_t nt = shape[0], nz = shape[1], ny = shape[2], nx = shape[3];
+  NcFile file(argv[1], NcFile::replace, file_format);
+  file.putAtt("title", "Synthetic concentration for benchmarking");
+
+  NcDim time = file.addDim("time");
+  NcDim z = file.addDim("z", nz);
+  NcDim y = file.addDim("y", ny);
+  NcDim x = file.addDim("x", nx);
+  add_coordinate(file, z, "m", 10);
+  add_coordinate(file, y, "m", 5);
+  add_coordinate(file, x, "m", 5);
+  NcVar time_var = file.addVar("time", ncDouble, time);
+  time_var.putAtt("units", "s");
+
+  NcVar conc = file.addVar("concentration", var_type, {time, z, y, x});
+  // Integers are in micrograms so that they aren't all zero
+  conc.putAtt("units", type == "int" ? "ug/m3" : "kg/m3");
+  const double max_value = 0.05;
+  if (packed) {
+    // Spread the range over the shorts, keeping the lowest for _FillValue
+    conc.putAtt("scale_factor", ncDouble, max_value / 65000);
+    conc.putAtt("add_offset", ncDouble, max_value / 2);
+    conc.putAtt("_FillValue", ncShort, (short)-32768);
+  }
+  double valid_range[] = {0, max_value};
+  conc.putAtt("valid_range", ncDouble, 2, valid_range);
+  if (file_format == NcFile::nc4) {
+    if (chunks.empty()) {
+      chunks = {1, 1, ny, nx};
+    }
+    conc.setChunking(NcVar::nc_CHUNKED, chunks);
+    if (deflate > 0 || shuffle) {
+      conc.setCompression(shuffle, deflate > 0, deflate);
+    }
+  }
+
+  // One (time, z) slice at a time so that any size fits in memory
+  std::mt19937_64 rng(12345);
+  std::uniform_real_distribution<double> noise(0.9, 1.1);
+  std::vector<double> slice(ny * nx);
+  std::vector<char> buffer(ny * nx * var_type.getSize());
+  for (std::size_t t = 0; t < nt; ++t) {
+    double seconds = t * 3600.0;
+    time_var.putVar({t}, {1}, &seconds);
+    // The plume's centre drifts diagonally over the whole run
+    const double cx = nx * (0.2 + 0.6 * t / std::max<std::size_t>(nt, 2));
+    const double cy = ny * (0.2 + 0.6 * t / std::max<std::size_t>(nt, 2));
+    for (std::size_t k = 0; k < nz; ++k) {
+      const double width = std::max(nx, ny) * (0.1 + 0.05 * k);
+      for (std::size_t j = 0; j < ny; ++j) {
+        for (std::size_t i = 0; i < nx; ++i) {
+          double r2 = ((i - cx) * (i - cx) + (j - cy) * (j - cy)) /
+            (width * width);
+          double v = r2 > 4 ? 0 : max_value * std::exp(-r2) * noise(rng);
+          slice[j * nx + i] = std::min(v, max_value);
+        }
+      }
+      for (std::size_t n = 0; n < slice.size(); ++n) {
+        if (type == "double") {
+          ((double*)buffer.data())[n] = slice[n];
+        }
+        else if (type == "float") {
+          ((float*)buffer.data())[n] = slice[n];
+        }
+        else if (type == "int") {
+          ((int*)buffer.data())[n] = std::lround(slice[n] * 1e9);
+        }
+        else {
+          ((short*)buffer.data())[n] =
+            std::lround((slice[n] - max_value / 2) / (max_value / 65000));
+        }
+      }
+      // Through void* as the char* overload would write text
+      conc.putVar({t, k, 0, 0}, {1, 1, ny, nx}, (const void*)buffer.data());
+    }
+  }
+
+  printf("Wrote %s: %s concentration(%zu, %zu, %zu, %zu) as %s\n",
+    argv[1], type.c_str(), nt, nz, ny, nx, format.c_str());
+  return EXIT_SUCCESS;
+}
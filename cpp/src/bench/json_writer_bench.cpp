@@ -0,0 +1,91 @@
+#include "json_writer.hpp"
+#include "read_netcdf.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+/**
+ * Compares the time taken to serialize a (time, z) sized slice of doubles
+ * through the nlohmann json tree (`read_netcdf::to_json(...).dump()`)
+ * against `json_writer`, and verifies both produce identical text, for
+ * the doubles and for floats of every magnitude.
+ *
+ * Usage: json_writer_bench [y_size] [x_size] [iterations]
+ */
+int main(int argc, char *argv[])
+{
+  std::size_t y_size = argc > 1 ? std::stoul(argv[1]) : 400;
+  std::size_t x_size = argc > 2 ? std::stoul(argv[2]) : 400;
+  int iterations = argc > 3 ? std::stoi(argv[3]) : 20;
+
+  // Mostly small positive values with a good share of exact zeros,
+  // which is roughly what the concentration data looks like
+  hyperslab slab;
+  slab.type = NC_DOUBLE;
+  slab.element_size = sizeof(double);
+  slab.shape = {y_size, x_size};
+  slab.data.resize(y_size * x_size * sizeof(double));
+  std::mt19937_64 rng(12345);
+  std::uniform_real_distribution<double> dist(0.0, 0.05);
+  double* values = (double*)slab.data.data();
+  for (std::size_t i = 0; i < y_size * x_size; ++i) {
+    values[i] = (rng() % 3 == 0) ? 0.0 : dist(rng);
+  }
+
+  using clock = std::chrono::steady_clock;
+  auto time_it = [&](auto&& fn) {
+    std::size_t bytes = 0;
+    auto start = clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      bytes += fn().size();
+    }
+    std::chrono::duration<double, std::milli> elapsed = clock::now() - start;
+    return std::make_pair(elapsed.count() / iterations, bytes / iterations);
+  };
+
+  std::string expected = read_netcdf::to_json(slab).dump();
+  std::string actual = json_writer::to_json(slab);
+  if (expected != actual) {
+    printf("FAILED: json_writer output differs from nlohmann dump()\n");
+    return EXIT_FAILURE;
+  }
+
+  // Floats take a different route to their digits in each, and switch
+  // notation at different magnitudes than doubles do
+  hyperslab floats;
+  floats.type = NC_FLOAT;
+  floats.element_size = sizeof(float);
+  std::vector<float> float_values = {
+    0.1f, 1234567.0f, 1e7f, 16777216.0f, 3.4028235e38f, 1e-30f,
+    -999999.9f, 1e15f, 1e16f, 1e17f, 0.0f, -0.0f};
+  std::uniform_real_distribution<double> exponent(-40.0, 38.0);
+  for (int i = 0; i < 100000; ++i) {
+    float_values.push_back(
+      (float)((rng() % 2 ? 1 : -1) * std::pow(10.0, exponent(rng))));
+  }
+  floats.shape = {float_values.size()};
+  floats.data.assign(
+    (const char*)float_values.data(), float_values.size() * sizeof(float));
+  if (read_netcdf::to_json(floats).dump() != json_writer::to_json(floats)) {
+    printf("FAILED: json_writer output differs from nlohmann dump() "
+      "for floats\n");
+    return EXIT_FAILURE;
+  }
+
+  auto [tree_ms, tree_bytes] = time_it([&]() {
+    return read_netcdf::to_json(slab).dump();
+  });
+  auto [writer_ms, writer_bytes] = time_it([&]() {
+    return json_writer::to_json(slab);
+  });
+
+  printf("slice %zux%zu doubles, %d iterations, %zu bytes of json\n",
+    y_size, x_size, iterations, writer_bytes);
+  printf("  nlohmann tree + dump(): %8.2f ms\n", tree_ms);
+  printf("  json_writer:            %8.2f ms\n", writer_ms);
+  printf("  speedup:                %8.2fx\n", tree_ms / writer_ms);
+  (void)tree_bytes;
+  return EXIT_SUCCESS;
+}
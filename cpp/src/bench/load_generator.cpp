@@ -0,0 +1,359 @@
+#include <nlohmann/json.hpp>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Drives a running server with a fixed number of concurrent keep-alive
+ * connections for a fixed time, and reports the throughput and latency
+ * percentiles of each path, eg for sizing hardware or checking that a
+ * change didn't make the endpoints slower under load.
+ * '{time}' and '{z}' in the paths are replaced with random indices along
+ * those dimensions (their sizes are read from /get-info first) so that
+ * the requests are spread over the whole file.
+ *
+ * Usage: load_generator [--host <host>] [--port <port>]
+ *   [--concurrency <connections>] [--duration <seconds>]
+ *   [--header "<name>: <value>"]... [path]...
+ * eg load_generator --concurrency 32 --header "Accept-Encoding: gzip" \
+ *   "/get-data?time_index={time}&z_index={z}"
+ */
+
+using clock_type = std::chrono::steady_clock;
+
+struct options {
+  std::string host = "127.0.0.1";
+  std::string port = "8080";
+  std::size_t concurrency = 8;
+  double duration = 10;
+  std::vector<std::string> headers;
+  std::vector<std::string> paths;
+};
+
+struct sample {
+  std::size_t path;
+  double ms;
+  int status;
+  std::size_t bytes;
+};
+
+/**
+ * A minimal HTTP/1.1 client for one keep-alive connection, just enough
+ * for the responses crow sends (which always have a Content-Length)
+ */
+class connection {
+public:
+  connection(const options& opts): opts(opts) {}
+
+  ~connection() {
+    disconnect();
+  }
+
+  /**
+   * Sends a GET and returns the status code, putting the body in 'body'.
+   * Throws on any connection error, after which the next call reconnects.
+   */
+  int get(const std::string& path, std::string& body) {
+    if (fd < 0) {
+      connect_to_server();
+    }
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " +
+      opts.host + "\r\n";
+    for (auto& h: opts.headers) {
+      request += h + "\r\n";
+    }
+    request += "\r\n";
+    try {
+      send_all(request);
+      return read_response(body);
+    }
+    catch (...) {
+      disconnect();
+      throw;
+    }
+  }
+
+private:
+  const options& opts;
+  int fd = -1;
+  // Bytes received past the end of the previous response
+  std::string pending;
+
+  void connect_to_server() {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    int rc = getaddrinfo(
+      opts.host.c_str(), opts.port.c_str(), &hints, &addresses);
+    if (rc != 0) {
+      throw std::runtime_error(gai_strerror(rc));
+    }
+    for (addrinfo* a = addresses; a != nullptr; a = a->ai_next) {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+        break;
+      }
+      disconnect();
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+      throw std::runtime_error(
+        "Unable to connect to " + opts.host + ":" + opts.port);
+    }
+    pending.clear();
+  }
+
+  void disconnect() {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  void send_all(const std::string& data) {
+    for (std::size_t sent = 0; sent < data.size(); ) {
+      ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        throw std::runtime_error("send failed");
+      }
+      sent += n;
+    }
+  }
+
+  // Appends more bytes from the socket to 'pending', false at the end
+  bool receive() {
+    char buffer[65536];
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n < 0) {
+      throw std::runtime_error("recv failed");
+    }
+    pending.append(buffer, n);
+    return n > 0;
+  }
+
+  int read_response(std::string& body) {
+    std::size_t header_end;
+    while ((header_end = pending.find("\r\n\r\n")) == std::string::npos) {
+      if (!receive()) {
+        throw std::runtime_error("Connection closed before the headers");
+      }
+    }
+    std::string headers = pending.substr(0, header_end + 2);
+    pending.erase(0, header_end + 4);
+
+    int status = std::atoi(headers.c_str() + headers.find(' ') + 1);
+    std::string lower = headers;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    const bool close_after = lower.find("connection: close") != std::string::npos;
+    std::size_t length_at = lower.find("content-length:");
+    if (length_at == std::string::npos) {
+      if (status == 304 || status == 204) {
+        body.clear();
+        return status;
+      }
+      // Without a length the body runs until the server closes
+      while (receive()) {
+      }
+      body = std::move(pending);
+      disconnect();
+      return status;
+    }
+
+    std::size_t length = std::stoull(headers.substr(length_at + 15));
+    while (pending.size() < length) {
+      if (!receive()) {
+        throw std::runtime_error("Connection closed during the body");
+      }
+    }
+    body = pending.substr(0, length);
+    pending.erase(0, length);
+    if (close_after) {
+      disconnect();
+    }
+    return status;
+  }
+};
+
+/**
+ * Returns the size of every dimension of every variable, from /get-info
+ */
+static std::map<std::string, std::size_t> get_dimension_sizes(
+    const options& opts) {
+  connection c(opts);
+  std::string body;
+  int status = c.get("/get-info", body);
+  if (status != 200) {
+    throw std::runtime_error("/get-info returned " + std::to_string(status));
+  }
+  std::map<std::string, std::size_t> sizes;
+  auto info = nlohmann::json::parse(body);
+  for (auto& [name, var]: info["variables"].items()) {
+    if (!var.contains("shape")) {
+      continue;
+    }
+    for (std::size_t d = 0; d < var["dimensions"].size(); ++d) {
+      sizes[var["dimensions"][d].get<std::string>()] =
+        var["shape"][d].get<std::size_t>();
+    }
+  }
+  return sizes;
+}
+
+static std::string substitute(
+    std::string path,
+    const std::map<std::string, std::size_t>& sizes,
+    std::mt19937_64& rng) {
+  for (auto& [name, size]: sizes) {
+    const std::string placeholder = "{" + name + "}";
+    for (std::size_t at; (at = path.find(placeholder)) != std::string::npos; ) {
+      path.replace(at, placeholder.size(),
+        std::to_string(rng() % std::max<std::size_t>(size, 1)));
+    }
+  }
+  return path;
+}
+
+static void report(
+    const char* name, std::vector<sample> samples, double seconds) {
+  if (samples.empty()) {
+    printf("  %-48s no requests\n", name);
+    return;
+  }
+  std::sort(samples.begin(), samples.end(),
+    [](auto& a, auto& b) { return a.ms < b.ms; });
+  std::size_t errors = 0, bytes = 0;
+  for (auto& s: samples) {
+    errors += s.status != 200 && s.status != 304;
+    bytes += s.bytes;
+  }
+  auto percentile = [&](double p) {
+    return samples[std::min(
+      samples.size() - 1, (std::size_t)(p / 100 * samples.size()))].ms;
+  };
+  printf("  %-48s %8zu %7zu %9.1f %8.1f %8.2f %8.2f %8.2f %8.2f\n",
+    name, samples.size(), errors, samples.size() / seconds,
+    bytes / 1e6 / seconds, percentile(50), percentile(90), percentile(99),
+    samples.back().ms);
+}
+
+int main(int argc, char *argv[])
+{
+  options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--host" && i + 1 < argc) {
+      opts.host = argv[++i];
+    }
+    else if (arg == "--port" && i + 1 < argc) {
+      opts.port = argv[++i];
+    }
+    else if (arg == "--concurrency" && i + 1 < argc) {
+      opts.concurrency = std::max(1ul, std::stoul(argv[++i]));
+    }
+    else if (arg == "--duration" && i + 1 < argc) {
+      opts.duration = std::stod(argv[++i]);
+    }
+    else if (arg == "--header" && i + 1 < argc) {
+      opts.headers.push_back(argv[++i]);
+    }
+    else if (arg.rfind("--", 0) == 0) {
+      printf("Unrecognized option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    else {
+      opts.paths.push_back(arg);
+    }
+  }
+  if (opts.paths.empty()) {
+    opts.paths = {
+      "/get-data?time_index={time}&z_index={z}",
+      "/get-image?time_index={time}&z_index={z}",
+    };
+  }
+
+  std::map<std::string, std::size_t> sizes;
+  try {
+    sizes = get_dimension_sizes(opts);
+  }
+  catch (std::exception& e) {
+    printf("Unable to read /get-info: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu connections to %s:%s for %.0f s\n",
+    opts.concurrency, opts.host.c_str(), opts.port.c_str(), opts.duration);
+
+  // Each connection cycles through the paths, starting at a different one
+  std::vector<std::vector<sample>> samples(opts.concurrency);
+  std::atomic<std::size_t> failures{0};
+  const auto deadline = clock_type::now() +
+    std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double>(opts.duration));
+  const auto started = clock_type::now();
+  std::vector<std::thread> threads;
+  for (std::size_t t = 0; t < opts.concurrency; ++t) {
+    threads.emplace_back([&, t]() {
+      connection c(opts);
+      std::mt19937_64 rng(t);
+      std::string body;
+      for (std::size_t n = t; clock_type::now() < deadline; ++n) {
+        std::size_t p = n % opts.paths.size();
+        std::string path = substitute(opts.paths[p], sizes, rng);
+        auto start = clock_type::now();
+        int status = 0;
+        try {
+          status = c.get(path, body);
+        }
+        catch (std::exception&) {
+          failures.fetch_add(1, std::memory_order_relaxed);
+          body.clear();
+        }
+        std::chrono::duration<double, std::milli> ms = clock_type::now() - start;
+        samples[t].push_back({p, ms.count(), status, body.size()});
+      }
+    });
+  }
+  for (auto& t: threads) {
+    t.join();
+  }
+  std::chrono::duration<double> elapsed = clock_type::now() - started;
+
+  printf("  %-48s %8s %7s %9s %8s %8s %8s %8s %8s\n",
+    "path", "requests", "errors", "req/s", "MB/s",
+    "p50 ms", "p90 ms", "p99 ms", "max ms");
+  std::vector<sample> all;
+  for (std::size_t p = 0; p < opts.paths.size(); ++p) {
+    std::vector<sample> for_path;
+    for (auto& thread_samples: samples) {
+      for (auto& s: thread_samples) {
+        if (s.path == p) {
+          for_path.push_back(s);
+        }
+      }
+    }
+    all.insert(all.end(), for_path.begin(), for_path.end());
+    report(opts.paths[p].c_str(), std::move(for_path), elapsed.count());
+  }
+  if (opts.paths.size() > 1) {
+    report("all", std::move(all), elapsed.count());
+  }
+  if (failures > 0) {
+    printf("%zu requests failed to connect or were cut off\n",
+      failures.load());
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+#include "binary_format.hpp"
+#include "classic_reader.hpp"
+#include "contour_renderer.hpp"
+#include "json_writer.hpp"
+#include "read_netcdf.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Times the main steps behind the REST endpoints against a real file,
+ * eg one written by generate_netcdf, one step at a time so that a
+ * regression can be pinned on the step that caused it:
+ *   - schema: read_netcdf::get_catalog (once at startup) and get_info
+ *   - read: a (time, z) slice through read_netcdf and, for classic
+ *     files, classic_reader
+ *   - get_data: read_netcdf::get_data, ie a read plus the json tree,
+ *     which is how /get-data used to produce its response
+ *   - serialize: json_writer, the nlohmann tree, and npy
+ *   - render: the contour plot png of /get-image
+ * Each step reports the mean and the 50th / 99th percentile times.
+ * The slices are picked at random so that the reads aren't all served
+ * from the same few pages of the OS cache.
+ *
+ * Usage: netcdf_api_bench <netCDF file> [--var <variable>] [--iterations <n>]
+ */
+
+using clock_type = std::chrono::steady_clock;
+
+static void measure(
+    const char* name, int iterations, const std::function<std::size_t()>& fn) {
+  std::vector<double> ms;
+  std::size_t bytes = 0;
+  for (int i = 0; i < iterations; ++i) {
+    auto start = clock_type::now();
+    bytes += fn();
+    std::chrono::duration<double, std::milli> elapsed = clock_type::now() - start;
+    ms.push_back(elapsed.count());
+  }
+  std::sort(ms.begin(), ms.end());
+  double total = 0;
+  for (double m: ms) {
+    total += m;
+  }
+  auto percentile = [&](double p) {
+    return ms[std::min(ms.size() - 1, (std::size_t)(p / 100 * ms.size()))];
+  };
+  printf("  %-28s %9.3f ms mean %9.3f p50 %9.3f p99 %10.1f MB/s\n",
+    name, total / iterations, percentile(50), percentile(99),
+    bytes / 1e6 / (total / 1e3));
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    printf("Usage: %s <netCDF file> [--var <variable>] [--iterations <n>]\n",
+      argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char* file_name = argv[1];
+  std::string variable_name = "concentration";
+  int iterations = 20;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--var" && i + 1 < argc) {
+      variable_name = argv[++i];
+    }
+    else if (arg == "--iterations" && i + 1 < argc) {
+      iterations = std::max(1, std::stoi(argv[++i]));
+    }
+    else {
+      printf("Unrecognized option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  read_netcdf reader(file_name);
+  auto classic = classic_reader::open(file_name);
+  auto dims = reader.get_variable_dimensions(variable_name.c_str());
+  if (dims.size() < 3) {
+    printf("%s needs at least 3 dimensions, ie (time, [z,] y, x)\n",
+      variable_name.c_str());
+    return EXIT_FAILURE;
+  }
+  // Every dimension but the last two is fixed, like /get-data does
+  std::mt19937_64 rng(12345);
+  auto random_slice = [&]() {
+    std::vector<uint64_t> indices;
+    for (std::size_t d = 0; d + 2 < dims.size(); ++d) {
+      indices.push_back(rng() % std::max<std::size_t>(dims[d].second, 1));
+    }
+    return indices;
+  };
+  hyperslab slab = reader.read_hyperslab(variable_name.c_str(), random_slice());
+
+  printf("%s: %s", file_name, variable_name.c_str());
+  for (auto& [name, size]: dims) {
+    printf(" %s=%zu", name.c_str(), size);
+  }
+  printf(", slices of %zu bytes, %d iterations\n",
+    slab.data.size(), iterations);
+
+  printf("schema\n");
+  measure("read_netcdf::get_catalog", iterations, [&]() {
+    return reader.get_catalog().get_info_body().size();
+  });
+  measure("read_netcdf::get_info", iterations, [&]() {
+    return reader.get_info().dump().size();
+  });
+
+  printf("read\n");
+  measure("read_netcdf::read_hyperslab", iterations, [&]() {
+    return reader.read_hyperslab(
+      variable_name.c_str(), random_slice()).data.size();
+  });
+  if (classic) {
+    measure("classic_reader::read_hyperslab", iterations, [&]() {
+      return classic->read_hyperslab(
+        variable_name.c_str(), random_slice()).data.size();
+    });
+  }
+  measure("read_netcdf::get_data + dump", iterations, [&]() {
+    return reader.get_data(variable_name.c_str(), random_slice()).dump().size();
+  });
+
+  printf("serialize\n");
+  measure("json_writer::to_json", iterations, [&]() {
+    return json_writer::to_json(slab).size();
+  });
+  measure("read_netcdf::to_json + dump", iterations, [&]() {
+    return read_netcdf::to_json(slab).dump().size();
+  });
+  measure("binary_format::to_npy", iterations, [&]() {
+    return binary_format::to_npy(slab).size();
+  });
+
+  printf("render\n");
+  contour_plot plot;
+  const auto& y_dim = dims[dims.size() - 2];
+  const auto& x_dim = dims.back();
+  for (std::size_t i = 0; i < x_dim.second; ++i) {
+    plot.x.push_back(i);
+  }
+  for (std::size_t i = 0; i < y_dim.second; ++i) {
+    plot.y.push_back(i);
+  }
+  plot.values = slab.to_doubles();
+  plot.title = variable_name;
+  measure("contour_renderer::render_png", iterations, [&]() {
+    return contour_renderer::render_png(plot).size();
+  });
+  return EXIT_SUCCESS;
+}
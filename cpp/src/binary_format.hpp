@@ -0,0 +1,223 @@
+#pragma once
+
+#include "hyperslab.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Helpers for serving a hyperslab as binary instead of json.  Two
+ * formats are supported:
+ *   - "raw": the bytes of the hyperslab exactly as netCDF handed them to
+ *     us, with the shape and dtype described in response headers, as
+ *     well as the packing attributes needed to turn them into the values
+ *     they mean (see packing_fields).
+ *   - "npy": the numpy .npy v1.0 format, so that clients can simply call
+ *     numpy.load() on the response body.  The .npy header can't carry
+ *     the packing attributes, so packed values are unpacked, like json.
+ * See https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html
+ * Several hyperslabs can also be put in one body, see append_batch_part
+ * and append_multipart_part.
+ */
+namespace binary_format {
+
+/**
+ * Returns the numpy dtype string (eg "<f8") for the specified netCDF type.
+ * netCDF always returns values in the host byte order, so that is
+ * what we report here.
+ */
+inline std::string numpy_dtype(nc_type type) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  const std::string order = "<";
+#else
+  const std::string order = ">";
+#endif
+  switch (type) {
+    case NC_BYTE:   return "|i1";
+    case NC_CHAR:   return "|S1";
+    case NC_UBYTE:  return "|u1";
+    case NC_SHORT:  return order + "i2";
+    case NC_USHORT: return order + "u2";
+    case NC_INT:    return order + "i4";
+    case NC_UINT:   return order + "u4";
+    case NC_INT64:  return order + "i8";
+    case NC_UINT64: return order + "u8";
+    case NC_FLOAT:  return order + "f4";
+    case NC_DOUBLE: return order + "f8";
+    default:
+      throw std::invalid_argument(
+        "Binary output is not supported for netCDF type " +
+        std::to_string(type));
+  }
+}
+
+/**
+ * Returns the shape formatted as a comma separated list, eg "100,120",
+ * which is what we send in the X-Shape header for the raw format.
+ * A scalar is represented by an empty string.
+ */
+inline std::string shape_header(const hyperslab& slab) {
+  std::string result;
+  for (std::size_t i = 0; i < slab.shape.size(); ++i) {
+    if (i > 0) {
+      result += ",";
+    }
+    result += std::to_string(slab.shape[i]);
+  }
+  return result;
+}
+
+/**
+ * Returns what a client needs to turn the raw values of the hyperslab
+ * into the values they mean, as {name, number} pairs: "scale_factor"
+ * and "add_offset" when they are packed (value = raw * scale_factor +
+ * add_offset), and "fill_value" when raw values equal to it are
+ * missing.  Empty when the raw values are simply the values.
+ */
+inline std::vector<std::pair<std::string, std::string>> packing_fields(
+    const hyperslab& slab) {
+  std::vector<std::pair<std::string, std::string>> result;
+  auto number = [](double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", v);
+    return std::string(buf);
+  };
+  if (slab.packing.packed) {
+    result.emplace_back("scale_factor", number(slab.packing.scale_factor));
+    result.emplace_back("add_offset", number(slab.packing.add_offset));
+  }
+  if (!slab.packing.fill_value.empty() && is_numeric_nc_type(slab.type)) {
+    visit_nc_type(slab.type, [&](auto tag) {
+      using T = typename decltype(tag)::type;
+      T fill;
+      if (slab.packing.get_fill_value(fill)) {
+        // 64 bit integers don't survive a trip through a double
+        result.emplace_back("fill_value", std::is_integral_v<T> ?
+          std::to_string(fill) : number(fill));
+      }
+    });
+  }
+  return result;
+}
+
+/**
+ * Returns packing_fields as the response headers of the raw format,
+ * X-Scale-Factor, X-Add-Offset and X-Fill-Value
+ */
+inline std::vector<std::pair<std::string, std::string>> packing_headers(
+    const hyperslab& slab) {
+  auto result = packing_fields(slab);
+  for (auto& [name, value]: result) {
+    name = name == "scale_factor" ? "X-Scale-Factor" :
+      name == "add_offset" ? "X-Add-Offset" : "X-Fill-Value";
+  }
+  return result;
+}
+
+/**
+ * Returns the .npy v1.0 preamble (magic, version, header length and
+ * header dictionary) describing the hyperslab.  The data itself
+ * immediately follows the preamble in the file.
+ */
+inline std::string npy_preamble(const hyperslab& slab) {
+  // Python tuple syntax requires a trailing comma for a single element
+  std::string shape = "(";
+  for (std::size_t i = 0; i < slab.shape.size(); ++i) {
+    shape += std::to_string(slab.shape[i]);
+    shape += (slab.shape.size() == 1 || i + 1 < slab.shape.size())
+      ? "," : "";
+    if (i + 1 < slab.shape.size()) {
+      shape += " ";
+    }
+  }
+  shape += ")";
+
+  std::string header =
+    "{'descr': '" + numpy_dtype(slab.type) + "', " +
+    "'fortran_order': False, " +
+    "'shape': " + shape + ", }";
+
+  // The total preamble length must be a multiple of 64 bytes, padded
+  // with spaces and terminated by a newline.
+  const std::size_t fixed_length = 10; // magic(6) + version(2) + length(2)
+  std::size_t total = fixed_length + header.size() + 1;
+  std::size_t padding = (64 - total % 64) % 64;
+  header.append(padding, ' ');
+  header += '\n';
+
+  std::uint16_t header_length = header.size();
+  std::string preamble = "\x93NUMPY";
+  preamble += '\x01';
+  preamble += '\x00';
+  // The header length is always little endian
+  preamble += (char)(header_length & 0xff);
+  preamble += (char)(header_length >> 8);
+  preamble += header;
+  return preamble;
+}
+
+/**
+ * Returns the complete contents of a .npy file for the hyperslab
+ */
+inline std::string to_npy(const hyperslab& slab) {
+  if (!packing_fields(slab).empty()) {
+    // Unpacked to doubles with missing values as NaN
+    std::vector<double> values = slab.to_doubles();
+    hyperslab unpacked;
+    unpacked.type = NC_DOUBLE;
+    unpacked.element_size = sizeof(double);
+    unpacked.shape = slab.shape;
+    unpacked.data.assign(
+      (const char*)values.data(), values.size() * sizeof(double));
+    return to_npy(unpacked);
+  }
+  std::string result = npy_preamble(slab);
+  result.reserve(result.size() + slab.data.size());
+  result += slab.data;
+  return result;
+}
+
+/**
+ * Appends one part of a length-prefixed batch: the length of 'header'
+ * as a 4 byte little endian integer, 'header' itself (json describing
+ * the part, including how many bytes of data follow), then 'data'.
+ */
+inline void append_batch_part(
+    std::string& body, const std::string& header, const std::string& data) {
+  const std::uint32_t length = header.size();
+  for (int shift = 0; shift < 32; shift += 8) {
+    body += (char)((length >> shift) & 0xff);
+  }
+  body += header;
+  body += data;
+}
+
+/**
+ * Appends one part of a multipart/mixed body (RFC 2046) with the
+ * specified headers.  The closing delimiter is appended separately,
+ * see end_multipart.
+ */
+inline void append_multipart_part(
+    std::string& body,
+    const std::string& boundary,
+    const std::vector<std::pair<std::string, std::string>>& headers,
+    const std::string& data) {
+  body += "--" + boundary + "\r\n";
+  for (auto& [name, value]: headers) {
+    body += name + ": " + value + "\r\n";
+  }
+  body += "Content-Length: " + std::to_string(data.size()) + "\r\n\r\n";
+  body += data;
+  body += "\r\n";
+}
+
+inline void end_multipart(std::string& body, const std::string& boundary) {
+  body += "--" + boundary + "--\r\n";
+}
+
+}
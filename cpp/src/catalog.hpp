@@ -0,0 +1,186 @@
+#pragma once
+
+#include "nc_types.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+/**
+ * The file's schema: its dimensions, variables and attributes.
+ * This is read once at startup (see read_netcdf::get_catalog) and then
+ * shared read-only by every thread, so looking up a dimension or
+ * variable is a hash lookup rather than a call into the netCDF library,
+ * and /get-info is served from a body serialized up front.
+ * The file doesn't change while the server runs, so neither does this,
+ * which also goes for the size of the unlimited dimension.
+ */
+class catalog {
+public:
+  struct dimension {
+    std::string name;
+    std::size_t size;
+    bool unlimited;
+  };
+
+  struct attribute {
+    std::string name;
+    // A single value, or a list when the attribute has several
+    json value;
+  };
+
+  struct variable {
+    std::string name;
+    nc_type type;
+    // Indices into the catalog's dimensions
+    std::vector<std::size_t> dimensions;
+    // The chunk size along each dimension, or empty when the variable
+    // is stored contiguously (which is always the case for classic files)
+    std::vector<std::size_t> chunking;
+    std::vector<attribute> attributes;
+    // The filters the chunks are compressed with, if any
+    bool shuffle = false;
+    int deflate_level = 0;
+  };
+
+  catalog(
+      std::vector<dimension> dimensions,
+      std::vector<variable> variables,
+      std::vector<attribute> attributes)
+    : dimensions(std::move(dimensions)),
+      variables(std::move(variables)),
+      attributes(std::move(attributes))
+  {
+    for (std::size_t i = 0; i < this->dimensions.size(); ++i) {
+      dimension_index[this->dimensions[i].name] = i;
+    }
+    for (std::size_t i = 0; i < this->variables.size(); ++i) {
+      variable_index[this->variables[i].name] = i;
+    }
+    info = get_info().dump();
+  }
+
+  const std::vector<dimension>& get_dimensions() const {
+    return dimensions;
+  }
+
+  const std::vector<variable>& get_variables() const {
+    return variables;
+  }
+
+  const std::vector<attribute>& get_attributes() const {
+    return attributes;
+  }
+
+  /**
+   * Returns the variable or throws invalid_argument if there's no such
+   * variable
+   */
+  const variable& get_variable(const std::string& variable_name) const {
+    auto it = variable_index.find(variable_name);
+    if (it == variable_index.end()) {
+      throw std::invalid_argument(
+        "Variable name '" + variable_name + "': does not exist");
+    }
+    return variables[it->second];
+  }
+
+  /**
+   * Same contract as read_netcdf::get_variable_dimensions
+   */
+  std::vector<std::pair<std::string, std::size_t>> get_variable_dimensions(
+      const std::string& variable_name) const {
+    std::vector<std::pair<std::string, std::size_t>> result;
+    for (auto d: get_variable(variable_name).dimensions) {
+      result.emplace_back(dimensions[d].name, dimensions[d].size);
+    }
+    return result;
+  }
+
+  /**
+   * Same contract as read_netcdf::validate_dimension_index
+   */
+  void validate_dimension_index(
+      const std::string& dimension_name,
+      std::size_t attempting_index) const {
+    auto it = dimension_index.find(dimension_name);
+    if (it == dimension_index.end()) {
+      throw std::invalid_argument(
+        "No such dimension '" + dimension_name + "'");
+    }
+    const std::size_t size = dimensions[it->second].size;
+    if (attempting_index >= size) {
+      throw std::invalid_argument(
+        "Dimension '" + dimension_name +
+        " has size " + std::to_string(size) +
+        " which means your attempted index " +
+        std::to_string(attempting_index) + " is invalid");
+    }
+  }
+
+  /**
+   * Returns the body of /get-info, serialized once up front
+   */
+  const std::string& get_info_body() const {
+    return info;
+  }
+
+  /**
+   * Returns general information about dimensions, variables and
+   * attributes formatted as json
+   */
+  json get_info() const {
+    auto dims = json::object();
+    for (auto& d: dimensions) {
+      dims[d.name] = d.unlimited ? json("<unlimited>") : json(d.size);
+    }
+
+    auto vars = json::object();
+    for (auto& v: variables) {
+      auto names = json::array();
+      auto shape = json::array();
+      for (auto d: v.dimensions) {
+        names.push_back(dimensions[d].name);
+        shape.push_back(dimensions[d].size);
+      }
+      vars[v.name] = {
+        {"dimensions", names},
+        {"attributes", get_info(v.attributes)},
+        {"type", nc_type_name(v.type)},
+        {"shape", shape},
+        {"chunking", v.chunking.empty() ? json(nullptr) : json(v.chunking)},
+        {"compression", v.deflate_level == 0 && !v.shuffle ? json(nullptr) :
+          json{{"deflate_level", v.deflate_level}, {"shuffle", v.shuffle}}},
+      };
+    }
+
+    return {
+      {"dimensions", dims},
+      {"variables", vars},
+      {"attributes", get_info(attributes)},
+    };
+  }
+
+private:
+  std::vector<dimension> dimensions;
+  std::vector<variable> variables;
+  std::vector<attribute> attributes;
+  std::unordered_map<std::string, std::size_t> dimension_index;
+  std::unordered_map<std::string, std::size_t> variable_index;
+  std::string info;
+
+  static json get_info(const std::vector<attribute>& attributes) {
+    auto result = json::object();
+    for (auto& a: attributes) {
+      result[a.name] = a.value;
+    }
+    return result;
+  }
+};
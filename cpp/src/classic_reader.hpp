@@ -0,0 +1,700 @@
+#pragma once
+
+#include "hyperslab.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * A reader for netCDF classic (CDF-1), 64-bit offset (CDF-2) and 64-bit
+ * data (CDF-5) files that doesn't go through the netCDF library at all.
+ * The header is parsed once and the values are then read with pread,
+ * after which the reader is immutable, so a single instance can be
+ * shared by every thread without any locking and without each thread
+ * opening the file.
+ * NOTE: the file isn't memory-mapped, even though that would save a
+ *   copy, because files are routinely truncated or rewritten in place
+ *   (eg by a model rerun) while they're served, and reading a mapping
+ *   past the new end of the file raises SIGBUS, which kills the whole
+ *   server.  With pread it's a short read, which read_hyperslab throws
+ *   as an error for the request, until the file is reloaded.
+ * (netCDF-4/HDF5 files have no such simple layout and keep using
+ * read_netcdf with one NcFile per thread.)
+ * The format is described at
+ * https://docs.unidata.ucar.edu/netcdf-c/current/file_format_specifications.html
+ */
+class classic_reader {
+public:
+  struct dimension {
+    std::string name;
+    std::size_t size;
+    bool unlimited;
+  };
+
+  struct attribute {
+    std::string name;
+    nc_type type;
+    std::size_t length;
+    // The values in host byte order
+    std::string values;
+  };
+
+  struct variable {
+    std::string name;
+    std::vector<std::size_t> dimids;
+    std::vector<attribute> attributes;
+    nc_type type;
+    std::size_t element_size;
+    std::uint64_t begin;
+    bool is_record;
+    // Resolved from 'attributes' when the header is parsed
+    packing_attributes packing;
+  };
+
+  /**
+   * Returns a reader for the file, or nullptr if the file isn't in one
+   * of the classic formats.  Throws if the file looks like a classic
+   * file but can't be parsed.
+   */
+  static std::unique_ptr<classic_reader> open(const char* path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error(
+        std::string("Unable to open ") + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 4) {
+      ::close(fd);
+      return nullptr;
+    }
+    char magic[4];
+    if (pread(fd, magic, 4, 0) != 4 ||
+        memcmp(magic, "CDF", 3) != 0 ||
+        (magic[3] != 1 && magic[3] != 2 && magic[3] != 5)) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    // We mostly read whole slices sequentially
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Takes over the descriptor
+    return std::unique_ptr<classic_reader>(
+      new classic_reader(fd, st.st_size));
+  }
+
+  ~classic_reader() {
+    ::close(fd);
+  }
+
+  classic_reader(const classic_reader&) = delete;
+  classic_reader& operator=(const classic_reader&) = delete;
+
+  const std::vector<dimension>& get_dimensions() const {
+    return dimensions;
+  }
+
+  const std::vector<variable>& get_variables() const {
+    return variables;
+  }
+
+  std::size_t get_record_count() const {
+    return numrecs;
+  }
+
+  /**
+   * Same contract as read_netcdf::read_hyperslab, reading the variable
+   * with its first dimensions fixed to 'prefix_indices'.
+   */
+  hyperslab read_hyperslab(
+      const char* variable_name,
+      const std::vector<uint64_t>& prefix_indices) const {
+    const variable& var = get_variable(variable_name);
+    if (!is_numeric_nc_type(var.type)) {
+      throw std::invalid_argument(
+        std::string("Variable name '") + variable_name +
+        "': is not a numeric variable");
+    }
+    if (prefix_indices.size() > var.dimids.size()) {
+      throw std::invalid_argument(
+        std::string("Variable name '") + variable_name + "': has " +
+        std::to_string(var.dimids.size()) + " dimensions " +
+        "but you've specifed more indexes (" +
+        std::to_string(prefix_indices.size()) + ")");
+    }
+
+    std::vector<std::size_t> start(
+      prefix_indices.begin(), prefix_indices.end());
+    std::vector<std::size_t> count(prefix_indices.size(), 1);
+    std::vector<std::size_t> shape;
+    for (std::size_t i = prefix_indices.size(); i < var.dimids.size(); ++i) {
+      start.push_back(0);
+      count.push_back(get_dimension_size(var, i));
+      shape.push_back(count.back());
+    }
+    for (std::size_t i = 0; i < prefix_indices.size(); ++i) {
+      if (start[i] >= get_dimension_size(var, i)) {
+        throw std::invalid_argument(
+          std::string("Variable name '") + variable_name + "': index " +
+          std::to_string(start[i]) + " is out of range for dimension '" +
+          dimensions[var.dimids[i]].name + "'");
+      }
+    }
+
+    hyperslab slab = read(var, start, count,
+      std::vector<std::size_t>(start.size(), 1));
+    slab.shape = shape;
+    return slab;
+  }
+
+  /**
+   * Same contract as read_netcdf::read_hyperslab with a hyperslab_query
+   */
+  hyperslab read_hyperslab(
+      const char* variable_name,
+      hyperslab_query query) const {
+    const variable& var = get_variable(variable_name);
+    if (!is_numeric_nc_type(var.type)) {
+      throw std::invalid_argument(
+        std::string("Variable name '") + variable_name +
+        "': is not a numeric variable");
+    }
+    std::vector<std::size_t> dim_sizes;
+    for (std::size_t i = 0; i < var.dimids.size(); ++i) {
+      dim_sizes.push_back(get_dimension_size(var, i));
+    }
+    query.resolve(variable_name, dim_sizes,
+      [&](std::size_t d, std::size_t index) {
+        validate_dimension_index(
+          dimensions[var.dimids[d]].name.c_str(), index);
+      });
+    return read(var, query.start, query.count, query.stride);
+  }
+
+  /**
+   * Same contract as read_netcdf::validate_dimension_index
+   */
+  void validate_dimension_index(
+      const char* dimension_name,
+      std::size_t attempting_index
+  ) const {
+    for (std::size_t i = 0; i < dimensions.size(); ++i) {
+      if (dimensions[i].name == dimension_name) {
+        std::size_t dim_size = get_dimension_size(i);
+        if (attempting_index >= dim_size) {
+          throw std::invalid_argument(
+            std::string("Dimension '") + dimension_name +
+            " has size " + std::to_string(dim_size) +
+            " which means your attempted index " +
+            std::to_string(attempting_index) + " is invalid");
+        }
+        return;
+      }
+    }
+    throw std::invalid_argument(
+      std::string("No such dimension '") + dimension_name + "'");
+  }
+
+  const variable& get_variable(const char* variable_name) const {
+    auto it = variable_index.find(variable_name);
+    if (it == variable_index.end()) {
+      throw std::invalid_argument(
+        std::string("Variable name '") + variable_name + "': does not exist");
+    }
+    return variables[it->second];
+  }
+
+  /**
+   * Same contract as read_netcdf::get_variable_dimensions
+   */
+  std::vector<std::pair<std::string, std::size_t>> get_variable_dimensions(
+      const char* variable_name) const {
+    const variable& var = get_variable(variable_name);
+    std::vector<std::pair<std::string, std::size_t>> result;
+    for (std::size_t i = 0; i < var.dimids.size(); ++i) {
+      result.emplace_back(
+        dimensions[var.dimids[i]].name, get_dimension_size(var, i));
+    }
+    return result;
+  }
+
+  std::size_t get_dimension_size(std::size_t dimid) const {
+    return dimensions[dimid].unlimited ? numrecs : dimensions[dimid].size;
+  }
+
+  /**
+   * Returns the size of the i'th dimension of the variable
+   */
+  std::size_t get_dimension_size(const variable& var, std::size_t i) const {
+    return get_dimension_size(var.dimids[i]);
+  }
+
+  /**
+   * Reads count[i] values along each dimension i of the variable, starting
+   * at start[i] and stepping by stride[i], into a hyperslab whose shape is
+   * 'count'.  The caller is responsible for validating the ranges.
+   */
+  hyperslab read(
+      const variable& var,
+      const std::vector<std::size_t>& start,
+      const std::vector<std::size_t>& count,
+      const std::vector<std::size_t>& stride) const {
+    hyperslab slab;
+    slab.type = var.type;
+    slab.element_size = var.element_size;
+    slab.shape = count;
+    slab.packing = var.packing;
+
+    std::size_t total = 1;
+    for (auto c: count) {
+      total *= c;
+    }
+    slab.data.resize(total * var.element_size);
+    if (total == 0) {
+      return slab;
+    }
+
+    const std::size_t dims = var.dimids.size();
+    const std::size_t esize = var.element_size;
+
+    // Scalar variables are just a single value at 'begin'
+    if (dims == 0) {
+      read_swapped(slab.data.data(), var.begin, 1, esize, esize, var.name);
+      return slab;
+    }
+
+    // Byte strides of each dimension within the file.  For record
+    // variables the first dimension steps a whole record at a time.
+    std::vector<std::uint64_t> file_strides(dims);
+    std::uint64_t s = esize;
+    for (std::size_t d = dims; d-- > 0; ) {
+      if (d == 0 && var.is_record) {
+        file_strides[d] = recsize;
+      }
+      else {
+        file_strides[d] = s;
+        s *= get_dimension_size(var, d);
+      }
+    }
+
+    // Walk every combination of the outer indices like an odometer and
+    // copy one run along the last dimension each time.
+    const std::size_t run = count[dims - 1];
+    const std::uint64_t run_stride = file_strides[dims - 1] * stride[dims - 1];
+    std::vector<std::size_t> index(dims, 0);
+    char* out = slab.data.data();
+    for (std::size_t copied = 0; copied < total; copied += run) {
+      std::uint64_t offset = var.begin;
+      for (std::size_t d = 0; d < dims; ++d) {
+        offset += (start[d] + index[d] * stride[d]) * file_strides[d];
+      }
+      std::uint64_t last = offset + (run - 1) * run_stride + esize;
+      if (last > size) {
+        throw std::runtime_error(
+          "classic_reader: read past the end of the file for '" +
+          var.name + "', the file may be truncated");
+      }
+      read_swapped(out, offset, run, esize, run_stride, var.name);
+      out += run * esize;
+
+      for (std::size_t d = dims - 1; d-- > 0; ) {
+        if (++index[d] < count[d]) {
+          break;
+        }
+        index[d] = 0;
+      }
+    }
+    return slab;
+  }
+
+private:
+  int fd;
+  // The size of the file when it was opened
+  std::uint64_t size;
+  int version;
+  std::size_t numrecs;
+  std::uint64_t recsize = 0;
+  std::vector<dimension> dimensions;
+  std::vector<attribute> attributes;
+  std::vector<variable> variables;
+  std::unordered_map<std::string, std::size_t> variable_index;
+
+  // Most strided runs are read in one go and gathered, unless that
+  // reads more than this much that isn't needed
+  static constexpr std::uint64_t max_gather_gap_bytes = 1024 * 1024;
+
+  classic_reader(int fd, std::uint64_t size)
+    : fd(fd), size(size)
+  {
+    try {
+      // The header is usually a few KB but its size isn't known until
+      // it's parsed, so this starts small and reads more as needed
+      for (std::uint64_t bytes = std::min<std::uint64_t>(size, 64 * 1024); ;
+           bytes = std::min<std::uint64_t>(size, bytes * 4)) {
+        header.resize(bytes);
+        read_exactly(header.data(), bytes, 0, "the header");
+        try {
+          parse_header();
+          break;
+        }
+        catch (header_needs_more&) {
+          reset_header();
+        }
+      }
+      header = std::string();
+    }
+    catch (...) {
+      ::close(fd);
+      throw;
+    }
+  }
+
+  /**
+   * Reads 'n' values of 'esize' bytes which are 'stride' bytes apart in
+   * the file from 'offset' to consecutive values in 'dst', converting
+   * from the file's big endian order to the host's.
+   * Throws when the file is shorter than it was, see the class.
+   */
+  void read_swapped(
+      char* dst, std::uint64_t offset,
+      std::size_t n, std::size_t esize, std::uint64_t stride,
+      const std::string& name) const {
+    if (stride == esize) {
+      read_exactly(dst, n * esize, offset, name);
+    }
+    else if ((stride - esize) * (n - 1) <= max_gather_gap_bytes) {
+      std::string span((n - 1) * stride + esize, '\0');
+      read_exactly(span.data(), span.size(), offset, name);
+      for (std::size_t i = 0; i < n; ++i) {
+        memcpy(dst + i * esize, span.data() + i * stride, esize);
+      }
+    }
+    else {
+      for (std::size_t i = 0; i < n; ++i) {
+        read_exactly(dst + i * esize, esize, offset + i * stride, name);
+      }
+    }
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    if (esize > 1) {
+      swap_in_place(dst, n, esize);
+    }
+#endif
+  }
+
+  void read_exactly(
+      char* dst, std::size_t bytes, std::uint64_t offset,
+      const std::string& name) const {
+    while (bytes > 0) {
+      ssize_t n = pread(fd, dst, bytes, offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        throw std::runtime_error(
+          "classic_reader: unable to read " + name + ": " + strerror(errno));
+      }
+      if (n == 0) {
+        throw std::runtime_error(
+          "classic_reader: read past the end of the file for " + name +
+          ", the file may have been truncated");
+      }
+      dst += n;
+      bytes -= n;
+      offset += n;
+    }
+  }
+
+  /**
+   * Copies 'n' values of 'esize' bytes which are 'stride' bytes apart in
+   * 'src' to consecutive values in 'dst', converting from the file's big
+   * endian order to the host's.
+   * The loops are deliberately simple so that the compiler vectorizes the
+   * byte swap (pshufb on x86) for the common contiguous case.
+   */
+  static void copy_swapped(
+      char* dst, const std::uint8_t* src,
+      std::size_t n, std::size_t esize, std::uint64_t stride) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const bool swap = false;
+#else
+    const bool swap = esize > 1;
+#endif
+    if (stride == esize) {
+      memcpy(dst, src, n * esize);
+      if (swap) {
+        swap_in_place(dst, n, esize);
+      }
+      return;
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+      memcpy(dst + i * esize, src + i * stride, esize);
+    }
+    if (swap) {
+      swap_in_place(dst, n, esize);
+    }
+  }
+
+  static void swap_in_place(char* data, std::size_t n, std::size_t esize) {
+    switch (esize) {
+      case 2:
+      {
+        std::uint16_t* p = (std::uint16_t*)data;
+        for (std::size_t i = 0; i < n; ++i) {
+          p[i] = __builtin_bswap16(p[i]);
+        }
+        break;
+      }
+      case 4:
+      {
+        std::uint32_t* p = (std::uint32_t*)data;
+        for (std::size_t i = 0; i < n; ++i) {
+          p[i] = __builtin_bswap32(p[i]);
+        }
+        break;
+      }
+      case 8:
+      {
+        std::uint64_t* p = (std::uint64_t*)data;
+        for (std::size_t i = 0; i < n; ++i) {
+          p[i] = __builtin_bswap64(p[i]);
+        }
+        break;
+      }
+    }
+  }
+
+  static std::size_t type_size(nc_type type) {
+    switch (type) {
+      case NC_BYTE:
+      case NC_CHAR:
+      case NC_UBYTE:
+        return 1;
+      case NC_SHORT:
+      case NC_USHORT:
+        return 2;
+      case NC_INT:
+      case NC_UINT:
+      case NC_FLOAT:
+        return 4;
+      case NC_DOUBLE:
+      case NC_INT64:
+      case NC_UINT64:
+        return 8;
+      default:
+        throw std::runtime_error(
+          "classic_reader: unexpected type " + std::to_string(type));
+    }
+  }
+
+  // The header is parsed with a simple cursor over the start of the
+  // file read into 'header', which is let go once it's parsed
+
+  std::string header;
+  std::size_t pos = 0;
+
+  // Thrown when the header goes on past the part of the file read
+  struct header_needs_more {};
+
+  void require(std::size_t n) const {
+    if (pos + n > header.size()) {
+      if (header.size() < size) {
+        throw header_needs_more{};
+      }
+      throw std::runtime_error("classic_reader: truncated header");
+    }
+  }
+
+  void reset_header() {
+    pos = 0;
+    recsize = 0;
+    dimensions.clear();
+    attributes.clear();
+    variables.clear();
+    variable_index.clear();
+  }
+
+  const std::uint8_t* at_pos() const {
+    return (const std::uint8_t*)header.data() + pos;
+  }
+
+  std::uint32_t read_u32() {
+    require(4);
+    std::uint32_t v;
+    memcpy(&v, at_pos(), 4);
+    pos += 4;
+    return __builtin_bswap32(v);
+  }
+
+  std::uint64_t read_u64() {
+    require(8);
+    std::uint64_t v;
+    memcpy(&v, at_pos(), 8);
+    pos += 8;
+    return __builtin_bswap64(v);
+  }
+
+  // NON_NEG values are 8 bytes in CDF-5 and 4 bytes otherwise
+  std::uint64_t read_non_neg() {
+    return version == 5 ? read_u64() : read_u32();
+  }
+
+  // OFFSET values are 4 bytes only in CDF-1
+  std::uint64_t read_offset() {
+    return version == 1 ? read_u32() : read_u64();
+  }
+
+  static std::size_t padded(std::size_t n) {
+    return (n + 3) & ~(std::size_t)3;
+  }
+
+  std::string read_name() {
+    std::size_t length = read_non_neg();
+    require(padded(length));
+    std::string name((const char*)at_pos(), length);
+    pos += padded(length);
+    return name;
+  }
+
+  /**
+   * Reads a list header, returning the number of elements, after checking
+   * the tag matches (or the list is ABSENT)
+   */
+  std::size_t read_list_header(std::uint32_t expected_tag) {
+    std::uint32_t tag = read_u32();
+    std::size_t count = read_non_neg();
+    if (tag == 0 && count == 0) {
+      return 0;
+    }
+    if (tag != expected_tag) {
+      throw std::runtime_error("classic_reader: malformed header");
+    }
+    return count;
+  }
+
+  /**
+   * Same as read_netcdf::get_packing, from the attributes in the header
+   */
+  static packing_attributes get_packing(const variable& v) {
+    packing_attributes packing;
+    bool has_scale = false;
+    bool has_offset = false;
+    for (auto& a: v.attributes) {
+      bool number = a.length >= 1 && is_numeric_nc_type(a.type);
+      if (a.name == "scale_factor" && number) {
+        packing.scale_factor = first_value_as_double(a.type, a.values.data());
+        has_scale = true;
+      }
+      else if (a.name == "add_offset" && number) {
+        packing.add_offset = first_value_as_double(a.type, a.values.data());
+        has_offset = true;
+      }
+      else if (a.name == "_FillValue" && a.type == v.type && a.length == 1) {
+        packing.fill_value = a.values;
+      }
+    }
+    packing.packed = has_scale || has_offset;
+    return packing;
+  }
+
+  std::vector<attribute> read_attributes() {
+    const std::uint32_t NC_ATTRIBUTE = 0x0C;
+    std::vector<attribute> result(read_list_header(NC_ATTRIBUTE));
+    for (auto& a: result) {
+      a.name = read_name();
+      a.type = read_u32();
+      a.length = read_non_neg();
+      std::size_t esize = type_size(a.type);
+      std::size_t bytes = a.length * esize;
+      require(padded(bytes));
+      a.values.resize(bytes);
+      copy_swapped(a.values.data(), at_pos(), a.length, esize, esize);
+      pos += padded(bytes);
+    }
+    return result;
+  }
+
+  void parse_header() {
+    version = header[3];
+    pos = 4;
+    std::uint64_t records = read_non_neg();
+
+    const std::uint32_t NC_DIMENSION = 0x0A;
+    dimensions.resize(read_list_header(NC_DIMENSION));
+    for (auto& d: dimensions) {
+      d.name = read_name();
+      d.size = read_non_neg();
+      d.unlimited = d.size == 0;
+    }
+
+    attributes = read_attributes();
+
+    const std::uint32_t NC_VARIABLE = 0x0B;
+    variables.resize(read_list_header(NC_VARIABLE));
+    std::size_t record_variables = 0;
+    std::uint64_t single_record_size = 0;
+    for (std::size_t i = 0; i < variables.size(); ++i) {
+      variable& v = variables[i];
+      v.name = read_name();
+      v.dimids.resize(read_non_neg());
+      for (auto& id: v.dimids) {
+        id = read_non_neg();
+        if (id >= dimensions.size()) {
+          throw std::runtime_error(
+            "classic_reader: bad dimension id for '" + v.name + "'");
+        }
+      }
+      v.attributes = read_attributes();
+      v.type = read_u32();
+      v.element_size = type_size(v.type);
+      std::uint64_t vsize = read_non_neg();
+      v.begin = read_offset();
+      v.is_record = !v.dimids.empty() && dimensions[v.dimids[0]].unlimited;
+      v.packing = get_packing(v);
+      if (v.is_record) {
+        ++record_variables;
+        recsize += vsize;
+        single_record_size = v.element_size;
+        for (std::size_t d = 1; d < v.dimids.size(); ++d) {
+          single_record_size *= dimensions[v.dimids[d]].size;
+        }
+      }
+      variable_index[v.name] = i;
+    }
+
+    // A file with a single record variable doesn't pad its records
+    if (record_variables == 1) {
+      recsize = single_record_size;
+    }
+
+    // numrecs is all ones while a file is being written in streaming
+    // mode, in which case we work out how many records are complete
+    // from the file size.
+    const std::uint64_t streaming =
+      version == 5 ? ~(std::uint64_t)0 : 0xFFFFFFFFu;
+    if (records == streaming) {
+      records = 0;
+      std::uint64_t first_record = size;
+      for (auto& v: variables) {
+        if (v.is_record) {
+          first_record = std::min<std::uint64_t>(first_record, v.begin);
+        }
+      }
+      if (recsize > 0 && first_record < size) {
+        records = (size - first_record) / recsize;
+      }
+    }
+    numrecs = records;
+  }
+};
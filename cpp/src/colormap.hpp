@@ -0,0 +1,61 @@
+#pragma once
+
+#include "indexed_image.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * Colormap lookups for rendering.  We use an approximation of 'parula',
+ * the default colormap of matplot++ (and MATLAB), so the images look
+ * like the ones the server used to produce through matplot++.
+ */
+class colormap {
+public:
+  /**
+   * Returns the colour at position t in [0, 1] along the colormap
+   */
+  static indexed_image::rgb parula(double t) {
+    // Control points sampled evenly along the colormap, we linearly
+    // interpolate between them.
+    static const double points[][3] = {
+      {53, 42, 135},
+      {15, 92, 221},
+      {18, 125, 216},
+      {7, 156, 207},
+      {21, 177, 180},
+      {89, 189, 140},
+      {165, 190, 107},
+      {225, 185, 82},
+      {249, 251, 14},
+    };
+    constexpr int n = sizeof(points) / sizeof(points[0]);
+
+    if (!(t > 0)) {
+      t = 0;
+    }
+    t = std::min(t, 1.0) * (n - 1);
+    int i = std::min((int)t, n - 2);
+    double f = t - i;
+    indexed_image::rgb c;
+    for (int k = 0; k < 3; ++k) {
+      c[k] = (std::uint8_t)std::lround(
+        points[i][k] + f * (points[i + 1][k] - points[i][k]));
+    }
+    return c;
+  }
+
+  /**
+   * Returns a lookup table of n colours evenly spaced along the colormap,
+   * with each colour taken from the centre of its band.
+   */
+  static std::vector<indexed_image::rgb> lut(std::size_t n) {
+    std::vector<indexed_image::rgb> result;
+    result.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      result.push_back(parula((i + 0.5) / n));
+    }
+    return result;
+  }
+};
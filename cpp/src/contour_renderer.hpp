@@ -0,0 +1,389 @@
+#pragma once
+
+#include "bitmap_font.hpp"
+#include "colormap.hpp"
+#include "indexed_image.hpp"
+#include "png_encoder.hpp"
+#include "resampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * Everything needed to draw a filled contour plot of a 2d slice
+ */
+struct contour_plot {
+  // Coordinates along each axis, which must be monotonically increasing
+  std::vector<double> x;
+  std::vector<double> y;
+  // y.size() * x.size() values in row-major order, ie values[yi][xi]
+  std::vector<double> values;
+
+  std::string title;
+  std::string xlabel;
+  std::string ylabel;
+
+  // Approximate number of contour levels, the actual levels are rounded
+  // to "nice" numbers
+  int levels = 10;
+
+  // When specified the colour scale spans this range instead of
+  // the minimum and maximum of 'values'
+  std::optional<std::pair<double, double>> range;
+};
+
+/**
+ * Renders a contour_plot into an image in memory, replacing what we used
+ * to do with matplot::contourf (which shelled out to gnuplot and wrote
+ * a temp file that we then had to poll for).
+ */
+class contour_renderer {
+public:
+  // Palette entries used for the decorations, the contour levels follow
+  static constexpr std::uint8_t background = 0;
+  static constexpr std::uint8_t foreground = 1;
+  static constexpr std::uint8_t first_level = 2;
+  static constexpr int max_levels = 256 - first_level;
+
+  static constexpr std::size_t default_width = 640;
+  static constexpr std::size_t default_height = 480;
+
+  // Most ticks nice_ticks returns, whatever it's asked for
+  static constexpr int max_ticks = 1000;
+
+  // Largest image along either axis
+  static constexpr std::size_t max_width = 4096;
+  static constexpr std::size_t max_height = 4096;
+
+  /**
+   * Returns the {width, height} of the image whose plot area is
+   * 'field_width' x 'field_height' pixels, eg to draw a grid with one
+   * pixel per cell
+   */
+  static std::pair<std::size_t, std::size_t> image_size(
+      std::size_t field_width, std::size_t field_height) {
+    return {field_width + margin_left + margin_right,
+      field_height + margin_top + margin_bottom};
+  }
+
+  static std::string render_png(
+      const contour_plot& plot,
+      std::size_t width = default_width,
+      std::size_t height = default_height) {
+    return png_encoder::encode(render(plot, width, height));
+  }
+
+  /**
+   * NOTE: a grid with more cells than the plot has pixels is first
+   *   averaged down to one cell per pixel (see resampler), spreading the
+   *   rows over 'thread_count' threads, so that every cell counts rather
+   *   than the ones the pixels happen to land on.
+   */
+  static indexed_image render(
+      const contour_plot& plot,
+      std::size_t width = default_width,
+      std::size_t height = default_height,
+      std::size_t thread_count = 1) {
+    if (plot.x.empty() || plot.y.empty() ||
+        plot.values.size() != plot.x.size() * plot.y.size()) {
+      throw std::invalid_argument(
+        "contour_renderer: values must have y.size() * x.size() elements");
+    }
+    if (width < 200 || height < 150) {
+      throw std::invalid_argument(
+        "contour_renderer: image must be at least 200x150");
+    }
+    if (width > max_width || height > max_height) {
+      throw std::invalid_argument(
+        "contour_renderer: image must be at most " +
+        std::to_string(max_width) + "x" + std::to_string(max_height));
+    }
+
+    std::vector<double> levels = get_levels(plot);
+    const std::size_t bands = levels.size() - 1;
+
+    indexed_image image(width, height, background);
+    image.palette.push_back({255, 255, 255});
+    image.palette.push_back({0, 0, 0});
+    for (auto& c: colormap::lut(bands)) {
+      image.palette.push_back(c);
+    }
+
+    // Layout
+    const long left = margin_left;
+    const long right = (long)width - margin_right;
+    const long top = margin_top;
+    const long bottom = (long)height - margin_bottom;
+
+    const std::size_t field_width = right - left;
+    const std::size_t field_height = bottom - top;
+    if (plot.x.size() > field_width || plot.y.size() > field_height) {
+      contour_plot fitted;
+      const std::size_t nx = std::min(plot.x.size(), field_width);
+      const std::size_t ny = std::min(plot.y.size(), field_height);
+      fitted.x = resampler::resample_coordinates(plot.x, nx);
+      fitted.y = resampler::resample_coordinates(plot.y, ny);
+      fitted.values = resampler::resample(plot.values,
+        plot.y.size(), plot.x.size(), ny, nx,
+        resampler::method::area, thread_count);
+      draw_field(image, fitted, levels, left, top, right, bottom);
+    }
+    else {
+      draw_field(image, plot, levels, left, top, right, bottom);
+    }
+    draw_frame(image, left, top, right, bottom);
+    draw_axes(image, plot, left, top, right, bottom);
+    draw_colorbar(image, levels, right + 20, top, right + 40, bottom);
+
+    bitmap_font::draw(image,
+      ((long)width - bitmap_font::text_width(plot.title, title_scale)) / 2,
+      10, plot.title, foreground, title_scale);
+    bitmap_font::draw(image,
+      (left + right - bitmap_font::text_width(plot.xlabel)) / 2,
+      bottom + 28, plot.xlabel, foreground);
+    bitmap_font::draw_vertical(image,
+      10, (top + bottom + bitmap_font::text_width(plot.ylabel)) / 2,
+      plot.ylabel, foreground);
+
+    return image;
+  }
+
+  /**
+   * Returns about 'count' evenly spaced "nice" values (multiples of
+   * 1, 2 or 5 times a power of 10) which cover [min, max].
+   */
+  static std::vector<double> nice_ticks(double min, double max, int count) {
+    if (!std::isfinite(min) || !std::isfinite(max) ||
+        !std::isfinite(max - min)) {
+      // Eg every value is missing, so there's nothing to scale
+      return {0, 1};
+    }
+    if (max < min) {
+      std::swap(min, max);
+    }
+    if (max - min <= 1e-12 * std::max(std::fabs(min), std::fabs(max))) {
+      // A flat field, eg all zero or differing only by rounding error,
+      // still needs a sensible scale.  Stepping through a range this
+      // small would never get anywhere, as the steps are lost in the
+      // rounding of the values.
+      double pad = min == 0 ? 1 : std::fabs(min) * 0.5;
+      return {min == 0 ? 0 : min - pad, max + pad};
+    }
+    double raw_step = (max - min) / std::max(count, 1);
+    double magnitude = std::pow(10, std::floor(std::log10(raw_step)));
+    double step = magnitude;
+    for (double m: {1.0, 2.0, 5.0, 10.0}) {
+      step = m * magnitude;
+      if (step >= raw_step) {
+        break;
+      }
+    }
+    double first = std::floor(min / step) * step;
+    std::vector<double> ticks;
+    for (int i = 0; i < max_ticks; ++i) {
+      // Avoid printing -0 and accumulated error like 0.30000000000000004
+      double rounded = std::round((first + i * step) / step) * step;
+      ticks.push_back(rounded == 0 ? 0 : rounded);
+      if (rounded >= max) {
+        break;
+      }
+    }
+    if (ticks.size() < 2) {
+      ticks.push_back(ticks.back() + step);
+    }
+    return ticks;
+  }
+
+  static std::string format_number(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%g", v);
+    return buf;
+  }
+
+private:
+  // Space around the plot area for the title, axes and colour bar
+  static constexpr int title_scale = 2;
+  static constexpr std::size_t margin_left = 80;
+  static constexpr std::size_t margin_right = 110;
+  static constexpr std::size_t margin_top =
+    20 + bitmap_font::glyph_height * title_scale;
+  static constexpr std::size_t margin_bottom = 50;
+
+  /**
+   * Returns the level boundaries, there is one colour band between
+   * each consecutive pair.
+   */
+  static std::vector<double> get_levels(const contour_plot& plot) {
+    double min, max;
+    if (plot.range) {
+      std::tie(min, max) = *plot.range;
+    }
+    else {
+      auto [lo, hi] = finite_min_max(plot.values);
+      min = lo;
+      max = hi;
+    }
+    std::vector<double> levels = nice_ticks(
+      min, max, std::clamp(plot.levels, 1, max_levels));
+    while (levels.size() - 1 > (std::size_t)max_levels) {
+      levels.pop_back();
+    }
+    return levels;
+  }
+
+  static std::pair<double, double> finite_min_max(
+      const std::vector<double>& values) {
+    double min = INFINITY;
+    double max = -INFINITY;
+    for (double v: values) {
+      if (std::isfinite(v)) {
+        min = std::min(min, v);
+        max = std::max(max, v);
+      }
+    }
+    if (min > max) {
+      // No finite values at all
+      return {0, 0};
+    }
+    return {min, max};
+  }
+
+  /**
+   * For each of 'pixels' positions spanning [coords.front(), coords.back()]
+   * returns the index of the grid cell it falls in and how far along
+   * that cell it is, for bilinear interpolation.
+   */
+  static std::vector<std::pair<std::size_t, double>> get_cell_positions(
+      const std::vector<double>& coords, long pixels) {
+    std::vector<std::pair<std::size_t, double>> result(pixels);
+    if (coords.size() == 1) {
+      return result;
+    }
+    const double lo = coords.front();
+    const double hi = coords.back();
+    for (long p = 0; p < pixels; ++p) {
+      double c = lo + (p + 0.5) / pixels * (hi - lo);
+      auto it = std::upper_bound(coords.begin(), coords.end(), c);
+      std::size_t i = std::clamp<std::size_t>(
+        it - coords.begin(), 1, coords.size() - 1) - 1;
+      double span = coords[i + 1] - coords[i];
+      double f = span > 0 ? (c - coords[i]) / span : 0;
+      result[p] = {i, std::clamp(f, 0.0, 1.0)};
+    }
+    return result;
+  }
+
+  static void draw_field(
+      indexed_image& image, const contour_plot& plot,
+      const std::vector<double>& levels,
+      long left, long top, long right, long bottom) {
+    const long w = right - left;
+    const long h = bottom - top;
+    auto columns = get_cell_positions(plot.x, w);
+    auto rows = get_cell_positions(plot.y, h);
+    const std::size_t nx = plot.x.size();
+    const std::size_t ny = plot.y.size();
+    const std::size_t bands = levels.size() - 1;
+
+    for (long py = 0; py < h; ++py) {
+      // Image rows go down while y goes up
+      auto [yi, fy] = rows[h - 1 - py];
+      std::size_t yi1 = std::min(yi + 1, ny - 1);
+      const double* row0 = plot.values.data() + yi * nx;
+      const double* row1 = plot.values.data() + yi1 * nx;
+      std::uint8_t* out = image.pixels.data() + (top + py) * image.width;
+
+      for (long px = 0; px < w; ++px) {
+        auto [xi, fx] = columns[px];
+        std::size_t xi1 = std::min(xi + 1, nx - 1);
+        double v0 = row0[xi] + fx * (row0[xi1] - row0[xi]);
+        double v1 = row1[xi] + fx * (row1[xi1] - row1[xi]);
+        double v = v0 + fy * (v1 - v0);
+
+        if (!std::isfinite(v)) {
+          out[left + px] = background;
+          continue;
+        }
+        std::size_t band = std::upper_bound(
+          levels.begin(), levels.end(), v) - levels.begin();
+        band = std::clamp<std::size_t>(band, 1, bands) - 1;
+        out[left + px] = first_level + band;
+      }
+    }
+  }
+
+  static void draw_frame(
+      indexed_image& image, long left, long top, long right, long bottom) {
+    image.fill_rect(left - 1, top - 1, right + 1, top, foreground);
+    image.fill_rect(left - 1, bottom, right + 1, bottom + 1, foreground);
+    image.fill_rect(left - 1, top - 1, left, bottom + 1, foreground);
+    image.fill_rect(right, top - 1, right + 1, bottom + 1, foreground);
+  }
+
+  static void draw_axes(
+      indexed_image& image, const contour_plot& plot,
+      long left, long top, long right, long bottom) {
+    const double x0 = plot.x.front(), x1 = plot.x.back();
+    for (double t: nice_ticks(x0, x1, 6)) {
+      if (t < x0 || t > x1 || x1 == x0) {
+        continue;
+      }
+      long px = left + std::lround((t - x0) / (x1 - x0) * (right - left - 1));
+      image.fill_rect(px, bottom, px + 1, bottom + 5, foreground);
+      std::string label = format_number(t);
+      bitmap_font::draw(image,
+        px - bitmap_font::text_width(label) / 2, bottom + 9,
+        label, foreground);
+    }
+
+    const double y0 = plot.y.front(), y1 = plot.y.back();
+    for (double t: nice_ticks(y0, y1, 6)) {
+      if (t < y0 || t > y1 || y1 == y0) {
+        continue;
+      }
+      long py = bottom - 1 -
+        std::lround((t - y0) / (y1 - y0) * (bottom - top - 1));
+      image.fill_rect(left - 5, py, left, py + 1, foreground);
+      std::string label = format_number(t);
+      bitmap_font::draw(image,
+        left - 9 - bitmap_font::text_width(label),
+        py - bitmap_font::glyph_height / 2,
+        label, foreground);
+    }
+  }
+
+  static void draw_colorbar(
+      indexed_image& image, const std::vector<double>& levels,
+      long left, long top, long right, long bottom) {
+    const std::size_t bands = levels.size() - 1;
+    const long h = bottom - top;
+    for (std::size_t b = 0; b < bands; ++b) {
+      long y1 = bottom - (long)(h * b / bands);
+      long y0 = bottom - (long)(h * (b + 1) / bands);
+      image.fill_rect(left, y0, right, y1, first_level + b);
+    }
+    draw_frame(image, left, top, right, bottom);
+
+    // Label every level boundary, skipping some if they would overlap
+    const long min_spacing = bitmap_font::glyph_height + 4;
+    std::size_t every = 1;
+    while (every * h / std::max<std::size_t>(bands, 1) < (std::size_t)min_spacing &&
+           every < bands) {
+      ++every;
+    }
+    for (std::size_t i = 0; i <= bands; i += every) {
+      long py = bottom - (long)(h * i / bands);
+      image.fill_rect(right, py, right + 4, py + 1, foreground);
+      bitmap_font::draw(image, right + 7,
+        py - bitmap_font::glyph_height / 2,
+        format_number(levels[i]), foreground);
+    }
+  }
+};
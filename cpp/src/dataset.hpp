@@ -0,0 +1,458 @@
+#pragma once
+
+#include "catalog.hpp"
+#include "file_pool.hpp"
+#include "hyperslab.hpp"
+#include "read_netcdf.hpp"
+
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * What the server serves: a single netCDF file, or many files with the
+ * same variables presented as one, concatenated along their 'time'
+ * dimension (eg model output written as one file per time window).
+ * The files are indexed once when the dataset is opened, mapping each
+ * index along 'time' to a file and the index within it, and the schema
+ * is that of the first file with the size of 'time' summed over all of
+ * them.  Variables without a 'time' dimension are read from the first
+ * file.
+ */
+class dataset {
+public:
+  static constexpr const char* aggregated_dimension = "time";
+
+  struct file {
+    std::string path;
+    // Where the file's time steps start in the dataset, and how many
+    // it has
+    std::size_t time_offset;
+    std::size_t time_size;
+    // The file's inode, modification time and size when it was indexed
+    std::string identity;
+  };
+
+  /**
+   * Opens a single file, every netCDF file (*.nc, *.nc4, *.cdf) in a
+   * directory, or the files matching a glob pattern such as
+   * "run/out_*.nc", and reads their schemas.  The files are ordered by
+   * name, which is taken to be their order along 'time'.
+   * Throws runtime_error when there are no files or they don't match.
+   */
+  static std::shared_ptr<const dataset> open(const std::string& path) {
+    return std::make_shared<const dataset>(find_files(path), path);
+  }
+
+  /**
+   * Indexes the files, 'source' being the path they were found from
+   */
+  explicit dataset(
+      std::vector<std::string> paths, std::string source = "")
+    : source(std::move(source))
+  {
+    if (paths.empty()) {
+      throw std::runtime_error("No netCDF files to serve");
+    }
+    std::vector<catalog::dimension> dimensions;
+    std::size_t time_total = 0;
+    for (auto& path: paths) {
+      // Before reading, so that a change while reading shows up as a
+      // different identity next time
+      std::string id = get_file_identity(path);
+      catalog c = read_netcdf(path.c_str()).get_catalog();
+      const catalog::dimension* time = find_dimension(c, aggregated_dimension);
+      const std::size_t time_size = time ? time->size : 0;
+      if (files.empty()) {
+        dimensions = c.get_dimensions();
+        first = std::make_unique<const catalog>(std::move(c));
+      }
+      else {
+        if (time == nullptr) {
+          throw std::runtime_error(
+            path + ": has no '" + aggregated_dimension +
+            "' dimension to be concatenated along");
+        }
+        check_matches(path, c);
+      }
+      files.push_back({path, time_total, time_size, std::move(id)});
+      time_total += time_size;
+    }
+    if (files.size() > 1 &&
+        find_dimension(*first, aggregated_dimension) == nullptr) {
+      throw std::runtime_error(
+        files[0].path + ": has no '" + aggregated_dimension +
+        "' dimension to be concatenated along");
+    }
+
+    for (auto& d: dimensions) {
+      if (d.name == aggregated_dimension) {
+        d.size = time_total;
+      }
+    }
+    schema = std::make_unique<const catalog>(
+      std::move(dimensions), first->get_variables(), first->get_attributes());
+    identity = make_identity();
+  }
+
+  const std::vector<file>& get_files() const {
+    return files;
+  }
+
+  const std::string& get_source() const {
+    return source;
+  }
+
+  /**
+   * Returns the directory in which files of the dataset are created,
+   * changed and removed, eg to watch it for changes, or an empty string
+   * when that isn't a single directory (a glob matching directories)
+   */
+  std::string get_directory() const {
+    if (std::filesystem::is_directory(source)) {
+      return source;
+    }
+    std::string parent = std::filesystem::path(source).parent_path().string();
+    if (parent.find_first_of("*?[") != std::string::npos) {
+      return "";
+    }
+    return parent.empty() ? "." : parent;
+  }
+
+  /**
+   * Whether the file of that name in get_directory() belongs to the
+   * dataset, following the same rules as `open`
+   */
+  bool is_source_file(const std::string& name) const {
+    if (std::filesystem::is_directory(source)) {
+      return is_netcdf_name(name);
+    }
+    std::filesystem::path pattern(source);
+    if (source.find_first_of("*?[") != std::string::npos) {
+      return fnmatch(pattern.filename().c_str(), name.c_str(), 0) == 0;
+    }
+    return name == pattern.filename();
+  }
+
+  const catalog& get_catalog() const {
+    return *schema;
+  }
+
+  /**
+   * Identifies the contents of every file, from their inode, modification
+   * time and size, eg for ETags
+   */
+  const std::string& get_identity() const {
+    return identity;
+  }
+
+  /**
+   * Returns the file holding the index along 'time' and the index in it
+   */
+  std::pair<std::size_t, std::size_t> locate(std::size_t time_index) const {
+    auto it = std::upper_bound(files.begin(), files.end(), time_index,
+      [](std::size_t t, const file& f) { return t < f.time_offset; });
+    std::size_t f = it == files.begin() ? 0 : (it - files.begin()) - 1;
+    // Skip any files with no time steps at all
+    while (f + 1 < files.size() &&
+           time_index >= files[f].time_offset + files[f].time_size) {
+      ++f;
+    }
+    return {f, time_index - files[f].time_offset};
+  }
+
+  /**
+   * Whether the variable is read across the files, ie has 'time' as its
+   * first dimension.  Throws invalid_argument for variables that have
+   * 'time' elsewhere, which can't be read across the files.
+   */
+  bool is_aggregated(const catalog::variable& var) const {
+    const auto& dims = schema->get_dimensions();
+    for (std::size_t d = 0; d < var.dimensions.size(); ++d) {
+      if (dims[var.dimensions[d]].name == aggregated_dimension) {
+        if (d > 0 && files.size() > 1) {
+          throw std::invalid_argument(
+            "Variable name '" + var.name + "': has '" +
+            aggregated_dimension + "' as other than its first dimension, "
+            "so it can't be read across files");
+        }
+        return files.size() > 1;
+      }
+    }
+    return false;
+  }
+
+private:
+  std::string source;
+  std::vector<file> files;
+  std::unique_ptr<const catalog> first;
+  std::unique_ptr<const catalog> schema;
+  std::string identity;
+
+  static std::vector<std::string> find_files(const std::string& path) {
+    std::vector<std::string> paths;
+    std::error_code error;
+    if (std::filesystem::is_directory(path, error)) {
+      for (auto& entry: std::filesystem::directory_iterator(path)) {
+        if (entry.is_regular_file() && is_netcdf_name(entry.path())) {
+          paths.push_back(entry.path().string());
+        }
+      }
+    }
+    else if (path.find_first_of("*?[") != std::string::npos) {
+      glob_t matches;
+      if (glob(path.c_str(), 0, nullptr, &matches) == 0) {
+        for (std::size_t i = 0; i < matches.gl_pathc; ++i) {
+          paths.push_back(matches.gl_pathv[i]);
+        }
+      }
+      globfree(&matches);
+    }
+    else {
+      paths.push_back(path);
+    }
+    if (paths.empty()) {
+      throw std::runtime_error("No netCDF files found at " + path);
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+  }
+
+  static bool is_netcdf_name(const std::filesystem::path& path) {
+    auto extension = path.extension();
+    return extension == ".nc" || extension == ".nc4" || extension == ".cdf";
+  }
+
+  static const catalog::dimension* find_dimension(
+      const catalog& c, const std::string& name) {
+    for (auto& d: c.get_dimensions()) {
+      if (d.name == name) {
+        return &d;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Throws unless the file has the same variables as the first, with the
+   * same types, dimensions and packing, as otherwise the values can't
+   * simply be concatenated
+   */
+  void check_matches(const std::string& path, const catalog& c) const {
+    auto mismatch = [&](const std::string& what) {
+      return std::runtime_error(
+        path + ": doesn't match " + files[0].path + ", " + what);
+    };
+    if (c.get_variables().size() != first->get_variables().size()) {
+      throw mismatch("it has a different number of variables");
+    }
+    for (auto& v: first->get_variables()) {
+      const catalog::variable* other;
+      try {
+        other = &c.get_variable(v.name);
+      }
+      catch (std::invalid_argument&) {
+        throw mismatch("it has no variable '" + v.name + "'");
+      }
+      if (other->type != v.type ||
+          other->dimensions.size() != v.dimensions.size()) {
+        throw mismatch("variable '" + v.name + "' has a different type or "
+          "number of dimensions");
+      }
+      for (std::size_t d = 0; d < v.dimensions.size(); ++d) {
+        auto& a = first->get_dimensions()[v.dimensions[d]];
+        auto& b = c.get_dimensions()[other->dimensions[d]];
+        if (a.name != b.name ||
+            (a.name != aggregated_dimension && a.size != b.size)) {
+          throw mismatch("variable '" + v.name + "' has different "
+            "dimensions");
+        }
+      }
+      for (auto name: {"scale_factor", "add_offset", "_FillValue",
+                       "missing_value"}) {
+        if (get_attribute(v, name) != get_attribute(*other, name)) {
+          throw mismatch("variable '" + v.name + "' has a different " + name);
+        }
+      }
+    }
+  }
+
+  static json get_attribute(const catalog::variable& v, const char* name) {
+    for (auto& a: v.attributes) {
+      if (a.name == name) {
+        return a.value;
+      }
+    }
+    return nullptr;
+  }
+
+  static std::string get_file_identity(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      throw std::runtime_error("Unable to stat " + path);
+    }
+    char id[64];
+    snprintf(id, sizeof(id), "%llx-%llx-%llx",
+      (unsigned long long)st.st_ino,
+      (unsigned long long)st.st_mtim.tv_sec * 1000000000ull +
+        st.st_mtim.tv_nsec,
+      (unsigned long long)st.st_size);
+    return id;
+  }
+
+  std::string make_identity() const {
+    if (files.size() == 1) {
+      return files[0].identity;
+    }
+    std::string identities;
+    for (auto& f: files) {
+      identities += f.identity;
+      identities += ',';
+    }
+    // Too long to go into every ETag, so hashed (64-bit FNV-1a)
+    std::uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c: identities) {
+      hash = (hash ^ c) * 1099511628211ull;
+    }
+    char id[64];
+    snprintf(id, sizeof(id), "%zx-%016llx",
+      files.size(), (unsigned long long)hash);
+    return id;
+  }
+};
+
+/**
+ * Reads from a dataset through a pool of open files, with the same
+ * contract as read_netcdf so that the server's reads don't need to know
+ * how many files there are.  Thread safe: each read leases the handles
+ * it needs from the pool.
+ */
+class dataset_reader {
+public:
+  dataset_reader(std::shared_ptr<const dataset> data, std::size_t max_open_files)
+    : data(std::move(data)), pool(get_paths(*this->data), max_open_files) {}
+
+  const dataset& get_dataset() const {
+    return *data;
+  }
+
+  catalog get_catalog() const {
+    return data->get_catalog();
+  }
+
+  std::vector<std::pair<std::string, std::size_t>> get_variable_dimensions(
+      const char* variable_name) const {
+    return data->get_catalog().get_variable_dimensions(variable_name);
+  }
+
+  /**
+   * Same contract as read_netcdf::read_hyperslab, the first index being
+   * along 'time' for variables read across the files
+   */
+  hyperslab read_hyperslab(
+      const char* variable_name,
+      const std::vector<uint64_t>& prefix_indices) const {
+    if (data->get_files().size() == 1) {
+      return pool.acquire(0)->read_hyperslab(variable_name, prefix_indices);
+    }
+    const catalog& schema = data->get_catalog();
+    const catalog::variable& var = schema.get_variable(variable_name);
+    if (!data->is_aggregated(var)) {
+      return pool.acquire(0)->read_hyperslab(variable_name, prefix_indices);
+    }
+    if (prefix_indices.empty()) {
+      // Every time step, ie every file
+      return read_hyperslab(variable_name, hyperslab_query());
+    }
+    schema.validate_dimension_index(
+      dataset::aggregated_dimension, prefix_indices[0]);
+    auto [file, local] = data->locate(prefix_indices[0]);
+    std::vector<uint64_t> local_indices = prefix_indices;
+    local_indices[0] = local;
+    return pool.acquire(file)->read_hyperslab(variable_name, local_indices);
+  }
+
+  /**
+   * Same contract as read_netcdf::read_hyperslab, reading the part of
+   * the selection along 'time' in each file from that file
+   */
+  hyperslab read_hyperslab(
+      const char* variable_name, hyperslab_query query) const {
+    if (data->get_files().size() == 1) {
+      return pool.acquire(0)->read_hyperslab(variable_name, query);
+    }
+    const catalog& schema = data->get_catalog();
+    const catalog::variable& var = schema.get_variable(variable_name);
+    if (!data->is_aggregated(var)) {
+      return pool.acquire(0)->read_hyperslab(variable_name, query);
+    }
+    if (!is_numeric_nc_type(var.type)) {
+      throw std::invalid_argument(
+        std::string("Variable name '") + variable_name +
+        "': is not a numeric variable");
+    }
+    auto dims = schema.get_variable_dimensions(variable_name);
+    std::vector<std::size_t> sizes;
+    for (auto& d: dims) {
+      sizes.push_back(d.second);
+    }
+    query.resolve(variable_name, sizes,
+      [&](std::size_t d, std::size_t index) {
+        schema.validate_dimension_index(dims[d].first, index);
+      });
+
+    // One read per file, of the time steps selected from it
+    hyperslab slab;
+    std::size_t done = 0;
+    while (done < query.count[0]) {
+      const std::size_t time_index = query.start[0] + done * query.stride[0];
+      auto [file, local] = data->locate(time_index);
+      const auto& f = data->get_files()[file];
+      const std::size_t in_file = std::min(query.count[0] - done,
+        (f.time_offset + f.time_size - 1 - time_index) / query.stride[0] + 1);
+      hyperslab_query part = query;
+      part.start[0] = local;
+      part.count[0] = in_file;
+      hyperslab piece = pool.acquire(file)->read_hyperslab(variable_name, part);
+      if (done == 0) {
+        slab.type = piece.type;
+        slab.element_size = piece.element_size;
+        slab.packing = piece.packing;
+        slab.data = std::move(piece.data);
+      }
+      else {
+        slab.data += piece.data;
+      }
+      done += in_file;
+    }
+    slab.shape = query.count;
+    return slab;
+  }
+
+  file_pool::stats get_pool_stats() const {
+    return pool.get_stats();
+  }
+
+private:
+  std::shared_ptr<const dataset> data;
+  // Leasing handles doesn't change what the reader reads
+  mutable file_pool pool;
+
+  static std::vector<std::string> get_paths(const dataset& data) {
+    std::vector<std::string> paths;
+    for (auto& f: data.get_files()) {
+      paths.push_back(f.path);
+    }
+    return paths;
+  }
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "logger.hpp"
+#include "read_netcdf.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * A bounded pool of open netCDF files shared by the I/O threads.
+ * A handle is only ever used by the thread that has it leased, see
+ * io_scheduler for why, and goes back to the pool when the lease ends.
+ * Idle handles are kept open for the next read of the same file, and
+ * when 'max_open' handles are open the least recently used idle one is
+ * closed to make room, so the number of open files stays bounded however
+ * many files there are.  The same file can have several handles open at
+ * once, one for each thread reading it.
+ */
+class file_pool {
+public:
+  struct stats {
+    std::size_t open;
+    std::size_t max_open;
+    std::uint64_t opened;
+    std::uint64_t evicted;
+    // Leases that had to wait for a handle to be returned
+    std::uint64_t waits;
+  };
+
+  class lease {
+  public:
+    lease(file_pool& pool, std::size_t file, std::unique_ptr<read_netcdf> reader)
+      : pool(&pool), file(file), reader(std::move(reader)) {}
+    lease(lease&& other) = default;
+    lease& operator=(lease&&) = delete;
+    lease(const lease&) = delete;
+    lease& operator=(const lease&) = delete;
+
+    ~lease() {
+      if (reader) {
+        pool->release(file, std::move(reader));
+      }
+    }
+
+    read_netcdf& operator*() const {
+      return *reader;
+    }
+
+    read_netcdf* operator->() const {
+      return reader.get();
+    }
+
+  private:
+    file_pool* pool;
+    std::size_t file;
+    std::unique_ptr<read_netcdf> reader;
+  };
+
+  /**
+   * 'paths' are the files, which are referred to by their index
+   */
+  file_pool(std::vector<std::string> paths, std::size_t max_open)
+    : paths(std::move(paths)), max_open(std::max<std::size_t>(max_open, 1)) {}
+
+  file_pool(const file_pool&) = delete;
+  file_pool& operator=(const file_pool&) = delete;
+
+  /**
+   * Returns a handle to the file that no other thread is using, opening
+   * it if there's no idle one, and waiting for one to be returned when
+   * 'max_open' are open and all of them are in use.
+   * Throws whatever read_netcdf throws if the file can't be opened.
+   */
+  lease acquire(std::size_t file) {
+    std::unique_ptr<read_netcdf> evicted;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      bool waited = false;
+      while (true) {
+        auto it = std::find_if(idle.begin(), idle.end(),
+          [&](const idle_handle& h) { return h.file == file; });
+        if (it != idle.end()) {
+          auto reader = std::move(it->reader);
+          idle.erase(it);
+          return lease(*this, file, std::move(reader));
+        }
+        if (open_count < max_open) {
+          break;
+        }
+        if (!idle.empty()) {
+          // The back is the least recently used
+          evicted = std::move(idle.back().reader);
+          idle.pop_back();
+          --open_count;
+          ++evicted_count;
+          break;
+        }
+        if (!waited) {
+          ++wait_count;
+          waited = true;
+        }
+        returned.wait(lock);
+      }
+      ++open_count;
+      ++opened_count;
+    }
+
+    // Closing and opening files are slow, so neither holds the lock
+    evicted.reset();
+    try {
+      logger::debug("Opening ", paths[file]);
+      return lease(*this, file, std::make_unique<read_netcdf>(paths[file].c_str()));
+    }
+    catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        --open_count;
+      }
+      returned.notify_one();
+      throw;
+    }
+  }
+
+  stats get_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats{
+      open_count, max_open, opened_count, evicted_count, wait_count};
+  }
+
+private:
+  struct idle_handle {
+    std::size_t file;
+    std::unique_ptr<read_netcdf> reader;
+  };
+
+  const std::vector<std::string> paths;
+  const std::size_t max_open;
+
+  std::mutex mutex;
+  std::condition_variable returned;
+  // Most recently used first
+  std::list<idle_handle> idle;
+  // Idle and leased
+  std::size_t open_count = 0;
+  std::uint64_t opened_count = 0;
+  std::uint64_t evicted_count = 0;
+  std::uint64_t wait_count = 0;
+
+  void release(std::size_t file, std::unique_ptr<read_netcdf> reader) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      idle.push_front({file, std::move(reader)});
+    }
+    returned.notify_one();
+  }
+};
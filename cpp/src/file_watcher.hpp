@@ -0,0 +1,132 @@
+#pragma once
+
+#include "logger.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+/**
+ * Calls 'on_change' on a background thread once files in a directory
+ * have been created, written, renamed or removed, as reported by
+ * inotify.  Only the files for which 'is_relevant(name)' is true count.
+ * The call waits until there has been no change for 'quiet' so that a
+ * file being written (or a batch of files being copied in) triggers one
+ * call once it's done rather than one per write.
+ * NOTE: the directory is watched rather than the files themselves as
+ *   files are often replaced by writing a new one and renaming it over
+ *   the old one, which a watch on the old file wouldn't see.
+ */
+class file_watcher {
+public:
+  file_watcher(
+      const std::string& directory,
+      std::function<bool(const std::string&)> is_relevant,
+      std::function<void()> on_change,
+      std::chrono::milliseconds quiet = std::chrono::milliseconds(1000))
+    : is_relevant(std::move(is_relevant)),
+      on_change(std::move(on_change)),
+      quiet(quiet)
+  {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+      throw std::runtime_error(
+        std::string("Unable to watch for changes: ") + strerror(errno));
+    }
+    if (inotify_add_watch(inotify_fd, directory.c_str(),
+          IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE |
+          IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+      int error = errno;
+      close(inotify_fd);
+      throw std::runtime_error(
+        "Unable to watch " + directory + " for changes: " + strerror(error));
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+      close(inotify_fd);
+      throw std::runtime_error(
+        std::string("Unable to watch for changes: ") + strerror(errno));
+    }
+    watcher = std::thread([this]() { run(); });
+  }
+
+  file_watcher(const file_watcher&) = delete;
+  file_watcher& operator=(const file_watcher&) = delete;
+
+  ~file_watcher() {
+    std::uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0) {
+      // Can't happen for an eventfd short of overflowing it
+    }
+    watcher.join();
+    close(stop_fd);
+    close(inotify_fd);
+  }
+
+private:
+  std::function<bool(const std::string&)> is_relevant;
+  std::function<void()> on_change;
+  std::chrono::milliseconds quiet;
+  int inotify_fd = -1;
+  int stop_fd = -1;
+  std::thread watcher;
+
+  void run() {
+    bool pending = false;
+    while (true) {
+      pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+      int ready = poll(fds, 2, pending ? (int)quiet.count() : -1);
+      if (ready < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        logger::error("Stopped watching for changes: ", strerror(errno));
+        return;
+      }
+      if (fds[1].revents != 0) {
+        return;
+      }
+      if (ready == 0) {
+        // Quiet for long enough
+        pending = false;
+        try {
+          on_change();
+        }
+        catch (std::exception& e) {
+          logger::error("Handling a change failed: ", e.what());
+        }
+        continue;
+      }
+      pending = read_events() || pending;
+    }
+  }
+
+  // Returns whether any of the events were for relevant files
+  bool read_events() {
+    alignas(inotify_event) char buffer[16384];
+    bool relevant = false;
+    while (true) {
+      ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        return relevant;
+      }
+      for (char* p = buffer; p < buffer + n; ) {
+        auto* event = (inotify_event*)p;
+        if ((event->mask & IN_Q_OVERFLOW) ||
+            (event->len > 0 && is_relevant(event->name))) {
+          relevant = true;
+        }
+        p += sizeof(inotify_event) + event->len;
+      }
+    }
+  }
+};
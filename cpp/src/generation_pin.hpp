@@ -0,0 +1,83 @@
+#pragma once
+
+#include <crow.h>
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * Crow middleware that pins the current generation of some state that
+ * is replaced while the server runs (eg when the file is reloaded) for
+ * the whole of each request, so that every part of a request sees the
+ * same generation however many times it looks it up, and a generation
+ * stays alive until the last request using it is done.
+ * The pin is thread_local, so code that hands work to other threads
+ * (eg parallel_for) has to pin the same generation there, see `scope`.
+ * NOTE: it must come before any middleware that uses the generation in
+ *   the app's list, as crow calls before_handle in that order.
+ */
+template <typename T>
+class generation_pin {
+public:
+  struct context {};
+
+  /**
+   * 'current' returns the generation that new requests should use.
+   * Must be called before the server starts.
+   */
+  void configure(std::function<std::shared_ptr<const T>()> current) {
+    this->current = std::move(current);
+  }
+
+  void before_handle(crow::request&, crow::response&, context&) {
+    pinned() = current();
+  }
+
+  void after_handle(crow::request&, crow::response&, context&) {
+    pinned().reset();
+  }
+
+  /**
+   * Returns the generation pinned on this thread.
+   * Throws logic_error when none is, which is a bug.
+   */
+  static const T& get() {
+    const auto& p = pinned();
+    if (!p) {
+      throw std::logic_error("No generation is pinned on this thread");
+    }
+    return *p;
+  }
+
+  static std::shared_ptr<const T> get_shared() {
+    return pinned();
+  }
+
+  /**
+   * Pins a generation on this thread for as long as it lives, restoring
+   * what was pinned before
+   */
+  class scope {
+  public:
+    explicit scope(std::shared_ptr<const T> generation)
+      : previous(std::exchange(pinned(), std::move(generation))) {}
+    ~scope() {
+      pinned() = std::move(previous);
+    }
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+  private:
+    std::shared_ptr<const T> previous;
+  };
+
+private:
+  std::function<std::shared_ptr<const T>()> current;
+
+  static std::shared_ptr<const T>& pinned() {
+    thread_local std::shared_ptr<const T> generation;
+    return generation;
+  }
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "indexed_image.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Minimal in-memory encoder for animated GIFs of palette based images.
+ * The frames are compressed independently (so callers can compress them
+ * on different threads) and then assembled behind a single global
+ * palette, which means every frame must use the same palette.
+ * See https://www.w3.org/Graphics/GIF/spec-gif89a.txt for the format.
+ */
+class gif_encoder {
+public:
+  /**
+   * Returns the LZW compressed pixels of the image, packed into data
+   * sub-blocks, ie the part of a frame that takes the time to produce
+   */
+  static std::string compress(const indexed_image& image) {
+    const int min_code_size = 8;
+    const std::uint32_t clear_code = 1 << min_code_size;
+    const std::uint32_t end_code = clear_code + 1;
+    const std::uint32_t max_code = 4095;
+
+    bit_writer out;
+    // Maps (prefix code << 8 | next byte) to the code for that string
+    std::unordered_map<std::uint32_t, std::uint32_t> dictionary;
+    dictionary.reserve(max_code);
+    std::uint32_t next_code = end_code + 1;
+    int code_size = min_code_size + 1;
+
+    out.write(clear_code, code_size);
+    if (image.pixels.empty()) {
+      out.write(end_code, code_size);
+      return out.finish();
+    }
+    std::uint32_t prefix = image.pixels[0];
+    for (std::size_t i = 1; i < image.pixels.size(); ++i) {
+      std::uint8_t c = image.pixels[i];
+      std::uint32_t key = prefix << 8 | c;
+      auto it = dictionary.find(key);
+      if (it != dictionary.end()) {
+        prefix = it->second;
+        continue;
+      }
+      out.write(prefix, code_size);
+      if (next_code <= max_code) {
+        dictionary.emplace(key, next_code);
+        // The decoder grows its code size one code later than we add
+        // the entry, so grow when the code we just added needs it
+        if (next_code == (1u << code_size) && code_size < 12) {
+          ++code_size;
+        }
+        ++next_code;
+      }
+      else {
+        // The table is full, start again
+        out.write(clear_code, code_size);
+        dictionary.clear();
+        next_code = end_code + 1;
+        code_size = min_code_size + 1;
+      }
+      prefix = c;
+    }
+    out.write(prefix, code_size);
+    out.write(end_code, code_size);
+    return out.finish();
+  }
+
+  /**
+   * Returns the GIF file contents for an animation whose frames are the
+   * 'compressed' results of `compress`, all the size of 'first' and
+   * sharing its palette, shown for 'delay_ms' each and looping forever
+   */
+  static std::string encode_animation(
+      const indexed_image& first,
+      const std::vector<std::string>& compressed,
+      unsigned delay_ms) {
+    if (first.palette.empty() || first.palette.size() > 256) {
+      throw std::invalid_argument("gif_encoder: palette must have 1-256 entries");
+    }
+    // The colour table size must be a power of 2
+    int table_bits = 1;
+    while ((1u << table_bits) < first.palette.size()) {
+      ++table_bits;
+    }
+
+    std::string gif = "GIF89a";
+    append_u16(gif, first.width);
+    append_u16(gif, first.height);
+    gif += (char)(0x80 | (table_bits - 1) << 4 | (table_bits - 1));
+    gif += (char)0; // background colour index
+    gif += (char)0; // no aspect ratio
+    for (std::size_t i = 0; i < (1u << table_bits); ++i) {
+      indexed_image::rgb c = i < first.palette.size() ?
+        first.palette[i] : indexed_image::rgb{0, 0, 0};
+      gif.append((const char*)c.data(), 3);
+    }
+
+    // NETSCAPE2.0 application extension, loop forever
+    gif += "\x21\xff\x0bNETSCAPE2.0\x03\x01";
+    append_u16(gif, 0);
+    gif += (char)0;
+
+    for (auto& frame: compressed) {
+      // Graphic control extension with the frame delay
+      gif += "\x21\xf9\x04";
+      gif += (char)(first.alpha.empty() ? 0 : 1);
+      append_u16(gif, (delay_ms + 5) / 10);
+      gif += (char)0; // transparent colour index (palette entry 0)
+      gif += (char)0;
+
+      // Image descriptor, the whole canvas with no local colour table
+      gif += (char)0x2c;
+      append_u16(gif, 0);
+      append_u16(gif, 0);
+      append_u16(gif, first.width);
+      append_u16(gif, first.height);
+      gif += (char)0;
+
+      gif += (char)8; // LZW minimum code size
+      gif += frame;
+    }
+    gif += (char)0x3b;
+    return gif;
+  }
+
+private:
+  /**
+   * Packs codes least significant bit first, as GIF requires, into
+   * sub-blocks of at most 255 bytes
+   */
+  class bit_writer {
+  public:
+    void write(std::uint32_t code, int bits) {
+      buffer |= (std::uint64_t)code << count;
+      count += bits;
+      while (count >= 8) {
+        bytes += (char)(buffer & 0xff);
+        buffer >>= 8;
+        count -= 8;
+      }
+    }
+
+    std::string finish() {
+      if (count > 0) {
+        bytes += (char)(buffer & 0xff);
+      }
+      std::string blocks;
+      for (std::size_t i = 0; i < bytes.size(); i += 255) {
+        std::size_t n = std::min<std::size_t>(255, bytes.size() - i);
+        blocks += (char)n;
+        blocks.append(bytes, i, n);
+      }
+      blocks += (char)0; // block terminator
+      return blocks;
+    }
+
+  private:
+    std::string bytes;
+    std::uint64_t buffer = 0;
+    int count = 0;
+  };
+
+  static void append_u16(std::string& s, std::uint16_t v) {
+    s += (char)(v & 0xff);
+    s += (char)(v >> 8);
+  }
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "lru_cache.hpp"
+
+#include <crow.h>
+#include <zlib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Crow middleware that takes advantage of the files only changing when
+ * they're reloaded, so that a response only depends on the request's url
+ * and the identity of the files it was served from.
+ *   - Every successful response gets a strong ETag made from the files'
+ *     identity (inode, modification time and size) and the url, and a
+ *     request whose If-None-Match has it gets a 304 without the handler
+ *     being called at all.
+ *   - Responses are gzip or deflate encoded when the client accepts it,
+ *     and the encoded responses are kept in a memory bounded cache so
+ *     that each is only built and compressed once.  A hit is also
+ *     answered without calling the handler.
+ * Paths whose responses change while the server runs (eg the cache
+ * statistics) are left alone, see `configure`.
+ */
+class http_cache {
+public:
+  // What gets cached for each encoded response
+  struct cached_response {
+    std::string body;
+    std::vector<std::pair<std::string, std::string>> headers;
+  };
+
+  struct context {
+    // Empty for requests that are left alone
+    std::string etag;
+    // "gzip", "deflate" or empty when the client accepts neither
+    std::string encoding;
+    // Set when before_handle already completed the response
+    bool answered = false;
+  };
+
+  struct stats {
+    std::uint64_t not_modified;
+    lru_cache<cached_response>::stats compressed;
+  };
+
+  /**
+   * Sets the function returning the identity of the files a request is
+   * served from, which goes into the ETags (see dataset::get_identity),
+   * the memory budget for the encoded responses, and the paths that must
+   * not be cached.  Encoded responses of files that have since changed
+   * are never hit again, so they age out of the cache.
+   * Must be called before the server starts.
+   */
+  void configure(
+      std::function<std::string()> identity,
+      std::size_t budget_bytes,
+      std::set<std::string> uncached_paths) {
+    file_identity = std::move(identity);
+    responses = std::make_unique<lru_cache<cached_response>>(budget_bytes);
+    this->uncached_paths = std::move(uncached_paths);
+  }
+
+  void before_handle(crow::request& req, crow::response& res, context& ctx) {
+    // The response to anything but a GET can depend on the body
+    if (!responses || req.method != crow::HTTPMethod::Get ||
+        uncached_paths.count(req.url) > 0) {
+      return;
+    }
+    ctx.etag = make_etag(req.raw_url);
+    ctx.encoding = choose_encoding(req.get_header_value("Accept-Encoding"));
+
+    // The tag of an encoded response has the encoding appended, either
+    // means the client already has this url's response
+    std::string client_tag = matching_etag(
+      req.get_header_value("If-None-Match"), ctx.etag);
+    if (!client_tag.empty()) {
+      not_modified.fetch_add(1, std::memory_order_relaxed);
+      res.code = crow::status::NOT_MODIFIED;
+      res.set_header("ETag", client_tag);
+      res.set_header("Vary", "Accept-Encoding");
+      ctx.answered = true;
+      res.end();
+      return;
+    }
+
+    if (!ctx.encoding.empty()) {
+      if (auto cached = responses->get(cache_key(ctx))) {
+        res.code = crow::status::OK;
+        res.body = cached->body;
+        for (auto& [name, value]: cached->headers) {
+          res.set_header(name, value);
+        }
+        ctx.answered = true;
+        res.end();
+      }
+    }
+  }
+
+  void after_handle(crow::request&, crow::response& res, context& ctx) {
+    if (ctx.etag.empty() || ctx.answered || res.code != crow::status::OK) {
+      return;
+    }
+    res.set_header("Vary", "Accept-Encoding");
+    if (ctx.encoding.empty() || !is_compressible(res)) {
+      res.set_header("ETag", ctx.etag);
+      return;
+    }
+
+    std::string encoded = compress(res.body, ctx.encoding == "gzip");
+    if (encoded.size() >= res.body.size()) {
+      res.set_header("ETag", ctx.etag);
+      return;
+    }
+    res.body = std::move(encoded);
+    res.set_header("Content-Encoding", ctx.encoding);
+    res.set_header("ETag", encoded_etag(ctx.etag, ctx.encoding));
+
+    auto cached = std::make_shared<cached_response>();
+    cached->body = res.body;
+    std::size_t bytes = sizeof(cached_response) + cached->body.size();
+    for (auto& [name, value]: res.headers) {
+      cached->headers.emplace_back(name, value);
+      bytes += name.size() + value.size();
+    }
+    responses->put(cache_key(ctx), cached, bytes);
+  }
+
+  stats get_stats() const {
+    return stats{
+      not_modified.load(std::memory_order_relaxed),
+      responses ? responses->get_stats() :
+        lru_cache<cached_response>::stats{}};
+  }
+
+  /**
+   * Returns whichever of the url's tags (plain or encoded) is listed in
+   * the If-None-Match header, or an empty string if none are.  As the
+   * spec requires for If-None-Match, weak tags match too.
+   * NOTE: "*" isn't treated as a match: it only says that some
+   * representation exists, which is true of every url here, so honouring
+   * it before the handler has run would answer 304 to clients that have
+   * never fetched the url and so have nothing to reuse.
+   */
+  static std::string matching_etag(
+      const std::string& header, const std::string& etag) {
+    std::stringstream list(header);
+    std::string tag;
+    while (std::getline(list, tag, ',')) {
+      tag = trim(tag);
+      if (tag.rfind("W/", 0) == 0) {
+        tag = tag.substr(2);
+      }
+      for (auto candidate: {
+          etag,
+          encoded_etag(etag, "gzip"),
+          encoded_etag(etag, "deflate")}) {
+        if (tag == candidate) {
+          return candidate;
+        }
+      }
+    }
+    return "";
+  }
+
+  /**
+   * Returns "gzip" or "deflate" if the Accept-Encoding header allows
+   * them (in that order of preference), otherwise an empty string
+   */
+  static std::string choose_encoding(const std::string& header) {
+    bool accepts_deflate = false;
+    std::stringstream list(header);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+      std::string coding = trim(item.substr(0, item.find(';')));
+      std::size_t q = item.find("q=");
+      if (q != std::string::npos && std::atof(item.c_str() + q + 2) <= 0) {
+        continue;
+      }
+      if (coding == "gzip") {
+        return coding;
+      }
+      accepts_deflate = accepts_deflate || coding == "deflate";
+    }
+    return accepts_deflate ? "deflate" : "";
+  }
+
+  /**
+   * Whether it's worth compressing the response.  The images, and
+   * values sent with encoding=shuffle-deflate, are already deflate
+   * compressed so they aren't.
+   */
+private:
+  // Bodies smaller than this aren't worth the Content-Encoding header
+  static constexpr std::size_t min_compress_bytes = 1024;
+
+  std::function<std::string()> file_identity;
+  std::unique_ptr<lru_cache<cached_response>> responses;
+  std::set<std::string> uncached_paths;
+  std::atomic<std::uint64_t> not_modified{0};
+
+  /**
+   * Returns the quoted strong ETag for the url, the same for as long
+   * as the files are unchanged and across server restarts
+   */
+  std::string make_etag(const std::string& url) const {
+    // 64 bit FNV-1a, which unlike std::hash is the same everywhere
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c: url) {
+      hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return "\"" + file_identity() + "-" + hex + "\"";
+  }
+
+  static std::string encoded_etag(
+      const std::string& etag, const std::string& encoding) {
+    return etag.substr(0, etag.size() - 1) + "-" + encoding + "\"";
+  }
+
+  static std::string cache_key(const context& ctx) {
+    return encoded_etag(ctx.etag, ctx.encoding);
+  }
+
+  static bool is_compressible(const crow::response& res) {
+    return res.body.size() >= min_compress_bytes &&
+      res.get_header_value("Content-Encoding").empty() &&
+      res.get_header_value("Content-Type").rfind("image/", 0) != 0 &&
+      res.get_header_value("X-Encoding").find("deflate") == std::string::npos;
+  }
+
+  /**
+   * Returns the body as a gzip stream, or as a zlib stream which is
+   * what HTTP calls "deflate"
+   */
+  static std::string compress(const std::string& body, bool gzip) {
+    z_stream stream{};
+    // 16 added to the window bits asks for a gzip header and trailer
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+          gzip ? 16 + MAX_WBITS : MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      throw std::runtime_error("http_cache: deflateInit2 failed");
+    }
+    std::string result(deflateBound(&stream, body.size()), '\0');
+    stream.next_in = (Bytef*)body.data();
+    stream.avail_in = body.size();
+    stream.next_out = (Bytef*)result.data();
+    stream.avail_out = result.size();
+    int rc = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (rc != Z_STREAM_END) {
+      throw std::runtime_error(
+        "http_cache: deflate failed with " + std::to_string(rc));
+    }
+    result.resize(stream.total_out);
+    return result;
+  }
+
+  static std::string trim(const std::string& s) {
+    std::size_t begin = s.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+      return "";
+    }
+    std::size_t end = s.find_last_not_of(" \t");
+    return s.substr(begin, end - begin + 1);
+  }
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "nc_types.hpp"
+
+#include <netcdf.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * A block of values read from a netCDF variable, kept exactly as the
+ * library handed it to us (native byte order, native element type).
+ * The bytes live in a std::string rather than a std::vector<char> so that
+ * they can be moved straight into a crow::response body without a copy.
+ */
+struct hyperslab {
+  nc_type type = NC_NAT;
+  std::size_t element_size = 0;
+
+  // The shape of the data as it is presented to clients.  Dimensions that
+  // were fixed to a single index via 'prefix_indices' are not included,
+  // which means a fully-specified read has an empty shape (a scalar).
+  std::vector<std::size_t> shape;
+
+  std::string data;
+
+  // The variable's scale_factor, add_offset and _FillValue.  'data' is
+  // always left packed, these are applied when converting the values.
+  packing_attributes packing;
+
+  std::size_t element_count() const {
+    return element_size == 0 ? 0 : data.size() / element_size;
+  }
+
+  const void* buffer() const {
+    return data.data();
+  }
+
+  /**
+   * Returns a copy of the values as doubles, eg for rendering, with the
+   * packing attributes applied and missing values set to NaN.
+   */
+  std::vector<double> to_doubles() const {
+    std::vector<double> result(element_count());
+    visit_nc_type(type, [&](auto tag) {
+      using T = typename decltype(tag)::type;
+      nc_kernels::to_doubles(
+        (const T*)buffer(), result.size(), result.data(), packing);
+    });
+    return result;
+  }
+};
+
+/**
+ * A general start/count/stride selection of a variable, as used by
+ * nc_get_vars.  Each list has one value per dimension of the variable,
+ * or is empty to use the defaults: start at 0, a stride of 1, and a count
+ * of every index from 'start' to the end of the dimension.
+ * Unlike the 'prefix_indices' reads, every dimension is kept in the
+ * shape of the result, even the ones with a count of 1.
+ */
+struct hyperslab_query {
+  std::vector<std::size_t> start;
+  std::vector<std::size_t> count;
+  std::vector<std::size_t> stride;
+
+  /**
+   * Returns a key that identifies this selection of the variable,
+   * eg for caching.  netCDF names can't contain '/' or '?'.
+   */
+  std::string cache_key(const std::string& variable_name) const {
+    std::string key = variable_name + "?";
+    for (auto* list: {&start, &count, &stride}) {
+      key += "/";
+      for (auto v: *list) {
+        key += std::to_string(v) + ",";
+      }
+    }
+    return key;
+  }
+
+  /**
+   * Fills in the defaults for a variable whose dimensions have the
+   * specified sizes, and checks the first and last index read along
+   * each dimension d by calling 'validate(d, index)', which is expected
+   * to throw if the index is out of range.
+   */
+  template <typename Validate>
+  void resolve(
+      const std::string& variable_name,
+      const std::vector<std::size_t>& dim_sizes,
+      Validate&& validate) {
+    const std::size_t dims = dim_sizes.size();
+    auto check_length = [&](std::vector<std::size_t>& list,
+                            const char* name, std::size_t fill) {
+      if (list.empty()) {
+        list.assign(dims, fill);
+      }
+      else if (list.size() != dims) {
+        throw std::invalid_argument(
+          std::string("Variable name '") + variable_name + "': has " +
+          std::to_string(dims) + " dimensions but you've specified " +
+          std::to_string(list.size()) + " " + name + " values");
+      }
+    };
+    bool default_count = count.empty();
+    check_length(start, "start", 0);
+    check_length(stride, "stride", 1);
+    check_length(count, "count", 0);
+
+    for (std::size_t d = 0; d < dims; ++d) {
+      if (stride[d] == 0) {
+        throw std::invalid_argument("stride values must be at least 1");
+      }
+      validate(d, start[d]);
+      if (default_count) {
+        count[d] = (dim_sizes[d] - start[d] + stride[d] - 1) / stride[d];
+      }
+      else if (count[d] == 0) {
+        throw std::invalid_argument("count values must be at least 1");
+      }
+      // Saturate rather than wrap around for absurdly large requests
+      std::size_t steps = count[d] - 1;
+      std::size_t last = steps > (SIZE_MAX - start[d]) / stride[d] ?
+        SIZE_MAX : start[d] + steps * stride[d];
+      validate(d, last);
+    }
+  }
+
+  /**
+   * Splits a resolved selection of a chunked variable into at most
+   * 'max_parts' selections along its first dimension with a count above
+   * 1, each of which covers whole chunks along that dimension so that no
+   * chunk has to be read (and decompressed) by more than one part.
+   * The dimensions before that one have a count of 1, so the values of
+   * the parts, one after the other, are the values of the whole.
+   * Returns just this selection when it can't be split.
+   */
+  std::vector<hyperslab_query> split(
+      const std::vector<std::size_t>& chunking,
+      std::size_t max_parts) const {
+    std::size_t d = 0;
+    while (d < count.size() && count[d] == 1) {
+      ++d;
+    }
+    if (d == count.size() || chunking.size() != count.size() ||
+        chunking[d] == 0 || max_parts < 2) {
+      return {*this};
+    }
+
+    // The first index of the selection in each chunk it touches
+    std::vector<std::size_t> chunk_starts;
+    std::size_t previous_chunk = SIZE_MAX;
+    for (std::size_t i = 0; i < count[d]; ++i) {
+      std::size_t chunk = (start[d] + i * stride[d]) / chunking[d];
+      if (chunk != previous_chunk) {
+        chunk_starts.push_back(i);
+        previous_chunk = chunk;
+      }
+    }
+    chunk_starts.push_back(count[d]);
+
+    const std::size_t chunks = chunk_starts.size() - 1;
+    const std::size_t parts = std::min(max_parts, chunks);
+    std::vector<hyperslab_query> result;
+    for (std::size_t p = 0; p < parts; ++p) {
+      std::size_t first = chunk_starts[p * chunks / parts];
+      std::size_t last = chunk_starts[(p + 1) * chunks / parts];
+      hyperslab_query part = *this;
+      part.start[d] = start[d] + first * stride[d];
+      part.count[d] = last - first;
+      result.push_back(std::move(part));
+    }
+    return result;
+  }
+};
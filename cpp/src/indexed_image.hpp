@@ -0,0 +1,44 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/**
+ * An 8-bit palette based image.  Our plots only ever use a handful of
+ * colours (the contour levels plus black/white for the decorations), so
+ * storing a palette index per pixel keeps the image small in memory and
+ * lets the encoders write it out without any colour quantization.
+ */
+struct indexed_image {
+  using rgb = std::array<std::uint8_t, 3>;
+
+  std::size_t width = 0;
+  std::size_t height = 0;
+  std::vector<std::uint8_t> pixels;
+  std::vector<rgb> palette;
+  // Opacity (0 - 255) of the first alpha.size() palette entries, the
+  // rest are opaque.  Empty for a fully opaque image.
+  std::vector<std::uint8_t> alpha;
+
+  indexed_image() = default;
+
+  indexed_image(std::size_t width, std::size_t height, std::uint8_t fill)
+    : width(width), height(height), pixels(width * height, fill)
+  {
+  }
+
+  void set(long x, long y, std::uint8_t index) {
+    if (x >= 0 && y >= 0 && (std::size_t)x < width && (std::size_t)y < height) {
+      pixels[y * width + x] = index;
+    }
+  }
+
+  void fill_rect(long x0, long y0, long x1, long y1, std::uint8_t index) {
+    for (long y = y0; y < y1; ++y) {
+      for (long x = x0; x < x1; ++x) {
+        set(x, y, index);
+      }
+    }
+  }
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "dataset.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A fixed pool of threads that do all of the netCDF library calls,
+ * fed through a request queue.
+ * NOTE: due to the concerns mentioned here...
+ *   https://github.com/Unidata/netcdf-c/issues/1373#issuecomment-637794942
+ *  ...we need to make sure that each NcFile instance is managed by no
+ *  more than one thread, so the I/O threads lease the open files from
+ *  a bounded pool shared between them (see file_pool) for the length of
+ *  each read.  This replaces the thread_local read_netcdf we used to
+ *  create for every crow thread, so the number of open files follows
+ *  the I/O concurrency and the pool's limit rather than the number of
+ *  HTTP threads (or, for a dataset of many files, threads x files).
+ * Reads of the same key that are queued or running at the same time
+ * are coalesced into a single read whose result goes to every caller.
+ * Each task is given the reader it should read from, which the task
+ * keeps alive, so that a task queued before the data was reloaded still
+ * reads the data it was queued for.
+ * Reads that nobody is waiting for yet (eg read_ahead's) can be queued in
+ * the background, which only runs when nothing else is queued and on at
+ * most half of the threads, so they never hold up requests.
+ */
+class io_scheduler {
+public:
+  enum class priority {
+    normal,
+    background,
+  };
+
+  struct stats {
+    std::uint64_t reads;
+    std::uint64_t coalesced;
+    std::size_t queued;
+    std::size_t queued_background;
+  };
+
+  explicit io_scheduler(std::size_t thread_count)
+    : max_background(std::max<std::size_t>(thread_count / 2, 1))
+  {
+    thread_count = std::max<std::size_t>(thread_count, 1);
+    for (std::size_t i = 0; i < thread_count; ++i) {
+      threads.emplace_back([this]() { run_thread(); });
+    }
+  }
+
+  ~io_scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t: threads) {
+      t.join();
+    }
+  }
+
+  io_scheduler(const io_scheduler&) = delete;
+  io_scheduler& operator=(const io_scheduler&) = delete;
+
+  /**
+   * Runs 'fn(*reader)' on one of the I/O threads and returns a future for
+   * its result.
+   */
+  template <typename F>
+  auto run(std::shared_ptr<const dataset_reader> reader, F fn)
+      -> std::future<decltype(fn(std::declval<const dataset_reader&>()))> {
+    using R = decltype(fn(std::declval<const dataset_reader&>()));
+    auto task = std::make_shared<std::packaged_task<R()>>(
+      [fn, reader]() { return fn(*reader); });
+    std::future<R> result = task->get_future();
+    enqueue([task]() { (*task)(); });
+    return result;
+  }
+
+  /**
+   * Runs 'load(*reader)' on one of the I/O threads unless a load for
+   * the same key is already queued or running, in which case the caller
+   * shares the result of that one instead.  The key must tell apart
+   * reads of different readers, see rest_server::versioned.
+   * A normal read that finds the same read queued in the background
+   * moves it to the normal queue, as somebody is now waiting for it.
+   */
+  std::shared_future<std::shared_ptr<const hyperslab>> read(
+      std::shared_ptr<const dataset_reader> reader,
+      const std::string& key,
+      std::function<std::shared_ptr<const hyperslab>(const dataset_reader&)> load,
+      priority p = priority::normal) {
+    auto promise = std::make_shared<
+      std::promise<std::shared_ptr<const hyperslab>>>();
+    std::shared_future<std::shared_ptr<const hyperslab>> future =
+      promise->get_future().share();
+    std::function<void()> task =
+      [this, reader, key, load, promise]() {
+        try {
+          promise->set_value(load(*reader));
+        }
+        catch (...) {
+          promise->set_exception(std::current_exception());
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        in_flight.erase(key);
+      };
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto existing = in_flight.find(key);
+      if (existing != in_flight.end()) {
+        coalesced.fetch_add(1, std::memory_order_relaxed);
+        if (p == priority::normal) {
+          promote(key);
+        }
+        return existing->second;
+      }
+      in_flight[key] = future;
+      if (p == priority::background) {
+        background_queue.emplace_back(key, std::move(task));
+      }
+      else {
+        queue.push_back(std::move(task));
+      }
+    }
+    reads.fetch_add(1, std::memory_order_relaxed);
+    wake.notify_one();
+    return future;
+  }
+
+  std::size_t thread_count() const {
+    return threads.size();
+  }
+
+  stats get_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats{
+      reads.load(std::memory_order_relaxed),
+      coalesced.load(std::memory_order_relaxed),
+      queue.size(),
+      background_queue.size()};
+  }
+
+private:
+  // The most threads running background reads at once
+  const std::size_t max_background;
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::function<void()>> queue;
+  // Reads queued with priority::background, with their keys
+  std::deque<std::pair<std::string, std::function<void()>>> background_queue;
+  std::size_t running_background = 0;
+  std::unordered_map<
+    std::string,
+    std::shared_future<std::shared_ptr<const hyperslab>>> in_flight;
+  bool stopping = false;
+
+  std::atomic<std::uint64_t> reads{0};
+  std::atomic<std::uint64_t> coalesced{0};
+
+  void enqueue(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(std::move(task));
+    }
+    wake.notify_one();
+  }
+
+  // Moves the background read of the key, if it's still queued, to the
+  // normal queue.  Called with the lock held.
+  void promote(const std::string& key) {
+    auto it = std::find_if(background_queue.begin(), background_queue.end(),
+      [&](const auto& queued) { return queued.first == key; });
+    if (it != background_queue.end()) {
+      queue.push_back(std::move(it->second));
+      background_queue.erase(it);
+    }
+  }
+
+  void run_thread() {
+    while (true) {
+      std::function<void()> task;
+      bool background = false;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto can_run_background = [this]() {
+          return !background_queue.empty() &&
+            running_background < max_background;
+        };
+        wake.wait(lock, [&]() {
+          return stopping || !queue.empty() || can_run_background();
+        });
+        if (!queue.empty()) {
+          task = std::move(queue.front());
+          queue.pop_front();
+        }
+        else if (stopping) {
+          return;
+        }
+        else {
+          task = std::move(background_queue.front().second);
+          background_queue.pop_front();
+          background = true;
+          ++running_background;
+        }
+      }
+      // If a file can't be opened the exception propagates to the
+      // task's future, and the next task will try again
+      task();
+      if (background) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          --running_background;
+        }
+        wake.notify_one();
+      }
+    }
+  }
+};
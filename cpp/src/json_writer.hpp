@@ -0,0 +1,209 @@
+#pragma once
+
+#include "hyperslab.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Serializes a hyperslab directly into a json string without building an
+ * intermediate nlohmann::json tree.  The output is byte-for-byte what
+ * `read_netcdf::get_data(...).dump()` produces, but it walks the raw
+ * buffer once and appends straight into the result, which avoids one
+ * heap allocated json value per element plus the copies made when
+ * nesting the lists.
+ * Every numeric netCDF type is supported.  Values are written in their
+ * own type (integers as integers, floats as the double of their shortest
+ * float form, see float_as_double) unless the variable has a scale_factor or add_offset, in which case
+ * the unpacked values are written as doubles.  Values equal to the
+ * variable's _FillValue are written as null.
+ */
+class json_writer {
+public:
+  /**
+   * Returns the hyperslab serialized as (possibly nested) json arrays,
+   * or as a single json value if the hyperslab is a scalar.
+   */
+  static std::string to_json(const hyperslab& slab) {
+    std::string out;
+    write(out, slab);
+    return out;
+  }
+
+  static void write(std::string& out, const hyperslab& slab) {
+    if (slab.packing.packed) {
+      // Missing values are already NaN after unpacking, and NaN is
+      // written as null, so there's no fill value to test for
+      std::vector<double> values = slab.to_doubles();
+      write_values<double, false>(out, values.data(), slab.shape, 0);
+      return;
+    }
+    // Resolve the type once, so that each loop below is compiled for
+    // one element type and one fill value policy
+    visit_nc_type(slab.type, [&](auto tag) {
+      using T = typename decltype(tag)::type;
+      const T* values = (const T*)slab.buffer();
+      T fill;
+      if (slab.packing.get_fill_value(fill)) {
+        write_values<T, true>(out, values, slab.shape, fill);
+      }
+      else {
+        write_values<T, false>(out, values, slab.shape, T());
+      }
+    });
+  }
+
+  /**
+   * Returns the double closest to the float's shortest decimal form, eg
+   * 0.1 for 0.1f rather than 0.10000000149011612.  Floats are written as
+   * this double, and read_netcdf::get_data stores them as it, so both
+   * print them with the double's notation (1234567.0 rather than the
+   * float's 1.234567e+06).
+   */
+  static double float_as_double(float value) {
+    if (!std::isfinite(value)) {
+      return value;
+    }
+    char buf[32] = {};
+    nlohmann::detail::to_chars(buf, buf + sizeof(buf) - 1, value);
+    return std::strtod(buf, nullptr);
+  }
+
+private:
+  /**
+   * Writes a single value at 'p' exactly as nlohmann::json's serializer
+   * would, returning the new end position.  Non-finite values are written
+   * as null just like nlohmann does, and so is the fill value.
+   * NOTE: I originally used std::to_chars for floating point values, but
+   * it produces the truly shortest digits while nlohmann's Grisu2
+   * occasionally emits a different (still round-tripping) last digit, so
+   * roughly 1 in 200 random doubles came out differently.  Calling the
+   * same routine that dump() uses is the only way to guarantee identical
+   * output.  Integers have only one representation so std::to_chars is
+   * fine for those.
+   */
+  template <typename T, bool HasFill>
+  static char* write_value(char* p, T value, T fill) {
+    if constexpr (HasFill) {
+      if (value == fill) {
+        return write_null(p);
+      }
+    }
+    if constexpr (std::is_floating_point_v<T>) {
+      if (!std::isfinite(value)) {
+        return write_null(p);
+      }
+      if constexpr (std::is_same_v<T, float>) {
+        return nlohmann::detail::to_chars(
+          p, p + max_value_length, float_as_double(value));
+      }
+      else {
+        return nlohmann::detail::to_chars(p, p + max_value_length, value);
+      }
+    }
+    else if constexpr (std::is_signed_v<T>) {
+      return std::to_chars(p, p + max_value_length, (long long)value).ptr;
+    }
+    else {
+      return std::to_chars(
+        p, p + max_value_length, (unsigned long long)value).ptr;
+    }
+  }
+
+  static char* write_null(char* p) {
+    memcpy(p, "null", 4);
+    return p + 4;
+  }
+
+  // "-1.2345678901234567e-308" is the longest a double can print, and
+  // "-9223372036854775808" the longest integer
+  static constexpr std::size_t max_value_length = 32;
+
+  /**
+   * Walks the buffer in row-major order, opening a '[' whenever we start
+   * a new list and closing every list that the element just completed.
+   * The output is sized for the worst case up front and written through
+   * a raw pointer, then trimmed, so there is no per-character bounds
+   * checking or reallocation in the loop.
+   */
+  template <typename T, bool HasFill>
+  static void write_values(
+      std::string& out, const T* values,
+      const std::vector<std::size_t>& shape, T fill) {
+    if (shape.empty()) {
+      char buf[max_value_length];
+      out.append(buf, write_value<T, HasFill>(buf, values[0], fill));
+      return;
+    }
+    std::size_t count = 1;
+    for (auto n: shape) {
+      count *= n;
+    }
+    if (count == 0) {
+      // get_data never creates the root list when a dimension is empty
+      // so the tree serializes as a null value
+      out += "null";
+      return;
+    }
+
+    const std::size_t dims = shape.size();
+    // strides[d] is the number of elements in one list at depth d
+    std::vector<std::size_t> strides(dims);
+    std::size_t stride = 1;
+    for (std::size_t d = dims; d-- > 0; ) {
+      stride *= shape[d];
+      strides[d] = stride;
+    }
+    const std::size_t row = shape[dims - 1];
+
+    // Each value is followed by at most one ',' and each row is
+    // surrounded by at most 'dims' brackets on either side
+    const std::size_t start = out.size();
+    out.resize(start + count * (max_value_length + 1) +
+      (count / row) * (2 * dims + 1));
+    char* p = out.data() + start;
+
+    for (std::size_t i = 0; i < count; i += row) {
+      // Open every list that starts at this element
+      std::size_t opening = 0;
+      for (std::size_t d = 0; d < dims; ++d) {
+        if (i % strides[d] == 0) {
+          opening = dims - d;
+          break;
+        }
+      }
+      if (i > 0) {
+        *p++ = ',';
+      }
+      memset(p, '[', opening);
+      p += opening;
+
+      // Write the innermost list in one go
+      p = write_value<T, HasFill>(p, values[i], fill);
+      for (std::size_t j = 1; j < row; ++j) {
+        *p++ = ',';
+        p = write_value<T, HasFill>(p, values[i + j], fill);
+      }
+
+      // Close every list that ends at this element
+      std::size_t end = i + row;
+      std::size_t closing = 0;
+      for (std::size_t d = 0; d < dims; ++d) {
+        if (end % strides[d] == 0) {
+          closing = dims - d;
+          break;
+        }
+      }
+      memset(p, ']', closing);
+      p += closing;
+    }
+    out.resize(p - out.data());
+  }
+};
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <crow.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+enum class log_level { debug, info, warning, error, off };
+
+/**
+ * Logging that stays off the threads doing the work.
+ * Each thread that logs gets its own ring buffer, which only it writes
+ * to and only the logger's background thread reads from, so a line is
+ * queued without taking a lock and the formatting of the time stamp and
+ * the writing and flushing of the output all happen in the background.
+ * Lines below the current level aren't even formatted, see `log`, so
+ * per-request lines can stay in the code at `debug` and cost a relaxed
+ * load each while that's off (which it is by default).
+ * NOTE: if a thread logs faster than the background thread drains its
+ *   buffer the lines that don't fit are dropped rather than making the
+ *   thread wait, and the number dropped is logged once there's room.
+ */
+class logger {
+public:
+  /**
+   * Returns the process wide logger, starting its thread on first use
+   */
+  static logger& get() {
+    static logger instance;
+    return instance;
+  }
+
+  logger(const logger&) = delete;
+  logger& operator=(const logger&) = delete;
+
+  ~logger() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+
+  void set_level(log_level level) {
+    current_level.store(level, std::memory_order_relaxed);
+  }
+
+  log_level get_level() const {
+    return current_level.load(std::memory_order_relaxed);
+  }
+
+  bool enabled(log_level level) const {
+    return level >= get_level() && level != log_level::off;
+  }
+
+  /**
+   * Queues the arguments, streamed one after the other, as a line if
+   * the level is enabled
+   */
+  template <typename... Args>
+  void log(log_level level, const Args&... args) {
+    if (!enabled(level)) {
+      return;
+    }
+    std::ostringstream message;
+    (message << ... << args);
+    write(level, message.str());
+  }
+
+  template <typename... Args>
+  static void debug(const Args&... args) {
+    get().log(log_level::debug, args...);
+  }
+
+  template <typename... Args>
+  static void info(const Args&... args) {
+    get().log(log_level::info, args...);
+  }
+
+  template <typename... Args>
+  static void warning(const Args&... args) {
+    get().log(log_level::warning, args...);
+  }
+
+  template <typename... Args>
+  static void error(const Args&... args) {
+    get().log(log_level::error, args...);
+  }
+
+  /**
+   * Queues a line that's already formatted, regardless of the level
+   */
+  void write(log_level level, std::string message) {
+    ring& r = local();
+    const std::size_t head = r.head.load(std::memory_order_relaxed);
+    if (head - r.tail.load(std::memory_order_acquire) == ring_size) {
+      r.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    entry& e = r.entries[head % ring_size];
+    e.time = std::chrono::system_clock::now();
+    e.level = level;
+    e.message = std::move(message);
+    r.head.store(head + 1, std::memory_order_release);
+    // Errors shouldn't wait for the next pass, everything else can
+    if (level >= log_level::error) {
+      wake.notify_one();
+    }
+  }
+
+  /**
+   * Returns once every line queued before the call has been written
+   */
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    const std::uint64_t target = passes + 2;
+    flush_requested = true;
+    wake.notify_one();
+    flushed.wait(lock, [&]() { return passes >= target || stopping; });
+  }
+
+  /**
+   * Parses a level as given on the command line
+   */
+  static log_level parse_level(const std::string& name) {
+    if (name == "debug") return log_level::debug;
+    if (name == "info") return log_level::info;
+    if (name == "warning") return log_level::warning;
+    if (name == "error") return log_level::error;
+    if (name == "off") return log_level::off;
+    throw std::invalid_argument("Unrecognized log level " + name);
+  }
+
+private:
+  static constexpr std::size_t ring_size = 1024;
+  // How long the background thread sleeps between passes
+  static constexpr std::chrono::milliseconds interval{50};
+
+  struct entry {
+    std::chrono::system_clock::time_point time;
+    log_level level;
+    std::string message;
+  };
+
+  struct ring {
+    // Numbers the threads in the output, in the order they first logged
+    std::size_t thread_number;
+    // Only ever increasing; the entries in [tail, head) are queued
+    alignas(64) std::atomic<std::size_t> head{0};
+    alignas(64) std::atomic<std::size_t> tail{0};
+    std::atomic<std::uint64_t> dropped{0};
+    // Cleared when the thread exits, after which the ring is removed
+    // once it has been drained
+    std::atomic<bool> alive{true};
+    entry entries[ring_size];
+  };
+
+  // Marks the thread's ring as abandoned when the thread exits
+  struct ring_owner {
+    std::shared_ptr<ring> r;
+    ~ring_owner() {
+      if (r) {
+        r->alive.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  std::atomic<log_level> current_level{log_level::info};
+
+  // Guards the list of rings (only changed when a thread first logs)
+  // and the flush handshake; never taken to queue a line
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable flushed;
+  std::vector<std::shared_ptr<ring>> rings;
+  std::size_t threads_seen = 0;
+  std::uint64_t passes = 0;
+  bool flush_requested = false;
+  bool stopping = false;
+  std::thread writer;
+
+  logger() {
+    writer = std::thread([this]() { run(); });
+  }
+
+  ring& local() {
+    thread_local ring_owner owner;
+    if (!owner.r) {
+      auto r = std::make_shared<ring>();
+      std::lock_guard<std::mutex> lock(mutex);
+      r->thread_number = ++threads_seen;
+      rings.push_back(r);
+      owner.r = std::move(r);
+    }
+    return *owner.r;
+  }
+
+  void run() {
+    std::vector<std::shared_ptr<ring>> snapshot;
+    std::string out;
+    while (true) {
+      bool stop;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait_for(lock, interval,
+          [this]() { return stopping || flush_requested; });
+        flush_requested = false;
+        stop = stopping;
+        snapshot = rings;
+      }
+
+      for (auto& r: snapshot) {
+        drain(*r, out);
+      }
+      if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        out.clear();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++passes;
+        // Forget the threads that have exited and whose lines are out
+        for (std::size_t i = 0; i < rings.size(); ) {
+          ring& r = *rings[i];
+          if (!r.alive.load(std::memory_order_acquire) &&
+              r.tail.load(std::memory_order_relaxed) ==
+                r.head.load(std::memory_order_acquire)) {
+            rings[i] = std::move(rings.back());
+            rings.pop_back();
+          }
+          else {
+            ++i;
+          }
+        }
+      }
+      flushed.notify_all();
+      if (stop) {
+        return;
+      }
+    }
+  }
+
+  void drain(ring& r, std::string& out) {
+    const std::size_t head = r.head.load(std::memory_order_acquire);
+    std::size_t tail = r.tail.load(std::memory_order_relaxed);
+    for (; tail != head; ++tail) {
+      entry& e = r.entries[tail % ring_size];
+      format(e.time, e.level, r.thread_number, e.message, out);
+      e.message = std::string();
+      r.tail.store(tail + 1, std::memory_order_release);
+    }
+    if (auto dropped = r.dropped.exchange(0, std::memory_order_relaxed)) {
+      format(std::chrono::system_clock::now(), log_level::warning,
+        r.thread_number,
+        std::to_string(dropped) + " lines dropped as the log fell behind",
+        out);
+    }
+  }
+
+  static void format(
+      std::chrono::system_clock::time_point time, log_level level,
+      std::size_t thread_number, const std::string& message,
+      std::string& out) {
+    static const char* const names[] = {
+      "DEBUG", "INFO", "WARNING", "ERROR", "OFF"};
+    const auto since_epoch = time.time_since_epoch();
+    const std::time_t seconds =
+      std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+    const long millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+      since_epoch).count() % 1000;
+    std::tm utc;
+    gmtime_r(&seconds, &utc);
+    char prefix[64];
+    std::size_t n = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(prefix + n, sizeof(prefix) - n, ".%03ldZ %-7s [%zu] ",
+      millis, names[(int)level], thread_number);
+    out += prefix;
+    out += message;
+    out += '\n';
+  }
+};
+
+/**
+ * Sends crow's own log lines through the logger rather than having crow
+ * write them to std::clog under its own lock, see `install`.
+ */
+class crow_log_handler: public crow::ILogHandler {
+public:
+  /**
+   * Routes crow's logging to the logger at the logger's level.
+   * NOTE: crow logs two lines for every request at its Info level, so
+   *   unless the logger is at debug crow is only asked for warnings and
+   *   the request lines are never even formatted.
+   */
+  static void install(log_level level) {
+    static crow_log_handler handler;
+    crow::logger::setHandler(&handler);
+    crow::logger::setLogLevel(
+      level == log_level::debug ? crow::LogLevel::Debug :
+      level == log_level::off ? crow::LogLevel::Critical :
+      level == log_level::error ? crow::LogLevel::Error :
+      crow::LogLevel::Warning);
+  }
+
+  void log(std::string message, crow::LogLevel level) override {
+    log_level mapped =
+      level == crow::LogLevel::Debug ? log_level::debug :
+      level == crow::LogLevel::Info ? log_level::debug :
+      level == crow::LogLevel::Warning ? log_level::warning :
+      log_level::error;
+    logger& l = logger::get();
+    if (l.enabled(mapped)) {
+      l.write(mapped, "crow: " + message);
+    }
+  }
+};
+
+/**
+ * Crow middleware logging one line per request at debug level: the
+ * method, the url with its parameters, the status, the size of the body
+ * and how long it took.  Off by default, see logger.
+ */
+class access_log {
+public:
+  struct context {
+    std::chrono::steady_clock::time_point start;
+  };
+
+  void before_handle(crow::request&, crow::response&, context& ctx) {
+    if (logger::get().enabled(log_level::debug)) {
+      ctx.start = std::chrono::steady_clock::now();
+    }
+  }
+
+  void after_handle(crow::request& req, crow::response& res, context& ctx) {
+    logger& l = logger::get();
+    if (!l.enabled(log_level::debug)) {
+      return;
+    }
+    std::chrono::duration<double, std::milli> ms =
+      std::chrono::steady_clock::now() - ctx.start;
+    char duration[32];
+    snprintf(duration, sizeof(duration), "%.3f ms", ms.count());
+    l.write(log_level::debug,
+      crow::method_name(req.method) + " " + req.raw_url + " " +
+      std::to_string(res.code) + " " + std::to_string(res.body.size()) +
+      " bytes " + duration);
+  }
+};
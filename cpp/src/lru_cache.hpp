@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A thread-safe, memory bounded LRU cache shared by all of crow's
+ * worker threads.
+ * The keys are hashed across a number of independent shards, each with
+ * its own lock, so that threads looking up different keys rarely contend
+ * with each other.  The memory budget is shared by all of them: a put
+ * that goes over it evicts the least recently used entries of the whole
+ * cache, found by looking at the oldest entry of each shard in turn.  Values are
+ * handed out as shared_ptr<const V> which means an entry can be evicted
+ * while a request is still using it without any further coordination.
+ */
+template <typename V>
+class lru_cache {
+public:
+  struct stats {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t evictions;
+    // Values that weren't cached because they're larger than the budget
+    std::uint64_t rejected;
+    std::size_t entries;
+    std::size_t bytes;
+    std::size_t budget_bytes;
+  };
+
+  using hash_function = std::function<std::size_t(const std::string&)>;
+
+  /**
+   * A budget of 0 disables caching entirely.  'hash' picks the shard of
+   * each key, see rekey for why it may only hash part of the key.
+   */
+  explicit lru_cache(
+      std::size_t budget_bytes,
+      std::size_t shard_count = 16,
+      hash_function hash = std::hash<std::string>())
+    : budget_bytes(budget_bytes), hash(std::move(hash))
+  {
+    shard_count = std::max<std::size_t>(shard_count, 1);
+    for (std::size_t i = 0; i < shard_count; ++i) {
+      shards.push_back(std::make_unique<shard>());
+    }
+  }
+
+  /**
+   * Returns the cached value or nullptr if there isn't one, and marks
+   * the entry as the most recently used.
+   */
+  std::shared_ptr<const V> get(const std::string& key) {
+    shard& s = get_shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.index.find(key);
+    if (it == s.index.end()) {
+      misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    s.order.splice(s.order.begin(), s.order, it->second);
+    it->second->last_used = clock.fetch_add(1, std::memory_order_relaxed);
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return it->second->value;
+  }
+
+  /**
+   * Stores the value, evicting least recently used entries until the
+   * cache fits in the budget.  Values that are larger than the whole
+   * budget are simply not cached, see stats::rejected.
+   */
+  void put(
+      const std::string& key,
+      std::shared_ptr<const V> value,
+      std::size_t bytes) {
+    if (bytes > budget_bytes) {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    shard& s = get_shard(key);
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      auto existing = s.index.find(key);
+      if (existing != s.index.end()) {
+        remove(s, existing->second);
+        s.index.erase(existing);
+      }
+      s.order.push_front(entry{key, std::move(value), bytes,
+        clock.fetch_add(1, std::memory_order_relaxed)});
+      s.index[key] = s.order.begin();
+      s.bytes += bytes;
+      total_bytes.fetch_add(bytes);
+    }
+    while (over_budget()) {
+      if (!evict_oldest()) {
+        break;
+      }
+    }
+  }
+
+  /**
+   * Returns the cached value, or calls 'load' to produce it and caches
+   * the result.  'size_of' returns the number of bytes the value uses.
+   * NOTE: two threads missing on the same key at the same time will
+   * both call 'load', the cache doesn't try to coordinate that.
+   */
+  template <typename Load, typename SizeOf>
+  std::shared_ptr<const V> get_or_load(
+      const std::string& key, Load&& load, SizeOf&& size_of) {
+    std::shared_ptr<const V> value = get(key);
+    if (value == nullptr) {
+      value = std::make_shared<const V>(load());
+      put(key, value, size_of(*value));
+    }
+    return value;
+  }
+
+  /**
+   * Moves every entry to the key 'rename(key)' returns, or drops it when
+   * that is empty, and returns how many were kept.  The entries keep
+   * their values, so this is how a cache survives its keys changing
+   * meaning, eg when the file they were read from changes.
+   * Each shard is renamed in place under its own lock, so the rest of
+   * the cache carries on being used meanwhile.  An entry whose new key
+   * 'hash' puts in another shard is moved there afterwards, and misses
+   * in between, which a hash that ignores the part of the key that
+   * changes avoids.
+   * NOTE: 'rename' is called with a shard locked, so mustn't use the
+   *   cache.  Entries put while this runs may or may not be renamed.
+   */
+  template <typename Rename>
+  std::size_t rekey(Rename&& rename) {
+    std::size_t kept = 0;
+    std::vector<entry> moving;
+    for (auto& s: shards) {
+      std::lock_guard<std::mutex> lock(s->mutex);
+      s->index.clear();
+      for (auto it = s->order.begin(); it != s->order.end(); ) {
+        std::string key = rename(it->key);
+        // Two entries renamed to the same key keep the more recently
+        // used, which comes first
+        if (key.empty() || s->index.count(key)) {
+          it = remove(*s, it);
+          continue;
+        }
+        it->key = std::move(key);
+        if (&get_shard(it->key) != s.get()) {
+          moving.push_back(std::move(*it));
+          it = remove(*s, it);
+          continue;
+        }
+        s->index[it->key] = it;
+        ++kept;
+        ++it;
+      }
+    }
+    // Least recently used first, so that the most recently used end up
+    // at the front of their new shards
+    for (auto e = moving.rbegin(); e != moving.rend(); ++e) {
+      put(e->key, std::move(e->value), e->bytes);
+      ++kept;
+    }
+    return kept;
+  }
+
+  stats get_stats() const {
+    stats result{
+      hits.load(std::memory_order_relaxed),
+      misses.load(std::memory_order_relaxed),
+      evictions.load(std::memory_order_relaxed),
+      rejected.load(std::memory_order_relaxed),
+      0, 0, budget_bytes};
+    for (auto& s: shards) {
+      std::lock_guard<std::mutex> lock(s->mutex);
+      result.entries += s->index.size();
+      result.bytes += s->bytes;
+    }
+    return result;
+  }
+
+private:
+  struct entry {
+    std::string key;
+    std::shared_ptr<const V> value;
+    std::size_t bytes;
+    // When it was last put or hit, see clock
+    std::uint64_t last_used;
+  };
+
+  struct shard {
+    std::mutex mutex;
+    // Most recently used at the front
+    std::list<entry> order;
+    std::unordered_map<std::string, typename std::list<entry>::iterator> index;
+    std::size_t bytes = 0;
+  };
+
+  bool over_budget() const {
+    return total_bytes.load() > budget_bytes;
+  }
+
+  // Removes the entry from the shard, which must be locked, and from
+  // its index if it's there, returning the entry after it
+  typename std::list<entry>::iterator remove(
+      shard& s, typename std::list<entry>::iterator it) {
+    s.bytes -= it->bytes;
+    total_bytes.fetch_sub(it->bytes);
+    return s.order.erase(it);
+  }
+
+  /**
+   * Evicts the least recently used entry of the whole cache, returning
+   * false when there's nothing left to evict.
+   * NOTE: only one shard is ever locked at a time, so that threads
+   *   evicting from each other's shards can't deadlock.  Another thread
+   *   may use the entry between finding and evicting it, which only
+   *   makes the choice slightly less than perfect.
+   */
+  bool evict_oldest() {
+    shard* oldest = nullptr;
+    std::uint64_t oldest_use = UINT64_MAX;
+    for (auto& s: shards) {
+      std::lock_guard<std::mutex> lock(s->mutex);
+      if (!s->order.empty() && s->order.back().last_used < oldest_use) {
+        oldest = s.get();
+        oldest_use = s->order.back().last_used;
+      }
+    }
+    if (oldest == nullptr) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(oldest->mutex);
+    if (!oldest->order.empty()) {
+      oldest->index.erase(oldest->order.back().key);
+      remove(*oldest, std::prev(oldest->order.end()));
+      evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  shard& get_shard(const std::string& key) {
+    return *shards[hash(key) % shards.size()];
+  }
+
+  const std::size_t budget_bytes;
+  const hash_function hash;
+  std::vector<std::unique_ptr<shard>> shards;
+  std::atomic<std::uint64_t> hits{0};
+  std::atomic<std::uint64_t> misses{0};
+  std::atomic<std::uint64_t> evictions{0};
+  std::atomic<std::uint64_t> rejected{0};
+  // The bytes of every shard, which is what the budget is for
+  std::atomic<std::size_t> total_bytes{0};
+  // Ticks once for every put and hit, ordering the entries' last uses
+  std::atomic<std::uint64_t> clock{0};
+};
@@ -1,21 +1,176 @@
 #include "rest_server.hpp"
+#include "slice_exporter.hpp"
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
 
 int main(int argc, char *argv[])
 {
-  // Ensure we have one argument
+  // Ensure we have the file argument, followed by any options
   const int argument_count = argc - 1;
   if (argument_count < 1) {
-    printf("Usage: %s <netCDF file>\n", argv[0]);
+    printf(
+      "Usage: %s <netCDF file, directory or glob> [--cache-mb <megabytes>] "
+      "[--response-cache-mb <megabytes>] [--io-threads <count>] [--http-threads <count>]\n"
+      "       [--max-open-files <count>] [--no-watch] [--timeseries-dir <directory>]\n"
+      "       [--playback-read-ahead <frames>] [--rendered-image-mb <megabytes>]\n"
+      "       [--log-level debug|info|warning|error|off]\n"
+      "       %s <netCDF file, directory or glob> --export <directory> [--var <variable>] "
+      "[--format png|npy|json] [--range slice|global] "
+      "[--threads <count>] [--io-threads <count>] [--read-ahead <slices>]\n",
+      argv[0], argv[0]);
     return EXIT_FAILURE;
   }
 
   const char* file_name = argv[1];
 
-  printf("Running netcdf-api with netCDF file %s\n", file_name);
-  fflush(stdout);
+  rest_server::options opts;
+  slice_exporter::options export_opts;
+  int i = 2;
+  // Reads the value of the option at argv[i], which must be a whole
+  // number of at most 'max', otherwise the option is reported like any
+  // other that isn't recognized
+  auto number = [&](unsigned long long max) {
+    const char* text = argv[++i];
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long value = std::strtoull(text, &end, 10);
+    if (!std::isdigit((unsigned char)*text) || *end != '\0' ||
+        errno == ERANGE || value > max) {
+      throw std::invalid_argument(text);
+    }
+    return value;
+  };
+  const unsigned long long max_count = std::numeric_limits<std::size_t>::max();
+  const unsigned long long max_mb = max_count / (1024 * 1024);
+  try {
+    for (; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--cache-mb" && i + 1 < argc) {
+        opts.cache_bytes = number(max_mb) * 1024 * 1024;
+      }
+      else if (arg == "--response-cache-mb" && i + 1 < argc) {
+        opts.response_cache_bytes = number(max_mb) * 1024 * 1024;
+      }
+      else if (arg == "--io-threads" && i + 1 < argc) {
+        opts.io_threads = number(max_count);
+        export_opts.io_threads = opts.io_threads;
+      }
+      else if (arg == "--max-open-files" && i + 1 < argc) {
+        opts.max_open_files = number(max_count);
+        export_opts.max_open_files = opts.max_open_files;
+      }
+      else if (arg == "--http-threads" && i + 1 < argc) {
+        opts.http_threads = number(std::numeric_limits<std::uint16_t>::max());
+      }
+      else if (arg == "--no-watch") {
+        opts.watch = false;
+      }
+      else if (arg == "--timeseries-dir" && i + 1 < argc) {
+        opts.timeseries_dir = argv[++i];
+      }
+      else if (arg == "--playback-read-ahead" && i + 1 < argc) {
+        opts.read_ahead = number(max_count);
+      }
+      else if (arg == "--rendered-image-mb" && i + 1 < argc) {
+        opts.rendered_image_bytes = number(max_mb) * 1024 * 1024;
+      }
+      else if (arg == "--log-level" && i + 1 < argc) {
+        std::string level = argv[++i];
+        try {
+          logger::get().set_level(logger::parse_level(level));
+        }
+        catch (std::invalid_argument& e) {
+          printf("%s\n", e.what());
+          return EXIT_FAILURE;
+        }
+      }
+      else if (arg == "--export" && i + 1 < argc) {
+        export_opts.out_dir = argv[++i];
+      }
+      else if (arg == "--var" && i + 1 < argc) {
+        export_opts.variable = argv[++i];
+      }
+      else if (arg == "--format" && i + 1 < argc) {
+        std::string format = argv[++i];
+        if (format == "png") {
+          export_opts.fmt = slice_exporter::format::png;
+        }
+        else if (format == "npy") {
+          export_opts.fmt = slice_exporter::format::npy;
+        }
+        else if (format == "json") {
+          export_opts.fmt = slice_exporter::format::json;
+        }
+        else {
+          printf("Unrecognized format %s\n", format.c_str());
+          return EXIT_FAILURE;
+        }
+      }
+      else if (arg == "--range" && i + 1 < argc) {
+        std::string range = argv[++i];
+        if (range != "slice" && range != "global") {
+          printf("Unrecognized range %s\n", range.c_str());
+          return EXIT_FAILURE;
+        }
+        export_opts.global_range = range == "global";
+      }
+      else if (arg == "--threads" && i + 1 < argc) {
+        export_opts.threads = number(max_count);
+      }
+      else if (arg == "--read-ahead" && i + 1 < argc) {
+        export_opts.read_ahead = number(max_count);
+      }
+      else {
+        printf("Unrecognized option %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  catch (std::invalid_argument&) {
+    printf("Unrecognized option %s %s\n", argv[i - 1], argv[i]);
+    return EXIT_FAILURE;
+  }
+
+  // Every file is indexed up front, so any that can't be read or don't
+  // match the others are reported before doing anything else
+  std::shared_ptr<const dataset> data;
+  try {
+    data = dataset::open(file_name);
+  }
+  catch (std::exception& e) {
+    printf("Unable to open %s: %s\n", file_name, e.what());
+    return EXIT_FAILURE;
+  }
+
+  // With --export we write the slices out and exit rather than serve them
+  if (!export_opts.out_dir.empty()) {
+    printf("Exporting %s from netCDF file %s to %s\n",
+      export_opts.variable.c_str(), file_name, export_opts.out_dir.c_str());
+    fflush(stdout);
+    auto started = std::chrono::steady_clock::now();
+    try {
+      std::size_t count = slice_exporter::run(data, export_opts);
+      std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - started;
+      printf("Wrote %zu slices in %.1f s\n", count, elapsed.count());
+    }
+    catch (std::exception& e) {
+      printf("Export failed: %s\n", e.what());
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  crow_log_handler::install(logger::get().get_level());
+  logger::info("Running netcdf-api with netCDF file ", file_name);
 
-  rest_server server(8080, file_name);
+  rest_server server(opts, data);
   server.run_and_wait();
 
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <crow.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Counters and latency histograms served in the Prometheus text format,
+ * see https://prometheus.io/docs/instrumenting/exposition_formats/
+ * Recording is lock-free: every value lives in a slot that is striped
+ * across a number of copies, each thread adds to the copy it was handed
+ * the first time it recorded anything, and the copies are only summed
+ * when the metrics are scraped.  With up to 'stripe_count' threads
+ * they never write the same cache lines; past that threads share copies,
+ * which is still correct as the adds are atomic.
+ * All the series are registered up front (eg when the server starts) so
+ * that recording is just an index into the thread's copy.
+ */
+class metrics {
+public:
+  // A counter is one slot
+  struct counter {
+    std::size_t slot;
+  };
+
+  // A histogram is a slot per bucket, then the overflow count, then the
+  // sum of the observed values in nanoseconds
+  struct histogram {
+    std::size_t slot;
+  };
+
+  // Upper bounds of the histogram buckets in seconds
+  static constexpr std::array<double, 16> buckets = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+    0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+  metrics() {
+    for (auto& s: copies) {
+      s = std::make_unique<stripe>();
+    }
+  }
+
+  metrics(const metrics&) = delete;
+  metrics& operator=(const metrics&) = delete;
+
+  /**
+   * Registers a counter, 'labels' being eg `route="/get-data"`
+   */
+  counter add_counter(
+      const std::string& name, const std::string& help,
+      const std::string& labels = "") {
+    return counter{add_series(name, help, "counter", labels, 1)};
+  }
+
+  /**
+   * Registers a histogram of durations in seconds
+   */
+  histogram add_histogram(
+      const std::string& name, const std::string& help,
+      const std::string& labels = "") {
+    return histogram{
+      add_series(name, help, "histogram", labels, buckets.size() + 2)};
+  }
+
+  void increment(counter c, std::uint64_t n = 1) {
+    local().slots[c.slot].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void observe(histogram h, std::chrono::nanoseconds duration) {
+    const double seconds = duration.count() / 1e9;
+    std::size_t bucket = 0;
+    while (bucket < buckets.size() && seconds > buckets[bucket]) {
+      ++bucket;
+    }
+    stripe& s = local();
+    s.slots[h.slot + bucket].fetch_add(1, std::memory_order_relaxed);
+    s.slots[h.slot + buckets.size() + 1].fetch_add(
+      duration.count(), std::memory_order_relaxed);
+  }
+
+  /**
+   * Observes the time until it goes out of scope
+   */
+  class timer {
+  public:
+    timer(metrics& m, histogram h)
+      : m(m), h(h), start(std::chrono::steady_clock::now()) {}
+    ~timer() {
+      m.observe(h, std::chrono::steady_clock::now() - start);
+    }
+    timer(const timer&) = delete;
+    timer& operator=(const timer&) = delete;
+  private:
+    metrics& m;
+    histogram h;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  timer time(histogram h) {
+    return timer(*this, h);
+  }
+
+  /**
+   * Returns the sum of a counter over all the threads
+   */
+  std::uint64_t get(counter c) const {
+    return sum(c.slot);
+  }
+
+  /**
+   * Returns every series in the Prometheus text format
+   */
+  std::string render() const {
+    std::lock_guard<std::mutex> lock(families_mutex);
+    std::string out;
+    for (auto& f: families) {
+      out += "# HELP " + f.name + " " + f.help + "\n";
+      out += "# TYPE " + f.name + " " + f.type + "\n";
+      for (auto& s: f.series) {
+        if (f.type == "counter") {
+          out += f.name + braces(s.labels) + " " +
+            std::to_string(sum(s.slot)) + "\n";
+          continue;
+        }
+        std::uint64_t cumulative = 0;
+        for (std::size_t b = 0; b <= buckets.size(); ++b) {
+          cumulative += sum(s.slot + b);
+          std::string le = b < buckets.size() ? format(buckets[b]) : "+Inf";
+          out += f.name + "_bucket" +
+            braces(join(s.labels, "le=\"" + le + "\"")) + " " +
+            std::to_string(cumulative) + "\n";
+        }
+        out += f.name + "_sum" + braces(s.labels) + " " +
+          format(sum(s.slot + buckets.size() + 1) / 1e9) + "\n";
+        out += f.name + "_count" + braces(s.labels) + " " +
+          std::to_string(cumulative) + "\n";
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Formats a value that's worked out when scraping (eg the size of a
+   * cache) the same way as the registered series
+   */
+  static std::string format_value(
+      const std::string& name, const std::string& help,
+      const char* type, double value) {
+    return "# HELP " + name + " " + help + "\n" +
+      "# TYPE " + name + " " + type + "\n" +
+      name + " " + format(value) + "\n";
+  }
+
+private:
+  static constexpr std::size_t stripe_count = 64;
+  static constexpr std::size_t max_slots = 1024;
+
+  struct alignas(64) stripe {
+    std::array<std::atomic<std::uint64_t>, max_slots> slots{};
+  };
+
+  struct labelled_series {
+    std::string labels;
+    std::size_t slot;
+  };
+
+  struct family {
+    std::string name;
+    std::string help;
+    std::string type;
+    std::vector<labelled_series> series;
+  };
+
+  std::array<std::unique_ptr<stripe>, stripe_count> copies;
+  std::atomic<std::size_t> next_stripe{0};
+  mutable std::mutex families_mutex;
+  std::vector<family> families;
+  std::size_t slots_used = 0;
+
+  std::size_t add_series(
+      const std::string& name, const std::string& help,
+      const char* type, const std::string& labels, std::size_t slots) {
+    std::lock_guard<std::mutex> lock(families_mutex);
+    if (slots_used + slots > max_slots) {
+      throw std::logic_error("metrics: too many series");
+    }
+    std::size_t slot = slots_used;
+    slots_used += slots;
+    for (auto& f: families) {
+      if (f.name == name) {
+        f.series.push_back({labels, slot});
+        return slot;
+      }
+    }
+    families.push_back({name, help, type, {{labels, slot}}});
+    return slot;
+  }
+
+  stripe& local() {
+    // Handed out round robin the first time each thread records
+    thread_local std::size_t index =
+      next_stripe.fetch_add(1, std::memory_order_relaxed) % stripe_count;
+    return *copies[index];
+  }
+
+  std::uint64_t sum(std::size_t slot) const {
+    std::uint64_t total = 0;
+    for (auto& s: copies) {
+      total += s->slots[slot].load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  static std::string braces(const std::string& labels) {
+    return labels.empty() ? "" : "{" + labels + "}";
+  }
+
+  static std::string join(const std::string& a, const std::string& b) {
+    return a.empty() ? b : a + "," + b;
+  }
+
+  static std::string format(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", value);
+    return buf;
+  }
+};
+
+/**
+ * Crow middleware counting the requests to each route, their latency,
+ * the bytes sent, and how many requests are in flight.
+ * It should be the first middleware so that it also times requests that
+ * later middlewares answer themselves (eg http_cache's 304s).
+ */
+class request_metrics {
+public:
+  struct context {
+    std::size_t route = 0;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  /**
+   * Registers the series for each of the routes, which are matched by
+   * the url's path or, for routes ending in '/', by its prefix so that
+   * eg "/tiles/" covers every tile.  Anything else counts as "other".
+   * Must be called before the server starts.
+   */
+  void configure(metrics& registry, std::vector<std::string> routes) {
+    this->registry = &registry;
+    routes.push_back("other");
+    for (auto& r: routes) {
+      const std::string label = "route=\"" + r + "\"";
+      route_series s{r, {}, {}, {}, {}};
+      for (int c = 0; c < 5; ++c) {
+        s.requests[c] = registry.add_counter(
+          "netcdf_api_requests_total",
+          "Requests served by route and status class",
+          label + ",code=\"" + std::to_string(c + 1) + "xx\"");
+      }
+      s.latency = registry.add_histogram(
+        "netcdf_api_request_duration_seconds",
+        "Time from receiving a request to having its response", label);
+      s.bytes = registry.add_counter(
+        "netcdf_api_response_bytes_total",
+        "Bytes of response bodies sent", label);
+      s.started = registry.add_counter(
+        "netcdf_api_requests_started_total",
+        "Requests started, the difference to those finished being "
+        "the requests in flight", label);
+      route_table.push_back(s);
+    }
+  }
+
+  /**
+   * Returns the number of requests being handled right now
+   */
+  std::uint64_t in_flight() const {
+    std::uint64_t started = 0, finished = 0;
+    for (auto& s: route_table) {
+      started += registry->get(s.started);
+      for (auto& c: s.requests) {
+        finished += registry->get(c);
+      }
+    }
+    return started - std::min(started, finished);
+  }
+
+  void before_handle(crow::request& req, crow::response&, context& ctx) {
+    if (!registry) {
+      return;
+    }
+    ctx.route = find_route(req.url);
+    ctx.start = std::chrono::steady_clock::now();
+    registry->increment(route_table[ctx.route].started);
+  }
+
+  void after_handle(crow::request&, crow::response& res, context& ctx) {
+    if (!registry) {
+      return;
+    }
+    const route_series& s = route_table[ctx.route];
+    registry->observe(s.latency, std::chrono::steady_clock::now() - ctx.start);
+    registry->increment(s.requests[std::clamp(res.code / 100, 1, 5) - 1]);
+    registry->increment(s.bytes, res.body.size());
+  }
+
+private:
+  struct route_series {
+    std::string route;
+    std::array<metrics::counter, 5> requests;
+    metrics::histogram latency;
+    metrics::counter bytes;
+    metrics::counter started;
+  };
+
+  metrics* registry = nullptr;
+  std::vector<route_series> route_table;
+
+  std::size_t find_route(const std::string& url) const {
+    for (std::size_t i = 0; i + 1 < route_table.size(); ++i) {
+      const std::string& r = route_table[i].route;
+      if (r.back() == '/' ? url.rfind(r, 0) == 0 : url == r) {
+        return i;
+      }
+    }
+    return route_table.size() - 1;
+  }
+};
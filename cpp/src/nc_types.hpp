@@ -0,0 +1,169 @@
+#pragma once
+
+#include <netcdf.h>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Compile time dispatch on the primitive netCDF numeric types.
+ * Rather than switching on the type for every element, callers switch
+ * once with `visit_nc_type` and get handed an `nc_type_tag<T>` so that
+ * the loop over the values is instantiated separately for each C++ type.
+ */
+template <typename T>
+struct nc_type_tag {
+  using type = T;
+};
+
+/**
+ * Calls 'f(nc_type_tag<T>{})' where T is the C++ type that netCDF uses
+ * for 'type', and returns its result.  Throws for the types that don't
+ * hold numbers (NC_CHAR, NC_STRING and the user defined types).
+ */
+template <typename F>
+decltype(auto) visit_nc_type(nc_type type, F&& f) {
+  switch (type) {
+    case NC_BYTE:   return f(nc_type_tag<signed char>{});
+    case NC_UBYTE:  return f(nc_type_tag<unsigned char>{});
+    case NC_SHORT:  return f(nc_type_tag<short>{});
+    case NC_USHORT: return f(nc_type_tag<unsigned short>{});
+    case NC_INT:    return f(nc_type_tag<int>{});
+    case NC_UINT:   return f(nc_type_tag<unsigned int>{});
+    case NC_INT64:  return f(nc_type_tag<long long>{});
+    case NC_UINT64: return f(nc_type_tag<unsigned long long>{});
+    case NC_FLOAT:  return f(nc_type_tag<float>{});
+    case NC_DOUBLE: return f(nc_type_tag<double>{});
+    default:
+      throw std::invalid_argument(
+        "Only numeric variables are supported, netCDF type " +
+        std::to_string(type) + " is not");
+  }
+}
+
+inline bool is_numeric_nc_type(nc_type type) {
+  return type >= NC_BYTE && type <= NC_UINT64 && type != NC_CHAR;
+}
+
+/**
+ * Returns the CDL name of the type (as ncdump prints it), eg "double"
+ */
+inline std::string nc_type_name(nc_type type) {
+  switch (type) {
+    case NC_BYTE:   return "byte";
+    case NC_CHAR:   return "char";
+    case NC_SHORT:  return "short";
+    case NC_INT:    return "int";
+    case NC_FLOAT:  return "float";
+    case NC_DOUBLE: return "double";
+    case NC_UBYTE:  return "ubyte";
+    case NC_USHORT: return "ushort";
+    case NC_UINT:   return "uint";
+    case NC_INT64:  return "int64";
+    case NC_UINT64: return "uint64";
+    case NC_STRING: return "string";
+    default:        return "user defined";
+  }
+}
+
+/**
+ * Returns the first value of a buffer of 'type' as a double, eg for
+ * reading a numeric attribute.
+ */
+inline double first_value_as_double(nc_type type, const void* buffer) {
+  return visit_nc_type(type, [&](auto tag) {
+    using T = typename decltype(tag)::type;
+    T value;
+    memcpy(&value, buffer, sizeof(T));
+    return (double)value;
+  });
+}
+
+/**
+ * The CF conventions' packing attributes of a variable, see
+ * https://cfconventions.org/Data/cf-conventions/cf-conventions-1.11/cf-conventions.html#packed-data
+ * The unpacked value is 'packed * scale_factor + add_offset', and values
+ * equal to _FillValue are missing, which we serve as null / NaN.
+ */
+struct packing_attributes {
+  double scale_factor = 1;
+  double add_offset = 0;
+  // True when either scale_factor or add_offset was specified
+  bool packed = false;
+  // The bytes of _FillValue in the variable's own type, or empty if the
+  // variable doesn't have one.  We compare in the variable's type rather
+  // than as doubles so that 64 bit integers compare exactly.
+  std::string fill_value;
+
+  template <typename T>
+  bool get_fill_value(T& value) const {
+    if (fill_value.size() != sizeof(T)) {
+      return false;
+    }
+    memcpy(&value, fill_value.data(), sizeof(T));
+    return true;
+  }
+};
+
+/**
+ * Kernels for converting a buffer of one of the netCDF types to doubles.
+ * Each one is a single pass with no branches in the body, so that the
+ * compiler can vectorize it (the fill value test becomes a compare and
+ * blend rather than a jump).
+ */
+namespace nc_kernels {
+
+template <typename T>
+void convert(const T* in, std::size_t n, double* out) {
+  for (std::size_t i = 0; i < n; ++i) {
+    out[i] = (double)in[i];
+  }
+}
+
+template <typename T>
+void unpack(
+    const T* in, std::size_t n, double* out,
+    double scale_factor, double add_offset) {
+  for (std::size_t i = 0; i < n; ++i) {
+    out[i] = (double)in[i] * scale_factor + add_offset;
+  }
+}
+
+/**
+ * Replaces every value whose packed value is 'fill' with NaN.  This is
+ * done as a second pass over the output so that the conversion loops
+ * above stay trivially vectorizable.
+ */
+template <typename T>
+void mask_fill(const T* in, std::size_t n, double* out, T fill) {
+  const double missing = NAN;
+  for (std::size_t i = 0; i < n; ++i) {
+    out[i] = in[i] == fill ? missing : out[i];
+  }
+}
+
+/**
+ * Converts 'n' values of type T to doubles, applying the packing
+ * attributes.
+ */
+template <typename T>
+void to_doubles(
+    const T* in, std::size_t n, double* out,
+    const packing_attributes& packing) {
+  if (packing.packed) {
+    unpack(in, n, out, packing.scale_factor, packing.add_offset);
+  }
+  else {
+    convert(in, n, out);
+  }
+  T fill;
+  if (packing.get_fill_value(fill)) {
+    mask_fill(in, n, out, fill);
+  }
+}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Calls 'fn(thread, i)' for every i in [0, count), spreading the calls
+ * over 'thread_count' threads (the calling thread being thread 0) which
+ * each take the next i as soon as they finish the previous one.
+ * The first exception thrown by any call is rethrown here, after the
+ * other threads have stopped taking new work.
+ */
+template <typename F>
+void parallel_for(std::size_t count, std::size_t thread_count, F&& fn) {
+  std::atomic<std::size_t> next{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto work = [&](std::size_t thread) {
+    try {
+      for (std::size_t i = next++; i < count; i = next++) {
+        fn(thread, i);
+      }
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      // Make the other threads stop early
+      next = count;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (std::size_t t = 1; t < thread_count; ++t) {
+    threads.emplace_back(work, t);
+  }
+  work(0);
+  for (auto& t: threads) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "indexed_image.hpp"
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Minimal in-memory PNG encoder for palette based images, built directly
+ * on zlib (which netCDF already pulls in) so that we don't need libpng.
+ * See https://www.w3.org/TR/png/ for the format.
+ */
+class png_encoder {
+public:
+  /**
+   * Returns the PNG file contents for the image
+   */
+  static std::string encode(
+      const indexed_image& image,
+      int compression_level = Z_BEST_SPEED) {
+    if (image.pixels.size() != image.width * image.height) {
+      throw std::invalid_argument("png_encoder: pixel buffer has wrong size");
+    }
+    if (image.palette.empty() || image.palette.size() > 256) {
+      throw std::invalid_argument("png_encoder: palette must have 1-256 entries");
+    }
+
+    std::string png("\x89PNG\r\n\x1a\n", 8);
+    append_chunk(png, "IHDR", header(image));
+
+    append_palette(png, image);
+
+    append_chunk(png, "IDAT", deflate_scanlines(image, compression_level));
+    append_chunk(png, "IEND", "");
+    return png;
+  }
+
+  /**
+   * Returns an animated PNG (APNG) whose frames are the 'compressed'
+   * results of `deflate_scanlines`, all the size of 'first' and sharing
+   * its palette, shown for 'delay_ms' each and looping forever.
+   * Producing the compressed frames is where the time goes, so callers
+   * can do that on several threads and then assemble them here.
+   * Viewers that don't support APNG show the first frame.
+   * See https://wiki.mozilla.org/APNG_Specification
+   */
+  static std::string encode_animation(
+      const indexed_image& first,
+      const std::vector<std::string>& compressed,
+      unsigned delay_ms) {
+    if (compressed.empty()) {
+      throw std::invalid_argument("png_encoder: an animation needs frames");
+    }
+    std::string png("\x89PNG\r\n\x1a\n", 8);
+    append_chunk(png, "IHDR", header(first));
+
+    std::string actl;
+    append_u32(actl, compressed.size());
+    append_u32(actl, 0); // loop forever
+    append_chunk(png, "acTL", actl);
+
+    append_palette(png, first);
+
+    // fcTL and fdAT chunks share one sequence number
+    std::uint32_t sequence = 0;
+    for (std::size_t i = 0; i < compressed.size(); ++i) {
+      std::string fctl;
+      append_u32(fctl, sequence++);
+      append_u32(fctl, first.width);
+      append_u32(fctl, first.height);
+      append_u32(fctl, 0); // x offset
+      append_u32(fctl, 0); // y offset
+      append_u16(fctl, delay_ms);
+      append_u16(fctl, 1000); // delay denominator, ie milliseconds
+      fctl += (char)0; // dispose op: none
+      fctl += (char)0; // blend op: source
+      append_chunk(png, "fcTL", fctl);
+
+      if (i == 0) {
+        // The first frame doubles as the default image
+        append_chunk(png, "IDAT", compressed[i]);
+      }
+      else {
+        std::string fdat;
+        append_u32(fdat, sequence++);
+        fdat += compressed[i];
+        append_chunk(png, "fdAT", fdat);
+      }
+    }
+    append_chunk(png, "IEND", "");
+    return png;
+  }
+
+  /**
+   * Returns the contents of the IHDR chunk for the image
+   */
+  static std::string header(const indexed_image& image) {
+    std::string ihdr;
+    append_u32(ihdr, image.width);
+    append_u32(ihdr, image.height);
+    ihdr += (char)8; // bit depth
+    ihdr += (char)3; // color type: indexed
+    ihdr += (char)0; // compression method: deflate
+    ihdr += (char)0; // filter method: adaptive
+    ihdr += (char)0; // interlace: none
+    return ihdr;
+  }
+
+  /**
+   * Returns the zlib stream holding the scanlines for the image,
+   * ie the payload of the IDAT chunk(s).
+   */
+  static std::string deflate_scanlines(
+      const indexed_image& image,
+      int compression_level) {
+    // Every scanline is prefixed with its filter type.  The PNG spec
+    // recommends no filtering for palette images, and deflate already
+    // does very well on the large flat areas of a contour plot.
+    const std::size_t stride = image.width;
+    std::vector<std::uint8_t> scanlines((stride + 1) * image.height);
+    for (std::size_t y = 0; y < image.height; ++y) {
+      std::uint8_t* out = scanlines.data() + y * (stride + 1);
+      out[0] = 0; // None
+      memcpy(out + 1, image.pixels.data() + y * stride, stride);
+    }
+
+    uLongf compressed_size = compressBound(scanlines.size());
+    std::string compressed(compressed_size, '\0');
+    int rc = compress2(
+      (Bytef*)compressed.data(), &compressed_size,
+      scanlines.data(), scanlines.size(),
+      compression_level);
+    if (rc != Z_OK) {
+      throw std::runtime_error(
+        "png_encoder: compress2 failed with " + std::to_string(rc));
+    }
+    compressed.resize(compressed_size);
+    return compressed;
+  }
+
+  /**
+   * Appends a chunk of the specified type, including its length
+   * prefix and crc suffix.
+   */
+  static void append_chunk(
+      std::string& png, const char* type, const std::string& data) {
+    append_u32(png, data.size());
+    std::size_t crc_start = png.size();
+    png.append(type, 4);
+    png += data;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc,
+      (const Bytef*)png.data() + crc_start, png.size() - crc_start);
+    append_u32(png, crc);
+  }
+
+  /**
+   * Appends the PLTE chunk, and the tRNS chunk if the palette has
+   * any transparency
+   */
+  static void append_palette(std::string& png, const indexed_image& image) {
+    std::string plte;
+    for (auto& c: image.palette) {
+      plte.append((const char*)c.data(), 3);
+    }
+    append_chunk(png, "PLTE", plte);
+
+    if (!image.alpha.empty()) {
+      if (image.alpha.size() > image.palette.size()) {
+        throw std::invalid_argument(
+          "png_encoder: more alpha values than palette entries");
+      }
+      append_chunk(png, "tRNS", std::string(
+        (const char*)image.alpha.data(), image.alpha.size()));
+    }
+  }
+
+  /**
+   * PNG integers are always big endian
+   */
+  static void append_u32(std::string& s, std::uint32_t v) {
+    s += (char)((v >> 24) & 0xff);
+    s += (char)((v >> 16) & 0xff);
+    s += (char)((v >> 8) & 0xff);
+    s += (char)(v & 0xff);
+  }
+
+  static void append_u16(std::string& s, std::uint16_t v) {
+    s += (char)((v >> 8) & 0xff);
+    s += (char)(v & 0xff);
+  }
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Spots clients stepping through time one frame after another (eg a
+ * viewer playing an animation with /get-image) and fetches the frames
+ * they're going to ask for next before they do, so that each arrives to
+ * find its frame already read (and rendered).
+ * Requests are grouped into streams, eg by client, route and z, and a
+ * stream whose time index has moved by the same (non-zero) stride twice
+ * in a row is taken to be playing.  The next 'depth' frames along that
+ * stride are then queued to be fetched on a background thread of its
+ * own, and any change of stride (the viewer seeking or turning around)
+ * cancels the ones that haven't started.
+ */
+class read_ahead {
+public:
+  struct stats {
+    std::uint64_t scheduled;
+    std::uint64_t fetched;
+    std::uint64_t cancelled;
+    std::uint64_t failed;
+  };
+
+  // Streams that haven't been seen for this long are forgotten
+  static constexpr std::chrono::seconds stream_timeout{60};
+  static constexpr std::size_t max_streams = 1024;
+
+  read_ahead() : worker([this]() { run(); }) {}
+
+  ~read_ahead() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+  }
+
+  read_ahead(const read_ahead&) = delete;
+  read_ahead& operator=(const read_ahead&) = delete;
+
+  /**
+   * Records that the stream asked for 'time_index' of the 'time_size'
+   * time steps, and when it's playing queues 'fetch(t)' for each of the
+   * next 'depth' time steps that aren't already queued.  'fetch' is
+   * called on the background thread and is expected to leave whatever
+   * it fetched in a cache.
+   */
+  void observe(
+      const std::string& stream,
+      std::size_t time_index,
+      std::size_t time_size,
+      std::size_t depth,
+      std::function<void(std::size_t)> fetch) {
+    const auto now = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      forget_idle_streams(now);
+      auto [it, added] = streams.try_emplace(stream);
+      stream_state& s = it->second;
+      s.last_seen = now;
+      const std::int64_t t = (std::int64_t)time_index;
+      if (added) {
+        s.last = t;
+        return;
+      }
+      const std::int64_t stride = t - s.last;
+      s.last = t;
+      if (stride == 0) {
+        // Eg the same frame at another size, which says nothing
+        return;
+      }
+      if (stride != s.stride) {
+        // Moved once, or seeked, so not (or no longer) playing
+        s.stride = stride;
+        cancel(stream, s);
+        return;
+      }
+
+      // Whatever is still queued from before this one is too late
+      auto behind = std::remove_if(queue.begin(), queue.end(),
+        [&](const job& j) {
+          return j.stream == stream &&
+            (stride > 0 ? (std::int64_t)j.time_index <= t :
+                          (std::int64_t)j.time_index >= t);
+        });
+      cancelled.fetch_add(queue.end() - behind, std::memory_order_relaxed);
+      queue.erase(behind, queue.end());
+
+      // From the first time step after the ones already queued
+      std::int64_t next = t + stride;
+      if (s.ahead_valid && (stride > 0 ? s.ahead >= next : s.ahead <= next)) {
+        next = s.ahead + stride;
+      }
+      const std::int64_t last = t + stride * (std::int64_t)depth;
+      for (std::int64_t f = next; stride > 0 ? f <= last : f >= last; f += stride) {
+        if (f < 0 || f >= (std::int64_t)time_size) {
+          break;
+        }
+        queue.push_back({stream, (std::size_t)f, fetch});
+        s.ahead = f;
+        s.ahead_valid = true;
+        scheduled.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    wake.notify_one();
+  }
+
+  stats get_stats() const {
+    return stats{
+      scheduled.load(std::memory_order_relaxed),
+      fetched.load(std::memory_order_relaxed),
+      cancelled.load(std::memory_order_relaxed),
+      failed.load(std::memory_order_relaxed)};
+  }
+
+private:
+  struct stream_state {
+    std::int64_t last = 0;
+    std::int64_t stride = 0;
+    // The furthest time step queued along 'stride'
+    std::int64_t ahead = 0;
+    bool ahead_valid = false;
+    std::chrono::steady_clock::time_point last_seen;
+  };
+
+  struct job {
+    std::string stream;
+    std::size_t time_index;
+    std::function<void(std::size_t)> fetch;
+  };
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::unordered_map<std::string, stream_state> streams;
+  std::deque<job> queue;
+  bool stopping = false;
+
+  std::atomic<std::uint64_t> scheduled{0};
+  std::atomic<std::uint64_t> fetched{0};
+  std::atomic<std::uint64_t> cancelled{0};
+  std::atomic<std::uint64_t> failed{0};
+
+  // Declared last so that everything it uses exists before it starts
+  std::thread worker;
+
+  // Drops the stream's queued jobs.  Called with the lock held.
+  void cancel(const std::string& stream, stream_state& s) {
+    s.ahead_valid = false;
+    auto end = std::remove_if(queue.begin(), queue.end(),
+      [&](const job& j) { return j.stream == stream; });
+    cancelled.fetch_add(queue.end() - end, std::memory_order_relaxed);
+    queue.erase(end, queue.end());
+  }
+
+  // Called with the lock held
+  void forget_idle_streams(std::chrono::steady_clock::time_point now) {
+    if (streams.size() < max_streams) {
+      return;
+    }
+    for (auto it = streams.begin(); it != streams.end(); ) {
+      if (now - it->second.last_seen > stream_timeout) {
+        cancel(it->first, it->second);
+        it = streams.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  void run() {
+    while (true) {
+      job next;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (stopping) {
+          return;
+        }
+        next = std::move(queue.front());
+        queue.pop_front();
+      }
+      try {
+        next.fetch(next.time_index);
+        fetched.fetch_add(1, std::memory_order_relaxed);
+      }
+      catch (std::exception& e) {
+        failed.fetch_add(1, std::memory_order_relaxed);
+        logger::debug("Reading ahead time step ", next.time_index,
+          " for ", next.stream, " failed: ", e.what());
+      }
+    }
+  }
+};
@@ -1,6 +1,17 @@
+#pragma once
+
+#include "catalog.hpp"
+#include "hyperslab.hpp"
+#include "json_writer.hpp"
+
 #include <nlohmann/json.hpp>
 #include <netcdf>
 
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <unordered_map>
+
 using namespace netCDF;
 using json = nlohmann::ordered_json;
 
@@ -16,6 +27,9 @@ public:
     // to get access to the format information
     // https://github.com/Unidata/netcdf-cxx4/issues/49
     nc_inq_format(file.getId(), &this->format);
+    if (format == NC_FORMAT_NETCDF4 || format == NC_FORMAT_NETCDF4_CLASSIC) {
+      size_chunk_caches();
+    }
   }
 
   /**
@@ -23,7 +37,45 @@ public:
    * attributes formatted as json
    */
   json get_info() const {
-    return get_info(file);    
+    return get_catalog().get_info();
+  }
+
+  /**
+   * Reads the whole schema of the file, which the server does once at
+   * startup rather than walking the file on every request
+   */
+  catalog get_catalog() const {
+    std::vector<catalog::dimension> dimensions;
+    std::unordered_map<std::string, std::size_t> dimension_index;
+    for (auto& [name, d]: file.getDims()) {
+      dimension_index[name] = dimensions.size();
+      dimensions.push_back({name, d.getSize(), d.isUnlimited()});
+    }
+
+    std::vector<catalog::variable> variables;
+    for (auto& [name, v]: file.getVars()) {
+      catalog::variable var{name, v.getType().getId(), {}, {}, {}};
+      for (auto& d: v.getDims()) {
+        var.dimensions.push_back(dimension_index.at(d.getName()));
+      }
+      NcVar::ChunkMode mode;
+      std::vector<std::size_t> chunk_sizes;
+      v.getChunkingParameters(mode, chunk_sizes);
+      if (mode == NcVar::nc_CHUNKED) {
+        var.chunking = chunk_sizes;
+        bool deflate;
+        v.getCompressionParameters(var.shuffle, deflate, var.deflate_level);
+        if (!deflate) {
+          var.deflate_level = 0;
+        }
+      }
+      var.attributes = get_attributes(v.getAtts());
+      variables.push_back(std::move(var));
+    }
+
+    return catalog(
+      std::move(dimensions), std::move(variables),
+      get_attributes(file.getAtts()));
   }
 
   /**
@@ -40,18 +92,57 @@ public:
   json get_data(
       const char* variable_name, 
       std::vector<uint64_t> prefix_indices
+  ) const {
+    return to_json(read_hyperslab(variable_name, prefix_indices));
+  }
+
+  /**
+   * Returns the hyperslab as a json document, nesting one list per
+   * dimension in its shape.
+   * NOTE: the REST api serves json through `json_writer` instead, which
+   * produces the same text without building this tree.  This is kept
+   * for callers that want to inspect the values as json.
+   */
+  static json to_json(const hyperslab& slab) {
+    if (slab.packing.packed) {
+      std::vector<double> values = slab.to_doubles();
+      return to_json<double, false>(values.data(), slab.shape, 0);
+    }
+    return visit_nc_type(slab.type, [&](auto tag) {
+      using T = typename decltype(tag)::type;
+      const T* values = (const T*)slab.buffer();
+      T fill;
+      if (slab.packing.get_fill_value(fill)) {
+        return to_json<T, true>(values, slab.shape, fill);
+      }
+      return to_json<T, false>(values, slab.shape, T());
+    });
+  }
+
+  /**
+   * Reads the raw values for the specified variable_name with its first
+   * dimensions constrained to the specified values in 'prefix_indices'.
+   * The values are left in the variable's native type and byte order so
+   * that they can be served without any per-element conversion.
+   */
+  hyperslab read_hyperslab(
+      const char* variable_name, 
+      const std::vector<uint64_t>& prefix_indices
   ) const {
     NcVar var = file.getVar(variable_name);
     try {
       if (var.isNull()) {
         throw std::invalid_argument("does not exist");
       }
-      if (prefix_indices.size() > var.getDimCount()) {
+      if (prefix_indices.size() > (std::size_t)var.getDimCount()) {
         throw std::invalid_argument("has " + 
           std::to_string(var.getDimCount()) + " dimensions " +
           "but you've specifed more indexes (" + 
           std::to_string(prefix_indices.size()) + ")");
       }
+      if (!is_numeric_nc_type(var.getType().getId())) {
+        throw std::invalid_argument("is not a numeric variable");
+      }
     }
     catch(std::exception& e) {
       throw std::invalid_argument(
@@ -60,67 +151,100 @@ public:
 
     // The first dimensions we'll start at the indices in 'prefix_indices'
     // and do counts of 1
-    std::vector<uint64_t> indices = prefix_indices;
-    std::vector<uint64_t> counts(prefix_indices.size(), 1);
+    std::vector<std::size_t> indices(
+      prefix_indices.begin(), prefix_indices.end());
+    std::vector<std::size_t> counts(prefix_indices.size(), 1);
+
+    hyperslab slab;
+    slab.type = var.getType().getId();
+    slab.element_size = var.getType().getSize();
+    slab.packing = get_packing(var);
 
-    std::size_t first_unrestricted_index = prefix_indices.size();
     // Then we want to add the entire range [0, size) of the
     // remaining dimensions
     std::size_t total_data_elements = 1;
-    for (std::size_t i = first_unrestricted_index; i < var.getDimCount(); ++i)
+    for (int i = prefix_indices.size(); i < var.getDimCount(); ++i)
     {
       indices.push_back(0);
       NcDim dim = var.getDim(i);
       counts.push_back(dim.getSize());
+      slab.shape.push_back(dim.getSize());
       total_data_elements *= dim.getSize();
     }
 
+    slab.data.resize(total_data_elements * slab.element_size);
+    var.getVar(indices, counts, slab.data.data());
+    return slab;
+  }
 
-    std::size_t buffer_size = total_data_elements * var.getType().getSize();
-    std::vector<char> buf(buffer_size);
-    void* buffer = (void*)buf.data();
-    var.getVar(indices, counts, buffer);
+  /**
+   * Reads the values selected by 'query' (see `hyperslab_query`) for the
+   * specified variable_name as a single strided read, ie nc_get_vars,
+   * so only the selected values are ever read and converted.
+   */
+  hyperslab read_hyperslab(
+      const char* variable_name,
+      hyperslab_query query
+  ) const {
+    NcVar var = file.getVar(variable_name);
+    try {
+      if (var.isNull()) {
+        throw std::invalid_argument("does not exist");
+      }
+      if (!is_numeric_nc_type(var.getType().getId())) {
+        throw std::invalid_argument("is not a numeric variable");
+      }
+    }
+    catch(std::exception& e) {
+      throw std::invalid_argument(
+        std::string("Variable name '") + variable_name + "': " + e.what());
+    }
 
-    std::vector<json> lists(indices.size());
+    std::vector<NcDim> dims = var.getDims();
+    std::vector<std::size_t> dim_sizes;
+    for (auto& d: dims) {
+      dim_sizes.push_back(d.getSize());
+    }
+    query.resolve(variable_name, dim_sizes,
+      [&](std::size_t d, std::size_t index) {
+        validate_dimension_index(dims[d].getName().c_str(), index);
+      });
 
-    std::size_t last_dim_index = var.getDimCount() - 1;
+    hyperslab slab;
+    slab.type = var.getType().getId();
+    slab.element_size = var.getType().getSize();
+    slab.packing = get_packing(var);
+    slab.shape = query.count;
 
-    // Handle special case where all indices have been specified
-    if (first_unrestricted_index == indices.size()) {
-      return get_data_from_buffer(var.getType(), buffer, 0);
+    std::size_t total_data_elements = 1;
+    for (auto c: query.count) {
+      total_data_elements *= c;
     }
+    slab.data.resize(total_data_elements * slab.element_size);
+    std::vector<std::ptrdiff_t> stride(
+      query.stride.begin(), query.stride.end());
+    var.getVar(query.start, query.count, stride, slab.data.data());
+    return slab;
+  }
 
-    for (std::size_t i = 0; i < total_data_elements; ++i) {
-      for (
-          std::size_t li = last_dim_index; 
-          li >= first_unrestricted_index;
-          --li
-      ) {
-        json &dim_list = lists[li];
-        if (li == last_dim_index) {
-          dim_list.push_back(
-            get_data_from_buffer(var.getType(), buffer, i));
-        } 
 
-        if (dim_list.size() == counts[li]) {
-          if (li > first_unrestricted_index) {
-            // It's time to append this list to the previous one
-            lists[li - 1].push_back(dim_list);
-            dim_list.clear();
-          }
-        }
-        else {
-          // We can break out of the for loop because we're
-          // still filling up this list.
-          break;
-        }
-      }
+  /**
+   * Returns the name and current size of each dimension of the variable
+   */
+  std::vector<std::pair<std::string, std::size_t>> get_variable_dimensions(
+      const char* variable_name) const {
+    NcVar var = file.getVar(variable_name);
+    if (var.isNull()) {
+      throw std::invalid_argument(
+        std::string("Variable name '") + variable_name + "': does not exist");
     }
-    // Return the root unbounded list
-    return lists[first_unrestricted_index];
+    std::vector<std::pair<std::string, std::size_t>> result;
+    for (auto& d: var.getDims()) {
+      result.emplace_back(d.getName(), d.getSize());
+    }
+    return result;
   }
 
-
   /**
    * Validates that the specified index is valid for the dimension,
    * and throws exception if either the dimension name or index are
@@ -145,79 +269,223 @@ public:
   }
 
 private:
+  // The most memory each variable's chunk cache is given, per reader
+  static constexpr std::size_t max_chunk_cache_bytes = 64 * 1024 * 1024;
 
   /**
-   * Return the json value depending on the type of data for the specified 
-   * type, reading from the buffer at the specified index. 
-   * NOTE: This should be merged with `get_info(const NcAtt& a)` below 
-   * since they do similar things, but in the interest of time
-   * for now I'm keeping them separate
+   * Sizes the chunk cache of every chunked variable to hold all of the
+   * chunks that a 2d slice (ie every dimension but the last two fixed,
+   * which is how the server reads) touches.
+   * NOTE: when the chunks span several time steps or z levels, as they
+   *   often do, the library's default cache (a few MB shared by the
+   *   variable) is too small to keep them between reads, so every slice
+   *   decompresses all of its chunks again just to use a sliver of each.
+   *   With them cached, reading the next slices along those dimensions
+   *   costs a copy out of the cache.
    */
-  json get_data_from_buffer(
-      NcType t, void* buffer, std::size_t index) const 
-  {
-    switch (t.getTypeClass())
-    {
-      case NcType::nc_DOUBLE:
-        return ((double *)buffer)[index];
-      default:
-        // NOTE: we should obviously extend this to handle all possible
-        // types but I have run out of time to complete this so we're
-        // throwing an exception if another type is encountered.
-        throw std::invalid_argument(
-          "WIP - Currently only handles DOUBLE values");
+  void size_chunk_caches() {
+    for (auto& [name, v]: file.getVars()) {
+      NcVar::ChunkMode mode;
+      std::vector<std::size_t> chunk_sizes;
+      v.getChunkingParameters(mode, chunk_sizes);
+      if (mode != NcVar::nc_CHUNKED || chunk_sizes.empty()) {
+        continue;
+      }
+      std::vector<NcDim> dims = v.getDims();
+      const std::size_t fixed = dims.size() > 2 ? dims.size() - 2 : 0;
+      std::size_t chunks = 1;
+      std::size_t bytes = v.getType().getSize();
+      for (std::size_t d = 0; d < dims.size(); ++d) {
+        std::size_t c = std::max<std::size_t>(chunk_sizes[d], 1);
+        std::size_t across = d < fixed ? 1 : (dims[d].getSize() + c - 1) / c;
+        chunks *= std::max<std::size_t>(across, 1);
+        bytes *= c * std::max<std::size_t>(across, 1);
+      }
+
+      std::size_t size, slots;
+      float preemption;
+      if (nc_get_var_chunk_cache(
+            file.getId(), v.getId(), &size, &slots, &preemption) != NC_NOERR) {
+        continue;
+      }
+      bytes = std::min(bytes, max_chunk_cache_bytes);
+      if (bytes <= size) {
+        continue;
+      }
+      // The library hashes chunks into the slots, which works best with
+      // a prime number of them well above the number of chunks cached
+      std::size_t wanted_slots = std::max(slots, chunks * 4);
+      while (!is_prime(wanted_slots)) {
+        ++wanted_slots;
+      }
+      // Failing only leaves the default in place, which still works
+      nc_set_var_chunk_cache(
+        file.getId(), v.getId(), bytes, wanted_slots, preemption);
+    }
+  }
+
+  static bool is_prime(std::size_t n) {
+    if (n < 2) {
+      return false;
+    }
+    for (std::size_t f = 2; f * f <= n; ++f) {
+      if (n % f == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+
+  /**
+   * Builds the nested lists for a hyperslab whose element type has
+   * already been resolved, see `to_json(const hyperslab&)`.
+   */
+  template <typename T, bool HasFill>
+  static json to_json(
+      const T* values, const std::vector<std::size_t>& shape, T fill) {
+    std::size_t count = 1;
+    for (auto n: shape) {
+      count *= n;
     }
+
+    // Handle special case where all indices have been specified
+    if (shape.empty()) {
+      return get_data_from_buffer<T, HasFill>(values, 0, fill);
+    }
+
+    std::vector<json> lists(shape.size());
+    std::size_t last_dim_index = shape.size() - 1;
+
+    for (std::size_t i = 0; i < count; ++i) {
+      for (std::size_t li = last_dim_index + 1; li-- > 0; ) {
+        json &dim_list = lists[li];
+        if (li == last_dim_index) {
+          dim_list.push_back(
+            get_data_from_buffer<T, HasFill>(values, i, fill));
+        } 
+
+        if (dim_list.size() == shape[li]) {
+          if (li > 0) {
+            // It's time to append this list to the previous one
+            lists[li - 1].push_back(dim_list);
+            dim_list.clear();
+          }
+        }
+        else {
+          // We can break out of the for loop because we're
+          // still filling up this list.
+          break;
+        }
+      }
+    }
+    // Return the root unbounded list
+    return lists[0];
   }
 
   /**
-   * Call get_info for each value in the specified multimap.
-   * Why do we iterate in reverse?  Because for some reason the
-   * crow json api insists on presenting the fields in
-   * the reverse order that they were inserted when a multimap
-   * is involved.
-   * NOTE! This implementation only supports a single value
-   * for each key in the multimap, which seems to be sufficient
-   * for the sample file provided.  A future upgrade could
-   * convert the first value to a list upon discovery of a second.
+   * Return the json value of type T from the buffer at the specified
+   * index, or null if it is the fill value.  Also used for the values
+   * of numeric attributes, see `get_attribute_value`.
    */
-  template <typename K, typename V>
-  auto get_info_mm(const std::multimap<K, V>& map) const {
-    auto o = json::object();
-    for (auto& [k, v]: map) {
-      o[k] = get_info(v);
+  template <typename T, bool HasFill>
+  static json get_data_from_buffer(
+      const T* buffer, std::size_t index, T fill)
+  {
+    T value = buffer[index];
+    if constexpr (HasFill) {
+      if (value == fill) {
+        return nullptr;
+      }
+    }
+    if constexpr (std::is_same_v<T, float>) {
+      // nlohmann only stores doubles, which would print 0.1f as
+      // 0.10000000149011612, so this stores the same double that
+      // json_writer writes
+      return json_writer::float_as_double(value);
+    }
+    else {
+      return value;
     }
-    return o;
   }
 
-  json get_info(const NcGroup& g) const {
-    return {
-      {"dimensions", get_info_mm(g.getDims())},
-      {"variables", get_info_mm(g.getVars())},
-      {"attributes", get_info_mm(g.getAtts())},
+  /**
+   * Reads the CF packing attributes, see `packing_attributes`
+   */
+  static packing_attributes get_packing(const NcVar& var) {
+    packing_attributes packing;
+    auto atts = var.getAtts();
+    auto get_number = [&](const char* name, double& value) {
+      auto it = atts.find(name);
+      if (it == atts.end() || it->second.getAttLength() < 1 ||
+          !is_numeric_nc_type(it->second.getType().getId())) {
+        return false;
+      }
+      // nc_get_att_double converts from whatever type the attribute is
+      std::vector<double> values(it->second.getAttLength());
+      it->second.getValues(values.data());
+      value = values[0];
+      return true;
     };
+    bool has_scale = get_number("scale_factor", packing.scale_factor);
+    bool has_offset = get_number("add_offset", packing.add_offset);
+    packing.packed = has_scale || has_offset;
+
+    auto fill = atts.find("_FillValue");
+    if (fill != atts.end() &&
+        fill->second.getType().getId() == var.getType().getId() &&
+        fill->second.getAttLength() == 1) {
+      packing.fill_value.resize(var.getType().getSize());
+      fill->second.getValues(packing.fill_value.data());
+    }
+    return packing;
+  }
+
+  /**
+   * Returns the attributes in the (multi)map from netCDF as the catalog
+   * holds them
+   */
+  template <typename Map>
+  std::vector<catalog::attribute> get_attributes(const Map& atts) const {
+    std::vector<catalog::attribute> result;
+    for (auto& [name, a]: atts) {
+      result.push_back({name, get_attribute_value(a)});
+    }
+    return result;
   }
 
-  json get_info(const NcAtt& a) const {
+  /**
+   * Returns the attribute's value as json, a list when the attribute
+   * has more than one value
+   */
+  json get_attribute_value(const NcAtt& a) const {
     if (a.isNull()) {
       return nullptr;
     }
 
     NcType t = a.getType();
+    const std::size_t length = a.getAttLength();
 
-    // NOTE!  This is a minimal implementation which should be
-    //  extended to support multiple values per attribute.  For
-    //  now it simply takes the first value available, which 
-    //  appears to be sufficient to process the provided sample file.
-
-    std::vector<char> buffer(a.getAttLength() * a.getType().getSize());
+    std::vector<char> buffer(length * t.getSize());
     void* data = buffer.data();
     a.getValues(data);
 
+    if (is_numeric_nc_type(t.getId())) {
+      return visit_nc_type(t.getId(), [&](auto tag) {
+        using T = typename decltype(tag)::type;
+        const T* values = (const T*)data;
+        if (length == 1) {
+          return get_data_from_buffer<T, false>(values, 0, T());
+        }
+        json list = json::array();
+        for (std::size_t i = 0; i < length; ++i) {
+          list.push_back(get_data_from_buffer<T, false>(values, i, T()));
+        }
+        return list;
+      });
+    }
+
     switch(t.getTypeClass()) {
-      case NcType::nc_BYTE:     //!< signed 1 byte integer
-      {
-        return ((signed char*)data)[0];
-      }
       case NcType::nc_CHAR:     //!< ISO/ASCII character
       {
         // Contrary to the description with this enum element,
@@ -227,58 +495,27 @@ private:
         // https://github.com/Unidata/netcdf-c/blob/main/ncdump/ncdump.c#L414
         return get_attr_string(buffer);
       }
-      case NcType::nc_SHORT:    //!< signed 2 byte integer
-      {        
-        return ((short *)data)[0];
-      }
-      case NcType::nc_INT:      //!< signed 4 byte integer
-      {        
-        return ((int *)data)[0];
-      }
-      case NcType::nc_FLOAT:    //!< single precision floating point number
-      {        
-        return ((float *)data)[0];
-      }
-      case NcType::nc_DOUBLE:   //!< double precision floating point number
-      {        
-        return ((double *)data)[0];
-      }
-      case NcType::nc_UBYTE:    //!< unsigned 1 byte int
-      {        
-        return ((unsigned char *)data)[0];
-      }
-      case NcType::nc_USHORT:   //!< unsigned 2-byte int
-      {        
-        return ((unsigned short*)data)[0];
-      }
-      case NcType::nc_UINT:     //!< unsigned 4-byte int
-      {
-        return ((unsigned int*)data)[0];
-      }
-      case NcType::nc_INT64:    //!< signed 8-byte int
-      {        
-        return ((int64_t*)data)[0];
-      }
-      case NcType::nc_UINT64:   //!< unsigned 8-byte int
-      {     
-        return ((uint64_t*)data)[0];
-      }
       case NcType::nc_STRING:   //!< string
       {        
         char** strings = (char **)data;
-        char* s = strings[0];
-        if (s == nullptr) {
-          return nullptr;
-        } 
-        size_t len = strlen(s);
-        std::vector<char> buf(len);
-        strncpy(buf.data(), s, len);
+        json list = json::array();
+        for (std::size_t i = 0; i < length; ++i) {
+          if (strings[i] == nullptr) {
+            list.push_back(nullptr);
+            continue;
+          }
+          std::vector<char> buf(strings[i], strings[i] + strlen(strings[i]));
+          list.push_back(get_attr_string(buf));
+        }
         // NOTE: we need to free the string buffers that
         // have been created for us after we copy the data
         // to our own buffer:
         // https://docs.unidata.ucar.edu/netcdf-c/4.9.3/group__attributes.html#ga19cae92a58e1bf7f999c3eeab5404189
-        nc_free_string(a.getAttLength(), strings);
-        return get_attr_string(buf);
+        nc_free_string(length, strings);
+        if (length == 1) {
+          return list[0];
+        }
+        return list;
       }
       case NcType::nc_VLEN:     //!< "NcVlen type"
       {        
@@ -386,34 +623,4 @@ private:
     }
     return result.str();
   }
-
-  json get_info(const NcDim& d) const {
-    if (d.isUnlimited()) {
-      return "<unlimited>";
-    }
-    return d.getSize();
-  }
-
-  json get_info(const NcVar& v) const {
-    // Variable attributes
-    auto ga = json::object();
-    for (auto &[k, val] : v.getAtts())
-    {
-      ga[k] = get_info(val);
-    }
-
-    // Variable dimensions (just an array of names)
-    auto vd = json::array();
-    for (auto& d: v.getDims()) {
-      vd.push_back(d.getName());
-    }
-
-    return {
-      {"dimensions", vd},
-      {"attributes", ga}
-    };
-  }
-
-
-
 };
\ No newline at end of file
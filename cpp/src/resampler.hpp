@@ -0,0 +1,209 @@
+#pragma once
+
+#include "hyperslab.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Resamples 2d slices of shape {y, x} to another resolution, usually a
+ * much smaller one to match the screen a client draws them on, so that
+ * what is sent or rendered scales with the output rather than the grid.
+ * Output cell i of n along an axis of N grid cells is centred on the
+ * fractional grid index (i + 0.5) * N / n - 0.5, for both methods:
+ *   - area: the mean of the grid cells whose centres fall in the output
+ *     cell, ignoring missing values (so a value is only missing when
+ *     they all are).  The right choice for shrinking, as every grid cell
+ *     counts; growing it repeats cells.
+ *   - bilinear: interpolated between the 4 nearest grid cells, missing
+ *     when any of them is.  The right choice for growing.
+ * The results are NC_DOUBLE with missing values as NaN, like the levels
+ * of a tile_pyramid.
+ */
+class resampler {
+public:
+  enum class method { area, bilinear };
+
+  // Largest output size along either axis
+  static constexpr std::size_t max_size = 8192;
+
+  /**
+   * Returns the 'ny' x 'nx' values resampled to 'out_ny' x 'out_nx',
+   * spreading the output rows over 'thread_count' threads
+   */
+  static std::vector<double> resample(
+      const std::vector<double>& values, std::size_t ny, std::size_t nx,
+      std::size_t out_ny, std::size_t out_nx,
+      method m, std::size_t thread_count = 1) {
+    if (values.size() != ny * nx || ny == 0 || nx == 0) {
+      throw std::invalid_argument(
+        "resampler: values must have ny * nx elements");
+    }
+    if (out_ny == 0 || out_nx == 0 ||
+        out_ny > max_size || out_nx > max_size) {
+      throw std::invalid_argument(
+        "The output size must be between 1 and " + std::to_string(max_size) +
+        " along each axis");
+    }
+    std::vector<double> out(out_ny * out_nx);
+    // Rows are handed out in blocks so that each thread has enough
+    // work per block to be worth the handing out
+    const std::size_t block = std::max<std::size_t>(1, 64 * 1024 / nx);
+    const std::size_t blocks = (out_ny + block - 1) / block;
+    thread_count = std::clamp<std::size_t>(thread_count, 1, blocks);
+
+    if (m == method::bilinear) {
+      const auto rows = sample_positions(ny, out_ny);
+      const auto columns = sample_positions(nx, out_nx);
+      parallel_for(blocks, thread_count, [&](std::size_t, std::size_t b) {
+        for (std::size_t y = b * block; y < std::min(out_ny, (b + 1) * block); ++y) {
+          bilinear_row(
+            values.data() + rows.first[y] * nx,
+            values.data() + rows.second[y] * nx,
+            rows.weight[y], columns, out.data() + y * out_nx, out_nx);
+        }
+      });
+    }
+    else {
+      const auto rows = boxes(ny, out_ny);
+      const auto columns = boxes(nx, out_nx);
+      parallel_for(blocks, thread_count, [&](std::size_t, std::size_t b) {
+        std::vector<double> sums(nx), counts(nx);
+        for (std::size_t y = b * block; y < std::min(out_ny, (b + 1) * block); ++y) {
+          std::fill(sums.begin(), sums.end(), 0.0);
+          std::fill(counts.begin(), counts.end(), 0.0);
+          for (std::size_t r = rows[y].first; r < rows[y].second; ++r) {
+            accumulate_row(values.data() + r * nx, nx,
+              sums.data(), counts.data());
+          }
+          area_row(sums.data(), counts.data(), columns,
+            out.data() + y * out_nx, out_nx);
+        }
+      });
+    }
+    return out;
+  }
+
+  /**
+   * Returns the 2d slice resampled to 'out_ny' x 'out_nx'
+   */
+  static hyperslab resample(
+      const hyperslab& slice, std::size_t out_ny, std::size_t out_nx,
+      method m, std::size_t thread_count = 1) {
+    if (slice.shape.size() != 2) {
+      throw std::invalid_argument(
+        "Resampling needs a 2d slice but the selection has " +
+        std::to_string(slice.shape.size()) + " dimensions");
+    }
+    std::vector<double> values = resample(slice.to_doubles(),
+      slice.shape[0], slice.shape[1], out_ny, out_nx, m, thread_count);
+    hyperslab result;
+    result.type = NC_DOUBLE;
+    result.element_size = sizeof(double);
+    result.shape = {out_ny, out_nx};
+    result.data.assign(
+      (const char*)values.data(), values.size() * sizeof(double));
+    return result;
+  }
+
+  /**
+   * Returns the coordinates of the 'n' output cells along an axis with
+   * the grid's coordinates 'coords', interpolated at their centres
+   */
+  static std::vector<double> resample_coordinates(
+      const std::vector<double>& coords, std::size_t n) {
+    const auto positions = sample_positions(coords.size(), n);
+    std::vector<double> result(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      const double c0 = coords[positions.first[i]];
+      const double c1 = coords[positions.second[i]];
+      result[i] = c0 + positions.weight[i] * (c1 - c0);
+    }
+    return result;
+  }
+
+private:
+  // For each output cell, the two grid cells on either side of its
+  // centre and how far it is from the first to the second
+  struct positions {
+    std::vector<std::size_t> first;
+    std::vector<std::size_t> second;
+    std::vector<double> weight;
+  };
+
+  static positions sample_positions(std::size_t cells, std::size_t n) {
+    positions result{std::vector<std::size_t>(n),
+      std::vector<std::size_t>(n), std::vector<double>(n)};
+    for (std::size_t i = 0; i < n; ++i) {
+      const double p = std::clamp(
+        (i + 0.5) * cells / n - 0.5, 0.0, (double)(cells - 1));
+      result.first[i] = (std::size_t)p;
+      result.second[i] = std::min(result.first[i] + 1, cells - 1);
+      result.weight[i] = p - result.first[i];
+    }
+    return result;
+  }
+
+  // The grid cells [first, second) whose centres fall in each output
+  // cell, or the nearest one when growing
+  static std::vector<std::pair<std::size_t, std::size_t>> boxes(
+      std::size_t cells, std::size_t n) {
+    std::vector<std::pair<std::size_t, std::size_t>> result(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      if (cells >= n) {
+        result[i] = {i * cells / n, (i + 1) * cells / n};
+      }
+      else {
+        const std::size_t c = std::min((2 * i + 1) * cells / (2 * n), cells - 1);
+        result[i] = {c, c + 1};
+      }
+    }
+    return result;
+  }
+
+  // These kernels are single branch-free passes so that the compiler
+  // can vectorize them, like nc_kernels
+
+  static void bilinear_row(
+      const double* row0, const double* row1, double fy,
+      const positions& columns, double* out, std::size_t n) {
+    const std::size_t* x0 = columns.first.data();
+    const std::size_t* x1 = columns.second.data();
+    const double* fx = columns.weight.data();
+    for (std::size_t x = 0; x < n; ++x) {
+      const double v0 = row0[x0[x]] + fx[x] * (row0[x1[x]] - row0[x0[x]]);
+      const double v1 = row1[x0[x]] + fx[x] * (row1[x1[x]] - row1[x0[x]]);
+      out[x] = v0 + fy * (v1 - v0);
+    }
+  }
+
+  static void accumulate_row(
+      const double* row, std::size_t n, double* sums, double* counts) {
+    for (std::size_t x = 0; x < n; ++x) {
+      // NaN compares false with itself, so missing values add nothing
+      const bool present = row[x] == row[x];
+      sums[x] += present ? row[x] : 0.0;
+      counts[x] += present ? 1.0 : 0.0;
+    }
+  }
+
+  static void area_row(
+      const double* sums, const double* counts,
+      const std::vector<std::pair<std::size_t, std::size_t>>& columns,
+      double* out, std::size_t n) {
+    for (std::size_t x = 0; x < n; ++x) {
+      double sum = 0, count = 0;
+      for (std::size_t c = columns[x].first; c < columns[x].second; ++c) {
+        sum += sums[c];
+        count += counts[c];
+      }
+      out[x] = count > 0 ? sum / count : NAN;
+    }
+  }
+};
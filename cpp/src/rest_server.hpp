@@ -1,42 +1,262 @@
+#include "animation_renderer.hpp"
+#include "binary_format.hpp"
+#include "catalog.hpp"
+#include "classic_reader.hpp"
+#include "contour_renderer.hpp"
+#include "dataset.hpp"
+#include "file_watcher.hpp"
+#include "generation_pin.hpp"
+#include "http_cache.hpp"
+#include "io_scheduler.hpp"
+#include "json_writer.hpp"
+#include "logger.hpp"
+#include "lru_cache.hpp"
+#include "metrics.hpp"
+#include "parallel_for.hpp"
+#include "read_ahead.hpp"
 #include "read_netcdf.hpp"
+#include "resampler.hpp"
+#include "stats_reducer.hpp"
+#include "thread_budget.hpp"
+#include "tile_pyramid.hpp"
+#include "timeseries_index.hpp"
+#include "transport_encoding.hpp"
 
 #include <crow.h>
-#include <matplot/matplot.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 
 
 class rest_server {
-  crow::SimpleApp app;
-  const char* file_name;
+public:
+  // Keeps a single /get-animation request from rendering for too long
+  static constexpr std::size_t max_animation_frames = 1000;
+  // Keeps /get-timeseries to small regions, it's meant for points
+  static constexpr std::size_t max_timeseries_positions = 4096;
+  // Keeps a single /get-batch request from reading too much at once
+  static constexpr std::size_t max_batch_slices = 1000;
+  static constexpr std::size_t max_batch_bytes = 256 * 1024 * 1024;
+
+  struct options {
+    int port = 8080;
+    // Memory budget for the hyperslab cache shared by all threads
+    std::size_t cache_bytes = 256 * 1024 * 1024;
+    // Memory budget for the gzip/deflate encoded responses
+    std::size_t response_cache_bytes = 64 * 1024 * 1024;
+    // Number of threads doing netCDF reads
+    std::size_t io_threads = 4;
+    // Most files the I/O threads keep open, raised to io_threads if lower
+    std::size_t max_open_files = 32;
+    // Number of threads serving HTTP requests, 0 means one per cpu
+    std::uint16_t http_threads = 0;
+    // Whether to reload the files when they change, see reload
+    bool watch = true;
+    // Where the time-major copies of variables for /get-timeseries are
+    // kept (see timeseries_index), empty to always read the files
+    std::string timeseries_dir;
+    // How many time steps to fetch ahead of clients playing through
+    // them, see read_ahead, 0 to not read ahead at all
+    std::size_t read_ahead = 4;
+    // Memory budget for the /get-image frames rendered ahead
+    std::size_t rendered_image_bytes = 32 * 1024 * 1024;
+  };
+
+private:
+  // Declared before the app whose middleware records into it
+  metrics registry;
+  // Time spent in each stage of handling requests, see /metrics
+  struct {
+    metrics::histogram read;
+    metrics::histogram json;
+    metrics::histogram npy;
+    metrics::histogram render;
+    metrics::histogram png;
+    metrics::histogram animation;
+    metrics::histogram stats;
+    metrics::histogram encode;
+    metrics::histogram resample;
+  } stages;
+
+  /**
+   * Everything that is read from the files, which is replaced as a whole
+   * when they change, see reload.  Each request uses the generation that
+   * was current when it arrived (see generation_pin) and a generation is
+   * freed once the last request using it is done.
+   */
+  struct generation {
+    std::uint64_t number;
+    std::shared_ptr<const dataset> data;
+    // Shared by all threads when the data is a single file in one of the
+    // classic formats, otherwise nullptr and reads go through the I/O
+    // threads
+    std::unique_ptr<const classic_reader> classic;
+    std::shared_ptr<const dataset_reader> reader;
+    // The minimum and maximum of whole variables, see get_global_range
+    mutable std::map<std::string, std::pair<double, double>> global_ranges;
+    mutable std::mutex global_ranges_mutex;
+    // The indexes that have been built, see get_timeseries_index
+    mutable std::map<std::string,
+      std::shared_ptr<const timeseries_index>> timeseries_indexes;
+    mutable std::mutex timeseries_indexes_mutex;
+
+    const catalog& schema() const {
+      return data->get_catalog();
+    }
+  };
+  using pin = generation_pin<generation>;
+
+  crow::App<request_metrics, access_log, pin, http_cache> app;
+  const options opts;
+  // Shared by every generation, the keys start with the generation's
+  // number, see versioned
+  lru_cache<hyperslab> hyperslab_cache;
+  // The png bodies of /get-image frames rendered ahead of the clients
+  // playing through them, keyed like hyperslab_cache
+  lru_cache<std::string> rendered_images;
+  // The generation new requests use, only ever accessed through
+  // std::atomic_load and std::atomic_store
+  std::shared_ptr<const generation> current;
+  std::atomic<std::uint64_t> reloads{0};
+  // The extra threads requests spread their rendering, resampling and
+  // so on over, one per cpu between all of them
+  thread_budget workers;
+  // Declared after everything but the watcher so that its threads are
+  // stopped before anything they might be using is destroyed
+  io_scheduler io;
+  // nullptr when there's no timeseries_dir
+  std::unique_ptr<timeseries_builder> timeseries_builds;
+  // nullptr when not reading ahead
+  std::unique_ptr<read_ahead> playback;
+  // Declared last so that it stops before anything a reload uses is
+  // destroyed, nullptr when the files aren't watched
+  std::unique_ptr<file_watcher> watcher;
 
 public:
-  rest_server(int port, const char* file_name):
-    file_name(file_name)
+  rest_server(const options& opts, std::shared_ptr<const dataset> data):
+    opts(opts),
+    hyperslab_cache(opts.cache_bytes, 16, unversioned_hash),
+    rendered_images(opts.read_ahead > 0 ? opts.rendered_image_bytes : 0),
+    current(make_generation(1, data)),
+    io(opts.io_threads),
+    timeseries_builds(opts.timeseries_dir.empty() ?
+      nullptr : std::make_unique<timeseries_builder>()),
+    playback(opts.read_ahead > 0 ? std::make_unique<read_ahead>() : nullptr)
   {
-    CROW_ROUTE(app, "/get-info")([=](){
-      read_netcdf& r = get_read_netcdf_for_thread();
+    if (current->classic) {
+      logger::info("Reading classic format file ", data->get_files()[0].path,
+        " through a shared reader");
+    }
+    else if (data->get_files().size() > 1) {
+      logger::info("Serving ", data->get_files().size(),
+        " files as one dataset along '", dataset::aggregated_dimension, "'");
+    }
+
+    app.get_middleware<pin>().configure([this]() {
+      return std::atomic_load(&current);
+    });
+    // Everything but the statistics is the same for as long as the
+    // files are, see http_cache
+    app.get_middleware<http_cache>().configure(
+      [this]() { return gen().data->get_identity(); },
+      opts.response_cache_bytes, {"/get-cache-stats", "/metrics"});
 
-      std::string json = r.get_info().dump();
+    app.get_middleware<request_metrics>().configure(registry, {
+      "/get-info", "/get-data", "/get-image", "/get-animation",
+      "/get-stats", "/get-timeseries", "/get-batch", "/tiles/", "/get-cache-stats",
+      "/metrics"});
+    auto add_stage = [&](const char* name) {
+      return registry.add_histogram(
+        "netcdf_api_stage_duration_seconds",
+        "Time spent in each stage of handling requests",
+        std::string("stage=\"") + name + "\"");
+    };
+    stages.read = add_stage("read");
+    stages.json = add_stage("json");
+    stages.npy = add_stage("npy");
+    stages.render = add_stage("render");
+    stages.png = add_stage("png");
+    stages.animation = add_stage("animation");
+    stages.stats = add_stage("stats");
+    stages.encode = add_stage("encode");
+    stages.resample = add_stage("resample");
+
+    CROW_ROUTE(app, "/get-info")([=](){
       crow::response res;
       res.code = crow::status::OK;
-      res.body = json;
+      res.body = gen().schema().get_info_body();
       res.set_header("Content-Type", "application/json");
       return res;
     });
 
     CROW_ROUTE(app, "/get-data")([=](const crow::request& req){
-      read_netcdf& r = get_read_netcdf_for_thread();
       uint64_t time_index, z_index;
+      std::string format;
+      std::string variable_name = "concentration";
+      std::optional<hyperslab_query> query;
+      transport_encoding::spec encoding;
+      std::optional<std::pair<std::size_t, std::size_t>> output_size;
+      resampler::method resample = resampler::method::area;
 
       // 1. Check that the request is valid, and if not return BAD_REQUEST
       try
       {
-        time_index = get_url_param_as_uint64(req, "time_index");
-        z_index = get_url_param_as_uint64(req, "z_index");
+        format = get_url_param_as_choice(
+          req, "format", {"json", "raw", "npy"});
+        if (char* e = req.url_params.get("encoding")) {
+          encoding = transport_encoding::parse(e);
+        }
+        if (encoding.shuffle_deflate && format != "raw") {
+          throw std::invalid_argument(
+            "encoding=shuffle-deflate can only be used with format=raw");
+        }
+        if (is_hyperslab_query(req) && (req.url_params.get("width") ||
+              req.url_params.get("height") || req.url_params.get("spacing"))) {
+          throw std::invalid_argument(
+            "width, height and spacing can only be used with time_index " +
+            std::string("and z_index"));
+        }
 
-        // Before continuing, make sure the dimensions are valid
-        // so that if they are invalid, we will return BAD_RESPONSE
-        r.validate_dimension_index("time", time_index);
-        r.validate_dimension_index("z", z_index);
+        if (is_hyperslab_query(req)) {
+          // A general start/count/stride selection of any variable,
+          // which is validated against the variable's dimensions
+          // when it is read
+          if (char* name = req.url_params.get("variable")) {
+            variable_name = name;
+          }
+          query.emplace();
+          query->start = get_url_param_as_uint64_list(req, "start");
+          query->count = get_url_param_as_uint64_list(req, "count");
+          query->stride = get_url_param_as_uint64_list(req, "stride");
+        }
+        else {
+          time_index = get_url_param_as_uint64(req, "time_index");
+          z_index = get_url_param_as_uint64(req, "z_index");
+
+          // Before continuing, make sure the dimensions are valid
+          // so that if they are invalid, we will return BAD_RESPONSE
+          validate_dimension_index("time", time_index);
+          validate_dimension_index("z", z_index);
+
+          output_size = get_output_size(req);
+          resample = get_url_param_as_choice(
+            req, "resample", {"area", "bilinear"}) == "area" ?
+            resampler::method::area : resampler::method::bilinear;
+
+          observe_playback(req, "data/" + std::to_string(z_index),
+            time_index, [this, z_index](std::size_t t) {
+              get_hyperslab("concentration", {t, z_index},
+                io_scheduler::priority::background);
+            });
+        }
       }
       catch (std::exception &e)
       {
@@ -45,32 +265,462 @@ public:
         return crow::response(crow::status::BAD_REQUEST, rsp.dump());
       }
 
-      // 2. Return the data
-      std::string json = r.get_data("concentration", 
-          std::vector<uint64_t>({time_index, z_index})).dump();
+      std::shared_ptr<const hyperslab> slab;
+      try {
+        if (query) {
+          slab = get_hyperslab(variable_name.c_str(), *query);
+        }
+        else if (output_size) {
+          slab = get_resampled_slice(time_index, z_index,
+            output_size->first, output_size->second, resample);
+        }
+        else {
+          slab = get_hyperslab(variable_name.c_str(), {time_index, z_index});
+        }
+      }
+      catch (std::invalid_argument &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 2. Encode the values when asked to, which leaves a slab of the
+      //    encoded values that is written out like any other
       crow::response res;
       res.code = crow::status::OK;
-      res.body = json;
-      res.set_header("Content-Type", "application/json");
+      if (!encoding.empty()) {
+        std::vector<std::pair<std::string, std::string>> headers;
+        try {
+          if (encoding.transform != transport_encoding::spec::values::none) {
+            slab = std::make_shared<const hyperslab>(timed(stages.encode, [&]() {
+              return transport_encoding::encode_values(*slab, encoding, headers);
+            }));
+          }
+        }
+        catch (std::exception &e)
+        {
+          json rsp = json::object();
+          rsp["error"] = e.what();
+          return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+        }
+        res.set_header("X-Encoding", transport_encoding::describe(encoding));
+        for (auto& [name, value]: headers) {
+          res.set_header(name, value);
+        }
+      }
+
+      // 3. Return the data in the requested format
+      if (format == "json") {
+        res.body = timed(stages.json, [&]() {
+          return json_writer::to_json(*slab);
+        });
+        res.set_header("Content-Type", "application/json");
+        return res;
+      }
+
+      try {
+        if (format == "npy") {
+          res.body = timed(stages.npy, [&]() {
+            return binary_format::to_npy(*slab);
+          });
+        }
+        else {
+          res.set_header("X-Dtype", binary_format::numpy_dtype(slab->type));
+          res.set_header("X-Shape", binary_format::shape_header(*slab));
+          for (auto& [name, value]: binary_format::packing_headers(*slab)) {
+            res.set_header(name, value);
+          }
+          if (encoding.shuffle_deflate) {
+            res.body = timed(stages.encode, [&]() {
+              return transport_encoding::shuffle_deflate(*slab);
+            });
+          }
+          else {
+            // No conversion necessary here, the body is simply a copy
+            // of the buffer that netCDF read into
+            res.body = slab->data;
+          }
+        }
+      }
+      catch (std::exception &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+      res.set_header("Content-Type", "application/octet-stream");
       return res;
     });
 
     CROW_ROUTE(app, "/get-image")([=](
         const crow::request& req
       ){
-      read_netcdf& r = get_read_netcdf_for_thread();
-      uint64_t time_index, z_index;
+      uint64_t time_index, z_index, width, height;
+      std::string range;
 
       // 1. Check that the request is valid, and if not return BAD_REQUEST
       try
       {
         time_index = get_url_param_as_uint64(req, "time_index");
         z_index = get_url_param_as_uint64(req, "z_index");
+        range = get_url_param_as_choice(req, "range", {"slice", "global"});
+        if (const char* spacing = req.url_params.get("spacing")) {
+          // One pixel per cell of that size, plus the decorations
+          if (req.url_params.get("width") || req.url_params.get("height")) {
+            throw std::invalid_argument(
+              "Only one of width / height and spacing can be used");
+          }
+          auto [ny, nx] = get_cells_at_spacing(spacing);
+          std::tie(width, height) = contour_renderer::image_size(nx, ny);
+        }
+        else {
+          width = req.url_params.get("width") ?
+            get_url_param_as_uint64(req, "width") :
+            contour_renderer::default_width;
+          height = req.url_params.get("height") ?
+            get_url_param_as_uint64(req, "height") :
+            contour_renderer::default_height;
+        }
+        if (width < 200 || width > contour_renderer::max_width ||
+            height < 150 || height > contour_renderer::max_height) {
+          throw std::invalid_argument(
+            "The image must be between 200x150 and " +
+            std::to_string(contour_renderer::max_width) + "x" +
+            std::to_string(contour_renderer::max_height) +
+            (req.url_params.get("spacing") ? ", spacing gives " +
+              std::to_string(width) + "x" + std::to_string(height) : ""));
+        }
 
         // Before continuing, make sure the dimensions are valid
         // so that if they are invalid, we will return BAD_RESPONSE
-        r.validate_dimension_index("time", time_index);
-        r.validate_dimension_index("z", z_index);
+        validate_dimension_index("time", time_index);
+        validate_dimension_index("z", z_index);
+      }
+      catch (std::exception &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 2. Gather the slice and its coordinates, unless the frame was
+      //    rendered ahead of this request
+      const std::string key = image_key(z_index, range, width, height);
+      observe_playback(req, "image/" + key, time_index,
+        [this, z_index, range, width, height](std::size_t t) {
+          render_image_ahead(t, z_index, range, width, height);
+        });
+      if (auto png = rendered_images.get(
+            versioned(gen(), std::to_string(time_index) + "/" + key))) {
+        crow::response res;
+        res.code = crow::status::OK;
+        res.body = *png;
+        res.set_header("Content-Type", "image/png");
+        return res;
+      }
+
+      contour_plot plot = get_contour_plot(time_index, z_index);
+      // NOTE: the values are drastically different between times, so
+      //   by default the colour scale is fitted to the slice.  With
+      //   range=global it spans the whole variable instead, which
+      //   makes images of different times comparable.
+      if (range == "global") {
+        plot.range = get_global_range("concentration");
+      }
+
+      // 3. Render and return the image, this all happens in memory
+      //    so there is no longer any temp file or waiting involved
+
+      indexed_image image = timed(stages.render, [&]() {
+        auto threads = workers.acquire(std::thread::hardware_concurrency());
+        return contour_renderer::render(plot, width, height, threads.count());
+      });
+      crow::response res;
+      res.code = crow::status::OK;
+      res.body = timed(stages.png, [&]() {
+        return png_encoder::encode(image);
+      });
+      res.set_header("Content-Type", "image/png");
+      return res;
+    });
+
+    CROW_ROUTE(app, "/get-animation")([=](const crow::request& req){
+      uint64_t z_index, time_start, time_end, delay_ms;
+      animation_renderer::format format;
+
+      // 1. Check that the request is valid, and if not return BAD_REQUEST
+      try
+      {
+        z_index = get_url_param_as_uint64(req, "z_index");
+        validate_dimension_index("z", z_index);
+
+        // Every time step by default
+        time_start = req.url_params.get("time_start") ?
+          get_url_param_as_uint64(req, "time_start") : 0;
+        if (req.url_params.get("time_end")) {
+          time_end = get_url_param_as_uint64(req, "time_end");
+        }
+        else {
+          time_end = get_stats_dimensions("concentration", nullptr)[0].size - 1;
+        }
+        validate_dimension_index("time", time_start);
+        validate_dimension_index("time", time_end);
+        if (time_end < time_start) {
+          throw std::invalid_argument("time_end must not be before time_start");
+        }
+        if (time_end - time_start + 1 > max_animation_frames) {
+          throw std::invalid_argument(
+            "Animations are limited to " +
+            std::to_string(max_animation_frames) + " frames");
+        }
+
+        format = get_url_param_as_choice(req, "format", {"gif", "apng"}) == "gif" ?
+          animation_renderer::format::gif : animation_renderer::format::apng;
+        delay_ms = req.url_params.get("delay_ms") ?
+          get_url_param_as_uint64(req, "delay_ms") : 200;
+        if (delay_ms > 60000) {
+          throw std::invalid_argument("delay_ms must be at most 60000");
+        }
+      }
+      catch (std::exception &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 2. Render every frame on the same colour scale, which gives them
+      //    all the same palette, spreading the frames over the cores.
+      //    NOTE: crow (as of 1.2) can only stream static files, so the
+      //      response is sent once the last frame is done rather than
+      //      as the frames finish.
+      auto range = get_global_range("concentration");
+      auto pinned = pin::get_shared();
+      crow::response res;
+      res.code = crow::status::OK;
+      auto timer = registry.time(stages.animation);
+      auto threads = workers.acquire(std::min<std::size_t>(
+        time_end - time_start + 1, std::thread::hardware_concurrency()));
+      res.body = animation_renderer::render(
+        time_end - time_start + 1,
+        [&](std::size_t i) {
+          // The frames are rendered on other threads
+          pin::scope frame_pin(pinned);
+          contour_plot plot = get_contour_plot(time_start + i, z_index);
+          plot.range = range;
+          return contour_renderer::render(plot);
+        },
+        format, delay_ms, threads.count());
+      res.set_header("Content-Type",
+        format == animation_renderer::format::gif ? "image/gif" : "image/apng");
+      return res;
+    });
+
+    CROW_ROUTE(app, "/get-stats")([=](const crow::request& req){
+      std::string variable_name = "concentration";
+      std::vector<double> percentiles = {25, 50, 75};
+      std::vector<stats_reducer::dimension> dims;
+
+      // 1. Check that the request is valid, and if not return BAD_REQUEST
+      try
+      {
+        if (char* name = req.url_params.get("variable")) {
+          variable_name = name;
+        }
+        dims = get_stats_dimensions(variable_name, req.url_params.get("dims"));
+        if (char* list = req.url_params.get("percentiles")) {
+          percentiles = parse_number_list("percentiles", list);
+        }
+      }
+      catch (std::exception &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 2. Stream the variable through the reduction
+      stats_reducer::result stats;
+      try {
+        stats = timed(stages.stats, [&]() {
+          return get_stats(variable_name, dims, percentiles);
+        });
+      }
+      catch (std::invalid_argument &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 3. Each statistic has the shape of the dimensions that were not
+      //    reduced, and is written like /get-data writes its values
+      auto timer = registry.time(stages.json);
+      json meta = {
+        {"variable", variable_name},
+        {"dimensions", stats.dimensions},
+        {"shape", stats.shape},
+      };
+      std::string body = meta.dump();
+      body.pop_back();
+      auto append = [&](const char* name, const std::vector<double>& v) {
+        body += std::string(",\"") + name + "\":" +
+          json_writer::to_json(make_hyperslab(v, stats.shape));
+      };
+      append("count", stats.count);
+      append("min", stats.min);
+      append("max", stats.max);
+      append("sum", stats.sum);
+      append("mean", stats.mean);
+      append("std", stats.std);
+      body += ",\"percentiles\":{";
+      for (std::size_t i = 0; i < stats.percentiles.size(); ++i) {
+        auto& [p, values] = stats.percentiles[i];
+        body += std::string(i > 0 ? "," : "") + "\"" +
+          contour_renderer::format_number(p) + "\":" +
+          json_writer::to_json(make_hyperslab(values, stats.shape));
+      }
+      body += "}}";
+
+      crow::response res;
+      res.code = crow::status::OK;
+      res.body = body;
+      res.set_header("Content-Type", "application/json");
+      return res;
+    });
+
+    CROW_ROUTE(app, "/get-timeseries")([=](const crow::request& req){
+      std::string format;
+      std::string variable_name = "concentration";
+      uint64_t time_start, time_end;
+      // Along each dimension after 'time'
+      std::vector<std::size_t> start, count;
+      std::vector<std::size_t> shape;
+
+      // 1. Check that the request is valid, and if not return BAD_REQUEST
+      try
+      {
+        format = get_url_param_as_choice(
+          req, "format", {"json", "raw", "npy"});
+        if (char* name = req.url_params.get("variable")) {
+          variable_name = name;
+        }
+        auto dims = gen().schema().get_variable_dimensions(variable_name);
+        if (dims.empty() || dims[0].first != dataset::aggregated_dimension ||
+            !is_numeric_nc_type(gen().schema().get_variable(variable_name).type)) {
+          throw std::invalid_argument(
+            "Variable name '" + variable_name + "': is not a numeric " +
+            "variable with '" + dataset::aggregated_dimension +
+            "' as its first dimension");
+        }
+
+        // Every time step by default
+        time_start = req.url_params.get("time_start") ?
+          get_url_param_as_uint64(req, "time_start") : 0;
+        if (req.url_params.get("time_end")) {
+          time_end = get_url_param_as_uint64(req, "time_end");
+        }
+        else {
+          validate_dimension_index(dims[0].first.c_str(), 0);
+          time_end = dims[0].second - 1;
+        }
+        validate_dimension_index(dims[0].first.c_str(), time_start);
+        validate_dimension_index(dims[0].first.c_str(), time_end);
+        if (time_end < time_start) {
+          throw std::invalid_argument("time_end must not be before time_start");
+        }
+        shape.push_back(time_end - time_start + 1);
+
+        // An index along every other dimension, named after it, and
+        // optionally a count of indices from there, eg x=10&x_count=4.
+        // Like a read with prefix indices, the dimensions without a
+        // count aren't part of the shape.
+        std::size_t positions = 1;
+        for (std::size_t d = 1; d < dims.size(); ++d) {
+          auto& [name, size] = dims[d];
+          start.push_back(get_url_param_as_uint64(req, name.c_str()));
+          validate_dimension_index(name.c_str(), start.back());
+          const std::string count_name = name + "_count";
+          count.push_back(1);
+          if (req.url_params.get(count_name)) {
+            count.back() = get_url_param_as_uint64(req, count_name.c_str());
+            if (count.back() == 0 || count.back() > size) {
+              throw std::invalid_argument(
+                "Invalid argument " + count_name + ": must be from 1 to " +
+                std::to_string(size));
+            }
+            validate_dimension_index(name.c_str(), start.back() + count.back() - 1);
+            shape.push_back(count.back());
+          }
+          positions *= count.back();
+        }
+        if (positions > max_timeseries_positions) {
+          throw std::invalid_argument(
+            "Time series are limited to " +
+            std::to_string(max_timeseries_positions) + " positions");
+        }
+      }
+      catch (std::exception &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 2. Read it from the time-major index, or the files until that
+      //    has been built
+      hyperslab series;
+      try {
+        series = get_timeseries(variable_name, start, count, time_start, shape);
+      }
+      catch (std::invalid_argument &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 3. Return it in the requested format
+      crow::response res;
+      res.code = crow::status::OK;
+      if (format == "json") {
+        res.body = timed(stages.json, [&]() {
+          return json_writer::to_json(series);
+        });
+        res.set_header("Content-Type", "application/json");
+      }
+      else if (format == "npy") {
+        res.body = timed(stages.npy, [&]() {
+          return binary_format::to_npy(series);
+        });
+        res.set_header("Content-Type", "application/octet-stream");
+      }
+      else {
+        res.set_header("X-Dtype", binary_format::numpy_dtype(series.type));
+        res.set_header("X-Shape", binary_format::shape_header(series));
+        for (auto& [name, value]: binary_format::packing_headers(series)) {
+          res.set_header(name, value);
+        }
+        res.body = std::move(series.data);
+        res.set_header("Content-Type", "application/octet-stream");
+      }
+      return res;
+    });
+
+    CROW_ROUTE(app, "/get-batch")
+      .methods(crow::HTTPMethod::Get, crow::HTTPMethod::Post)
+      ([=](const crow::request& req){
+      std::string format;
+      std::vector<batch_slice> slices;
+
+      // 1. Check that the request is valid, and if not return BAD_REQUEST
+      try
+      {
+        format = get_url_param_as_choice(req, "format", {"binary", "multipart"});
+        slices = req.method == crow::HTTPMethod::Post ?
+          parse_batch_body(req.body) : parse_batch_params(req);
+        validate_batch(slices);
       }
       catch (std::exception &e)
       {
@@ -79,109 +729,382 @@ public:
         return crow::response(crow::status::BAD_REQUEST, rsp.dump());
       }
 
-      // 2. get a file name to use
-      // Use one temp file per thread...this is to limit the total
-      // number of tempfiles requested
-      thread_local char tmpf[] = "/usr/local/var/tmpimage_XXXXXX.png";
-      thread_local bool initialized = false;
-      if (!initialized) {
-        mkstemps(tmpf, strlen(".png"));
-        initialized = true;
-      }
-      std::cout
-          << "Using tmp_path " << tmpf << " for thread "
-          << std::this_thread::get_id() << std::endl;
-
-      // Ensure that the file is truncated to 0 since 
-      // we are re-using the same files for each thread
-      // and our way of knowing when the files are created
-      // is to ensure the size is non-0.
-      std::filesystem::resize_file(tmpf, 0);
-      // ...and to be 100% sure that our logic below is
-      // set up for success, we'll ensure that file_size
-      // does in fact read '0', in case there could be
-      // any async behavior here.
-      while (std::filesystem::file_size(tmpf) != 0) {
-        usleep(100 * 1000); // sleep 100ms
+      // 2. Read the slices in parallel (each one is coalesced and cached
+      //    like a /get-data read), keeping them in the order they finish
+      struct batch_result {
+        std::size_t index;
+        std::shared_ptr<const hyperslab> slab;
+        std::string error;
       };
+      std::vector<batch_result> results;
+      std::mutex results_mutex;
+      auto pinned = pin::get_shared();
+      auto threads = workers.acquire(std::min(slices.size(),
+        std::max<std::size_t>(
+          io.thread_count(), std::thread::hardware_concurrency())));
+      parallel_for(slices.size(), threads.count(),
+        [&](std::size_t, std::size_t i) {
+          pin::scope slice_pin(pinned);
+          batch_result result{i, nullptr, ""};
+          try {
+            result.slab = slices[i].query ?
+              get_hyperslab(slices[i].variable.c_str(), *slices[i].query) :
+              get_hyperslab(slices[i].variable.c_str(), slices[i].prefix_indices);
+          }
+          catch (std::exception &e) {
+            // Bad indices and failed reads alike only fail their own
+            // slice, rather than the whole batch
+            result.error = e.what();
+          }
+          std::lock_guard<std::mutex> lock(results_mutex);
+          results.push_back(std::move(result));
+        });
+
+      // 3. One part per slice, each described by its own headers
+      //    NOTE: crow (as of 1.2) can't stream a response, so the body is
+      //      sent once the last slice is read.
+      crow::response res;
+      res.code = crow::status::OK;
+      const std::string boundary = format == "multipart" ? make_boundary() : "";
+      const std::string no_data;
+      for (auto& result: results) {
+        const batch_slice& slice = slices[result.index];
+        json header = {
+          {"index", result.index},
+          {"variable", slice.variable},
+        };
+        if (slice.query) {
+          header["start"] = slice.query->start;
+          header["count"] = slice.query->count;
+          header["stride"] = slice.query->stride;
+        }
+        else {
+          header["indices"] = slice.prefix_indices;
+        }
+        if (!result.error.empty()) {
+          header["error"] = result.error;
+        }
+        else {
+          header["dtype"] = binary_format::numpy_dtype(result.slab->type);
+          header["shape"] = result.slab->shape;
+          for (auto& [name, value]:
+              binary_format::packing_fields(*result.slab)) {
+            // A NaN fill value isn't a json number, so is sent as text
+            json number = json::parse(value, nullptr, false);
+            header[name] = number.is_discarded() ? json(value) : number;
+          }
+        }
+        const std::string& data = result.slab ? result.slab->data : no_data;
+
+        if (format == "multipart" && result.slab) {
+          binary_format::append_multipart_part(res.body, boundary, {
+            {"Content-Type", "application/octet-stream"},
+            {"X-Slice", header.dump()},
+          }, data);
+        }
+        else if (format == "multipart") {
+          binary_format::append_multipart_part(res.body, boundary, {
+            {"Content-Type", "application/json"},
+            {"X-Slice", header.dump()},
+          }, json({{"error", result.error}}).dump());
+        }
+        else {
+          header["bytes"] = data.size();
+          binary_format::append_batch_part(res.body, header.dump(), data);
+        }
+      }
+      if (format == "multipart") {
+        binary_format::end_multipart(res.body, boundary);
+        res.set_header("Content-Type", "multipart/mixed; boundary=" + boundary);
+      }
+      else {
+        res.set_header("Content-Type", "application/octet-stream");
+      }
+      return res;
+    });
 
-      // 3. Generate the visualization to the file
-
-      json time_data = r.get_data("time");
-      json x_data = r.get_data("x");
-      json y_data = r.get_data("y");
-      json concentration_data = 
-        r.get_data("concentration", 
-          std::vector<uint64_t>({time_index, z_index}));
-
-      std::vector<double> x, y;
-      for (json xv: x_data) {
-        x.push_back(xv);
-      }
-      for (json yv : y_data)
-      {
-        y.push_back(yv);
-      }
-      auto [X, Y] = matplot::meshgrid(x, y);
-      matplot::vector_2d C;
-      for (json cy: concentration_data) {
-        std::vector<double> cys;
-        for (json cx: cy) {
-          cys.push_back(cx);
-        }
-        C.push_back(cys);
-      }
-
-      // Generate figure without any display in quiet mode
-      auto f = matplot::figure(true);
-      matplot::title(
-        std::string("Concentration (kg/m3) at time ") + 
-        time_data[time_index].dump() + " s");
-      matplot::xlabel("X Distance (m)");
-      matplot::ylabel("Y Distance (m)");
-      matplot::axis(matplot::tight);
-      matplot::contourf(X, Y, C);
-      // NOTE: experimenting with forcing min/max values
-      //   (ultimately this was unhelpful because the
-      //    values are drastically different between times)
-      // matplot::cblim({0, 0.04});
-      // matplot::colormap();
-      matplot::save(tmpf);
-
-
-      // 4. Wait for the file to be created (it seems
-      //    that the save function works asynchronously)
-      while (std::filesystem::file_size(tmpf) == 0) {
-        std::cout << "waiting for visualization to be created" << std::endl;
-        usleep(100 * 1000); // sleep 100ms
+    CROW_ROUTE(app, "/tiles/<string>")([=](std::string variable_name){
+      // Describes the tile pyramid of the variable's 2d slices
+      std::vector<std::pair<std::string, std::size_t>> dims;
+      try {
+        dims = get_tile_dimensions(variable_name);
+      }
+      catch (std::invalid_argument &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+      auto& [y_name, ny] = dims[dims.size() - 2];
+      auto& [x_name, nx] = dims[dims.size() - 1];
+      const std::size_t levels = tile_pyramid::level_count(ny, nx);
+      json rsp = {
+        {"variable", variable_name},
+        {"tile_size", tile_pyramid::tile_size},
+        {"dimensions", {y_name, x_name}},
+        {"levels", json::array()},
       };
+      for (std::size_t l = 0; l < levels; ++l) {
+        std::size_t h = ny, w = nx;
+        for (std::size_t i = l + 1; i < levels; ++i) {
+          h = (h + 1) / 2;
+          w = (w + 1) / 2;
+        }
+        rsp["levels"].push_back({
+          {"level", l},
+          {"shape", {h, w}},
+          {"tiles", {tile_pyramid::tiles(h), tile_pyramid::tiles(w)}},
+        });
+      }
+      crow::response res;
+      res.code = crow::status::OK;
+      res.body = rsp.dump();
+      res.set_header("Content-Type", "application/json");
+      return res;
+    });
+
+    CROW_ROUTE(app, "/tiles/<string>/<uint>/<uint>/<uint>/<uint>/<uint>")([=](
+        const crow::request& req, std::string variable_name,
+        uint64_t time_index, uint64_t z_index,
+        uint64_t level, uint64_t tx, uint64_t ty
+      ){
+      std::string format;
+      tile_pyramid::pooling pool;
+      std::size_t levels;
+      std::vector<std::pair<std::string, std::size_t>> dims;
+
+      // 1. Check that the request is valid, and if not return BAD_REQUEST
+      try
+      {
+        format = get_url_param_as_choice(
+          req, "format", {"png", "json", "raw", "npy"});
+        pool = get_url_param_as_choice(req, "pool", {"mean", "max"}) == "max" ?
+          tile_pyramid::pooling::max : tile_pyramid::pooling::mean;
+
+        dims = get_tile_dimensions(variable_name);
+        if (dims.size() != 4) {
+          throw std::invalid_argument(
+            "Variable name '" + variable_name + "': has " +
+            std::to_string(dims.size()) + " dimensions, tiles need 4 " +
+            "(eg time, z, y, x)");
+        }
+        validate_dimension_index(dims[0].first.c_str(), time_index);
+        validate_dimension_index(dims[1].first.c_str(), z_index);
+        levels = tile_pyramid::level_count(dims[2].second, dims[3].second);
+        if (level >= levels) {
+          throw std::invalid_argument(
+            "Invalid level " + std::to_string(level) + ", there are " +
+            std::to_string(levels) + " levels");
+        }
+      }
+      catch (std::exception &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
+
+      // 2. Cut the tile out of its (lazily built and cached) level
+      hyperslab tile;
+      try {
+        tile = tile_pyramid::extract_tile(
+          *get_tile_level(variable_name, time_index, z_index,
+            pool, level, levels),
+          tx, ty);
+      }
+      catch (std::invalid_argument &e)
+      {
+        json rsp = json::object();
+        rsp["error"] = e.what();
+        return crow::response(crow::status::BAD_REQUEST, rsp.dump());
+      }
 
-      // 3. Return the image
-      std::ifstream image_file(tmpf, std::ios::binary);
-      std::ostringstream image_data;
-      image_data << image_file.rdbuf();
-      std::string image_string = image_data.str();
+      // 3. Return it in the requested format
+      crow::response res;
+      res.code = crow::status::OK;
+      std::string bounds = get_tile_bounds(
+        dims[2].first, dims[3].first, level, levels, tx, ty);
+      if (!bounds.empty()) {
+        res.set_header("X-Tile-Bounds", bounds);
+      }
+      if (format == "png") {
+        // Every tile of every time is coloured on the same scale so
+        // that neighbouring tiles match up
+        auto [min, max] = get_global_range(variable_name);
+        indexed_image image = timed(stages.render, [&]() {
+          return tile_pyramid::render(tile, min, max);
+        });
+        res.body = timed(stages.png, [&]() {
+          return png_encoder::encode(image);
+        });
+        res.set_header("Content-Type", "image/png");
+      }
+      else if (format == "json") {
+        res.body = timed(stages.json, [&]() {
+          return json_writer::to_json(tile);
+        });
+        res.set_header("Content-Type", "application/json");
+      }
+      else if (format == "npy") {
+        res.body = timed(stages.npy, [&]() {
+          return binary_format::to_npy(tile);
+        });
+        res.set_header("Content-Type", "application/octet-stream");
+      }
+      else {
+        res.set_header("X-Dtype", binary_format::numpy_dtype(tile.type));
+        res.set_header("X-Shape", binary_format::shape_header(tile));
+        res.body = std::move(tile.data);
+        res.set_header("Content-Type", "application/octet-stream");
+      }
+      return res;
+    });
 
+    CROW_ROUTE(app, "/get-cache-stats")([=](){
+      auto stats = hyperslab_cache.get_stats();
+      auto io_stats = io.get_stats();
+      auto file_stats = gen().reader->get_pool_stats();
+      auto ahead_stats = playback ? playback->get_stats() : read_ahead::stats{};
+      auto image_stats = rendered_images.get_stats();
+      auto http_stats = app.get_middleware<http_cache>().get_stats();
+      json rsp = {
+        {"hits", stats.hits},
+        {"misses", stats.misses},
+        {"evictions", stats.evictions},
+        {"rejected", stats.rejected},
+        {"entries", stats.entries},
+        {"bytes", stats.bytes},
+        {"budget_bytes", stats.budget_bytes},
+        {"io_reads", io_stats.reads},
+        {"io_coalesced", io_stats.coalesced},
+        {"io_queued", io_stats.queued},
+        {"open_files", file_stats.open},
+        {"max_open_files", file_stats.max_open},
+        {"files_opened", file_stats.opened},
+        {"files_evicted", file_stats.evicted},
+        {"generation", gen().number},
+        {"reloads", reloads.load(std::memory_order_relaxed)},
+        {"read_ahead_scheduled", ahead_stats.scheduled},
+        {"read_ahead_fetched", ahead_stats.fetched},
+        {"read_ahead_cancelled", ahead_stats.cancelled},
+        {"rendered_image_hits", image_stats.hits},
+        {"rendered_image_entries", image_stats.entries},
+        {"rendered_image_bytes", image_stats.bytes},
+        {"not_modified", http_stats.not_modified},
+        {"response_hits", http_stats.compressed.hits},
+        {"response_misses", http_stats.compressed.misses},
+        {"response_entries", http_stats.compressed.entries},
+        {"response_bytes", http_stats.compressed.bytes},
+        {"response_budget_bytes", http_stats.compressed.budget_bytes},
+      };
       crow::response res;
       res.code = crow::status::OK;
-      res.body = image_string;
-      res.set_header("Content-Type", "image/png");
+      res.body = rsp.dump();
+      res.set_header("Content-Type", "application/json");
       return res;
+    });
 
-      // res.set_header("Content-Type", "image/png"); // Explicitly set content type
-      // res.end();
+    CROW_ROUTE(app, "/metrics")([=](){
+      auto stats = hyperslab_cache.get_stats();
+      auto io_stats = io.get_stats();
+      auto file_stats = gen().reader->get_pool_stats();
+      auto ahead_stats = playback ? playback->get_stats() : read_ahead::stats{};
+      auto image_stats = rendered_images.get_stats();
+      auto http_stats = app.get_middleware<http_cache>().get_stats();
+      auto& requests = app.get_middleware<request_metrics>();
+      // Everything that isn't recorded as it happens is read off here
+      std::string body = registry.render() +
+        metrics::format_value("netcdf_api_requests_in_flight",
+          "Requests being handled", "gauge", requests.in_flight()) +
+        metrics::format_value("netcdf_api_generation",
+          "Number of the generation of the files being served", "gauge",
+          gen().number) +
+        metrics::format_value("netcdf_api_reloads_total",
+          "Times the files were reloaded after changing", "counter",
+          reloads.load(std::memory_order_relaxed)) +
+        metrics::format_value("netcdf_api_open_files",
+          "netCDF files open for the I/O threads", "gauge",
+          file_stats.open) +
+        metrics::format_value("netcdf_api_files_opened_total",
+          "netCDF files opened", "counter", file_stats.opened) +
+        metrics::format_value("netcdf_api_files_evicted_total",
+          "netCDF files closed to stay under the limit", "counter",
+          file_stats.evicted) +
+        metrics::format_value("netcdf_api_file_waits_total",
+          "Reads that waited for a file handle", "counter",
+          file_stats.waits) +
+        metrics::format_value("netcdf_api_io_reads_total",
+          "Reads run on the I/O threads", "counter", io_stats.reads) +
+        metrics::format_value("netcdf_api_io_coalesced_total",
+          "Reads that waited on the same read already in flight",
+          "counter", io_stats.coalesced) +
+        metrics::format_value("netcdf_api_io_queued",
+          "Tasks waiting for an I/O thread", "gauge", io_stats.queued) +
+        metrics::format_value("netcdf_api_io_queued_background",
+          "Background reads waiting for an I/O thread", "gauge",
+          io_stats.queued_background) +
+        metrics::format_value("netcdf_api_read_ahead_scheduled_total",
+          "Time steps queued to be read ahead of clients", "counter",
+          ahead_stats.scheduled) +
+        metrics::format_value("netcdf_api_read_ahead_fetched_total",
+          "Time steps read ahead of clients", "counter",
+          ahead_stats.fetched) +
+        metrics::format_value("netcdf_api_read_ahead_cancelled_total",
+          "Time steps no longer read ahead as the client stopped playing",
+          "counter", ahead_stats.cancelled) +
+        metrics::format_value("netcdf_api_rendered_image_hits_total",
+          "Hits on the images rendered ahead", "counter",
+          image_stats.hits) +
+        metrics::format_value("netcdf_api_rendered_image_bytes",
+          "Bytes of images rendered ahead", "gauge", image_stats.bytes) +
+        metrics::format_value("netcdf_api_hyperslab_cache_hits_total",
+          "Hyperslab cache hits", "counter", stats.hits) +
+        metrics::format_value("netcdf_api_hyperslab_cache_misses_total",
+          "Hyperslab cache misses", "counter", stats.misses) +
+        metrics::format_value("netcdf_api_hyperslab_cache_evictions_total",
+          "Hyperslab cache evictions", "counter", stats.evictions) +
+        metrics::format_value("netcdf_api_hyperslab_cache_rejected_total",
+          "Hyperslabs too large for the cache's budget", "counter",
+          stats.rejected) +
+        metrics::format_value("netcdf_api_hyperslab_cache_entries",
+          "Hyperslabs in the cache", "gauge", stats.entries) +
+        metrics::format_value("netcdf_api_hyperslab_cache_bytes",
+          "Bytes of hyperslabs in the cache", "gauge", stats.bytes) +
+        metrics::format_value("netcdf_api_not_modified_total",
+          "Requests answered with 304 Not Modified", "counter",
+          http_stats.not_modified) +
+        metrics::format_value("netcdf_api_response_cache_hits_total",
+          "Compressed response cache hits", "counter",
+          http_stats.compressed.hits) +
+        metrics::format_value("netcdf_api_response_cache_misses_total",
+          "Compressed response cache misses", "counter",
+          http_stats.compressed.misses) +
+        metrics::format_value("netcdf_api_response_cache_bytes",
+          "Bytes of compressed responses in the cache", "gauge",
+          http_stats.compressed.bytes);
+      crow::response res;
+      res.code = crow::status::OK;
+      res.body = std::move(body);
+      res.set_header("Content-Type", "text/plain; version=0.0.4");
+      return res;
     });
 
+    app.port(opts.port);
+    if (opts.http_threads > 0) {
+      app.concurrency(opts.http_threads);
+    }
+    else {
+      app.multithreaded(); // Based on some experimentation, crow always uses a 
+                           // background thread to service requests, but when you
+                           // specify `multithreaded()` it will use *all* the 
+                           // cpus to service requests.  The netCDF reads happen
+                           // on the separate `io` threads so the two can be
+                           // sized independently.
+    }
 
-    app
-      .port(port)
-      .multithreaded(); // Based on some experimentation, crow always uses a 
-                        // background thread to service requests, but when you
-                        // specify `multithreaded()` it will use *all* the 
-                        // cpus to service requests.  I'm leaving this
-                        // specified here, not because this is a high-throughput
-                        // application, but because it's an important indicator
-                        // that we have to deal with multithreading concerns.
+    if (opts.watch) {
+      start_watching(*data);
+    }
   }
 
   /**
@@ -217,27 +1140,1203 @@ private:
   }
 
   /**
-   * Return the read_netcdf instance unique to the current thread.
-   * NOTE: due to the concerns mentioned here...
-   *   https://github.com/Unidata/netcdf-c/issues/1373#issuecomment-637794942
-   *  ...we need to make sure that each NcFile instance is managed
-   *  by no more than one thread.  To accomplish this we are using
-   *  thread_local storage so that each thread has its own instance.
-   *  It is accepted that this will cause a slowdown when each thread
-   *  is invoked for the first time.
+   * Returns the comma separated list of non-negative integers in an
+   * optional url parameter, eg "0,10,10", or an empty list if the
+   * parameter is missing.
    */
-  read_netcdf& get_read_netcdf_for_thread() {
-    thread_local std::unique_ptr<read_netcdf> reader = nullptr;    
-    if (reader == nullptr) {
-      std::cout 
-        << "Creating new read_netcdf for thread " 
-        << std::this_thread::get_id() << std::endl;
-      reader = std::make_unique<read_netcdf>(file_name);
-    } else {
-      std::cout
-          << "Re-using read_netcdf already created for thread "
-          << std::this_thread::get_id() << std::endl;
+  static std::vector<std::size_t> get_url_param_as_uint64_list(
+      const crow::request& req,
+      const char* name) {
+    std::vector<std::size_t> result;
+    char *val = req.url_params.get(name);
+    if (nullptr == val) {
+      return result;
+    }
+    std::stringstream list(val);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+      try {
+        std::size_t used = 0;
+        int64_t value = std::stoll(item, &used);
+        if (used != item.size()) {
+          throw std::invalid_argument("Not an integer '" + item + "'");
+        }
+        if (value < 0) {
+          throw std::invalid_argument("Negative values not allowed");
+        }
+        result.push_back(value);
+      } catch (std::exception& e) {
+        throw std::invalid_argument(
+          std::string("Invalid argument ") + name +
+          ": " + e.what());
+      }
     }
-    return *(reader.get());
-  }  
+    return result;
+  }
+
+  // One slice of a /get-batch request, read like /get-data reads it
+  struct batch_slice {
+    std::string variable;
+    // When there's no query, the first dimensions fixed to these
+    std::vector<uint64_t> prefix_indices;
+    std::optional<hyperslab_query> query;
+  };
+
+  /**
+   * Returns the list of indices in a required url parameter, where each
+   * comma separated item is an index or an inclusive range of them, eg
+   * "0..49" or "0,5,10..12"
+   */
+  static std::vector<uint64_t> get_url_param_as_index_list(
+      const crow::request& req,
+      const char* name) {
+    char *val = req.url_params.get(name);
+    if (nullptr == val) {
+      throw std::invalid_argument(
+        std::string("Missing required argument ") + name);
+    }
+    auto parse = [&](const std::string& item) -> uint64_t {
+      try {
+        std::size_t used = 0;
+        int64_t value = std::stoll(item, &used);
+        if (used != item.size()) {
+          throw std::invalid_argument("Not an integer '" + item + "'");
+        }
+        if (value < 0) {
+          throw std::invalid_argument("Negative values not allowed");
+        }
+        return value;
+      } catch (std::exception& e) {
+        throw std::invalid_argument(
+          std::string("Invalid argument ") + name + ": " + e.what());
+      }
+    };
+    std::vector<uint64_t> result;
+    std::stringstream list(val);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+      std::size_t dots = item.find("..");
+      uint64_t first = parse(item.substr(0, dots));
+      uint64_t last = dots == std::string::npos ?
+        first : parse(item.substr(dots + 2));
+      if (last < first || last - first >= max_batch_slices) {
+        throw std::invalid_argument(
+          std::string("Invalid argument ") + name + ": bad range '" + item + "'");
+      }
+      for (uint64_t i = first; i <= last; ++i) {
+        result.push_back(i);
+      }
+    }
+    return result;
+  }
+
+  /**
+   * Returns the slices of a GET /get-batch: every combination of the
+   * time_index and z_index lists of 'variable' (default concentration)
+   */
+  static std::vector<batch_slice> parse_batch_params(const crow::request& req) {
+    std::string variable_name = "concentration";
+    if (char* name = req.url_params.get("variable")) {
+      variable_name = name;
+    }
+    auto times = get_url_param_as_index_list(req, "time_index");
+    auto zs = get_url_param_as_index_list(req, "z_index");
+    if (times.size() * zs.size() > max_batch_slices) {
+      throw std::invalid_argument(
+        "Batches are limited to " + std::to_string(max_batch_slices) + " slices");
+    }
+    std::vector<batch_slice> slices;
+    for (auto t: times) {
+      for (auto z: zs) {
+        slices.push_back({variable_name, {t, z}, std::nullopt});
+      }
+    }
+    return slices;
+  }
+
+  /**
+   * Returns the slices of a POST /get-batch, whose body is a json list
+   * of objects, each with a "variable" (default concentration) and either
+   * "indices" (like time_index and z_index) or any of "start", "count"
+   * and "stride" (like /get-data), eg
+   *   [{"indices": [0, 0]}, {"variable": "x", "start": [10], "count": [5]}]
+   */
+  static std::vector<batch_slice> parse_batch_body(const std::string& body) {
+    json list = json::parse(body);
+    if (!list.is_array()) {
+      throw std::invalid_argument("The body must be a json list of slices");
+    }
+    if (list.size() > max_batch_slices) {
+      throw std::invalid_argument(
+        "Batches are limited to " + std::to_string(max_batch_slices) + " slices");
+    }
+    std::vector<batch_slice> slices;
+    for (auto& item: list) {
+      batch_slice slice{item.value("variable", "concentration"), {}, std::nullopt};
+      if (item.contains("indices")) {
+        slice.prefix_indices = item["indices"].get<std::vector<uint64_t>>();
+      }
+      else {
+        slice.query.emplace();
+        slice.query->start = item.value("start", std::vector<std::size_t>());
+        slice.query->count = item.value("count", std::vector<std::size_t>());
+        slice.query->stride = item.value("stride", std::vector<std::size_t>());
+      }
+      slices.push_back(std::move(slice));
+    }
+    return slices;
+  }
+
+  /**
+   * Checks every slice of a batch against the catalog, resolving the
+   * queries, and that all of them together aren't too large, so that a
+   * bad batch is rejected before anything is read
+   */
+  void validate_batch(std::vector<batch_slice>& slices) {
+    if (slices.empty()) {
+      throw std::invalid_argument("The batch has no slices");
+    }
+    std::size_t total = 0;
+    for (auto& slice: slices) {
+      const catalog& schema = gen().schema();
+      const catalog::variable& var = schema.get_variable(slice.variable);
+      if (!is_numeric_nc_type(var.type)) {
+        throw std::invalid_argument(
+          "Variable name '" + slice.variable + "': is not a numeric variable");
+      }
+      auto dims = schema.get_variable_dimensions(slice.variable);
+      std::size_t bytes = visit_nc_type(var.type, [](auto tag) {
+        return sizeof(typename decltype(tag)::type);
+      });
+      if (slice.query) {
+        std::vector<std::size_t> sizes;
+        for (auto& d: dims) {
+          sizes.push_back(d.second);
+        }
+        slice.query->resolve(slice.variable, sizes,
+          [&](std::size_t d, std::size_t index) {
+            schema.validate_dimension_index(dims[d].first, index);
+          });
+        for (auto c: slice.query->count) {
+          bytes = c > SIZE_MAX / bytes ? SIZE_MAX : bytes * c;
+        }
+      }
+      else {
+        if (slice.prefix_indices.size() > dims.size()) {
+          throw std::invalid_argument(
+            "Variable name '" + slice.variable + "': has " +
+            std::to_string(dims.size()) + " dimensions but you've " +
+            "specified more indexes (" +
+            std::to_string(slice.prefix_indices.size()) + ")");
+        }
+        for (std::size_t d = 0; d < dims.size(); ++d) {
+          if (d < slice.prefix_indices.size()) {
+            schema.validate_dimension_index(dims[d].first, slice.prefix_indices[d]);
+          }
+          else {
+            bytes = dims[d].second > SIZE_MAX / bytes ?
+              SIZE_MAX : bytes * dims[d].second;
+          }
+        }
+      }
+      total = bytes > SIZE_MAX - total ? SIZE_MAX : total + bytes;
+    }
+    if (total > max_batch_bytes) {
+      throw std::invalid_argument(
+        "Batches are limited to " + std::to_string(max_batch_bytes) +
+        " bytes of values");
+    }
+  }
+
+  /**
+   * Returns a multipart boundary that's vanishingly unlikely to appear
+   * in any of the parts
+   */
+  static std::string make_boundary() {
+    static thread_local std::mt19937_64 random(std::random_device{}());
+    char boundary[40];
+    snprintf(boundary, sizeof(boundary), "batch-%016llx%016llx",
+      (unsigned long long)random(), (unsigned long long)random());
+    return boundary;
+  }
+
+  /**
+   * Whether /get-data was called with any of the general hyperslab
+   * parameters rather than just time_index and z_index
+   */
+  static bool is_hyperslab_query(const crow::request& req) {
+    for (auto name: {"variable", "start", "count", "stride"}) {
+      if (req.url_params.get(name) != nullptr) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Returns the value of an optional url parameter which must be one
+   * of the specified choices.  When the parameter is missing the first
+   * choice is returned as the default.
+   */
+  static std::string get_url_param_as_choice(
+      const crow::request& req,
+      const char* name,
+      const std::vector<std::string>& choices) {
+    char *val = req.url_params.get(name);
+    if (nullptr == val) {
+      return choices.front();
+    }
+    if (std::find(choices.begin(), choices.end(), val) == choices.end()) {
+      std::string allowed;
+      for (auto& c: choices) {
+        allowed += (allowed.empty() ? "" : ", ") + c;
+      }
+      throw std::invalid_argument(
+        std::string("Invalid argument ") + name + 
+        ": must be one of " + allowed);
+    }
+    return val;
+  }
+
+  /**
+   * Returns the hyperslab for the variable with its first dimensions
+   * fixed to 'prefix_indices', from the shared cache if any thread has
+   * read it recently, otherwise reading it from the file and caching it.
+   */
+  std::shared_ptr<const hyperslab> get_hyperslab(
+      const char* variable_name,
+      const std::vector<uint64_t>& prefix_indices,
+      io_scheduler::priority priority = io_scheduler::priority::normal) {
+    // netCDF names can't contain '/' so this can't be ambiguous
+    std::string key = variable_name;
+    for (auto i: prefix_indices) {
+      key += "/" + std::to_string(i);
+    }
+    // Background reads aren't in a hurry, so aren't split either
+    if (priority == io_scheduler::priority::normal) {
+      if (auto split = get_split_hyperslab(key, variable_name,
+            [&](const std::vector<std::pair<std::string, std::size_t>>& dims) {
+              // The same selection as a query, dropping the fixed
+              // dimensions from the shape like read_hyperslab does
+              split_read r;
+              if (prefix_indices.size() > dims.size()) {
+                return r;
+              }
+              for (std::size_t d = 0; d < dims.size(); ++d) {
+                bool fixed = d < prefix_indices.size();
+                r.query.start.push_back(fixed ? prefix_indices[d] : 0);
+                r.query.count.push_back(fixed ? 1 : dims[d].second);
+                r.query.stride.push_back(1);
+                if (!fixed) {
+                  r.shape.push_back(dims[d].second);
+                }
+              }
+              r.valid = true;
+              return r;
+            })) {
+        return split;
+      }
+    }
+    return get_hyperslab(key, [name = std::string(variable_name),
+                               prefix_indices](const auto& reader) {
+      return reader.read_hyperslab(name.c_str(), prefix_indices);
+    }, priority);
+  }
+
+  /**
+   * Same as above for a general start/count/stride selection
+   */
+  std::shared_ptr<const hyperslab> get_hyperslab(
+      const char* variable_name,
+      const hyperslab_query& query) {
+    const std::string key = query.cache_key(variable_name);
+    if (auto split = get_split_hyperslab(key, variable_name,
+          [&](const std::vector<std::pair<std::string, std::size_t>>& dims) {
+            split_read r{query, {}, true};
+            std::vector<std::size_t> sizes;
+            for (auto& d: dims) {
+              sizes.push_back(d.second);
+            }
+            r.query.resolve(variable_name, sizes,
+              [&](std::size_t d, std::size_t index) {
+                gen().schema().validate_dimension_index(dims[d].first, index);
+              });
+            r.shape = r.query.count;
+            return r;
+          })) {
+      return split;
+    }
+    return get_hyperslab(key,
+      [name = std::string(variable_name), query](const auto& reader) {
+        return reader.read_hyperslab(name.c_str(), query);
+      });
+  }
+
+  // A selection resolved against the catalog, see get_split_hyperslab
+  struct split_read {
+    hyperslab_query query;
+    std::vector<std::size_t> shape;
+    bool valid = false;
+  };
+
+  // Reads smaller than this aren't worth splitting
+  static constexpr std::size_t min_split_part_bytes = 4 * 1024 * 1024;
+
+  /**
+   * Reads a large selection of a chunked variable as chunk aligned parts
+   * on several I/O threads at once, so that their chunks are read and
+   * decompressed in parallel, and caches the whole under 'key'.
+   * 'resolve(dims)' returns the selection for the variable's dimensions.
+   * Returns nullptr when the selection isn't worth splitting (or the file
+   * is classic, whose reads are already parallel), leaving the caller to
+   * read it in one go.
+   */
+  template <typename Resolve>
+  std::shared_ptr<const hyperslab> get_split_hyperslab(
+      const std::string& key, const char* variable_name, Resolve resolve) {
+    const generation& g = gen();
+    if (g.classic || io.thread_count() < 2) {
+      return nullptr;
+    }
+    const catalog::variable* var;
+    try {
+      var = &g.schema().get_variable(variable_name);
+    }
+    catch (std::invalid_argument&) {
+      // Left for the read to report
+      return nullptr;
+    }
+    if (var->chunking.empty() || !is_numeric_nc_type(var->type)) {
+      return nullptr;
+    }
+
+    split_read r = resolve(g.schema().get_variable_dimensions(variable_name));
+    if (!r.valid) {
+      return nullptr;
+    }
+    std::size_t bytes = visit_nc_type(var->type, [](auto tag) {
+      return sizeof(typename decltype(tag)::type);
+    });
+    for (auto c: r.query.count) {
+      bytes = c > SIZE_MAX / bytes ? SIZE_MAX : bytes * c;
+    }
+    const std::size_t max_parts = std::min(
+      io.thread_count(), bytes / min_split_part_bytes);
+    std::vector<hyperslab_query> parts = r.query.split(var->chunking, max_parts);
+    if (parts.size() < 2) {
+      return nullptr;
+    }
+    // Only now that the read is known to be split: the caller's fallback
+    // looks the key up itself, so looking it up any earlier would count
+    // every read that isn't split as two misses
+    if (auto cached = hyperslab_cache.get(versioned(g, key))) {
+      return cached;
+    }
+
+    // Each part is coalesced with the same part of any concurrent read
+    std::vector<std::shared_future<std::shared_ptr<const hyperslab>>> reads;
+    for (auto& part: parts) {
+      reads.push_back(io.read(g.reader,
+        versioned(g, part.cache_key(variable_name)),
+        [this, name = std::string(variable_name), part](const dataset_reader& reader) {
+          return std::make_shared<const hyperslab>(timed(stages.read, [&]() {
+            return reader.read_hyperslab(name.c_str(), part);
+          }));
+        }));
+    }
+    hyperslab slab;
+    for (auto& read: reads) {
+      auto part = read.get();
+      if (slab.data.empty()) {
+        slab.type = part->type;
+        slab.element_size = part->element_size;
+        slab.packing = part->packing;
+        slab.data.reserve(bytes);
+      }
+      slab.data += part->data;
+    }
+    slab.shape = std::move(r.shape);
+    auto result = std::make_shared<const hyperslab>(std::move(slab));
+    hyperslab_cache.put(versioned(g, key), result, hyperslab_bytes(*result));
+    return result;
+  }
+
+  /**
+   * Returns the cached hyperslab for 'key', or calls 'read' with
+   * whichever reader is appropriate for the files to produce it, on the
+   * I/O threads with that priority.
+   */
+  template <typename Read>
+  std::shared_ptr<const hyperslab> get_hyperslab(
+      const std::string& key, Read read,
+      io_scheduler::priority priority = io_scheduler::priority::normal) {
+    const generation& g = gen();
+    const std::string versioned_key = versioned(g, key);
+    if (g.classic) {
+      // No need to go through the I/O threads, the classic reader
+      // can be used from any thread
+      return hyperslab_cache.get_or_load(versioned_key,
+        [&]() { return timed(stages.read, [&]() { return read(*g.classic); }); },
+        hyperslab_bytes);
+    }
+
+    if (auto cached = hyperslab_cache.get(versioned_key)) {
+      return cached;
+    }
+    // The result is cached before the read is marked as complete, so
+    // any request arriving after this point finds it in the cache.
+    return io.read(g.reader, versioned_key,
+      [this, versioned_key, read](const dataset_reader& r) {
+        auto slab = std::make_shared<const hyperslab>(
+          timed(stages.read, [&]() { return read(r); }));
+        hyperslab_cache.put(versioned_key, slab, hyperslab_bytes(*slab));
+        return slab;
+      }, priority).get();
+  }
+
+  /**
+   * Returns the contour plot of the concentration at the specified
+   * time and z, as shown by /get-image
+   */
+  contour_plot get_contour_plot(
+      uint64_t time_index, uint64_t z_index,
+      io_scheduler::priority priority = io_scheduler::priority::normal) {
+    contour_plot plot;
+    plot.x = get_hyperslab("x", hyperslab_query())->to_doubles();
+    plot.y = get_hyperslab("y", hyperslab_query())->to_doubles();
+    plot.values = get_hyperslab(
+      "concentration", {time_index, z_index}, priority)->to_doubles();
+    plot.title =
+      std::string("Concentration (kg/m3) at time ") +
+      json_writer::to_json(*get_hyperslab("time", {time_index}, priority)) +
+      " s";
+    plot.xlabel = "X Distance (m)";
+    plot.ylabel = "Y Distance (m)";
+    return plot;
+  }
+
+  /**
+   * Tells read_ahead that the client asked for 'time_index' of the
+   * concentration in 'stream' (eg a route and z), and has it call
+   * 'fetch(t)' for the time steps ahead of a client playing through
+   * them, with the request's generation pinned.
+   */
+  void observe_playback(
+      const crow::request& req,
+      const std::string& stream,
+      std::size_t time_index,
+      std::function<void(std::size_t)> fetch) {
+    if (!playback) {
+      return;
+    }
+    const generation& g = gen();
+    auto dims = g.schema().get_variable_dimensions("concentration");
+    std::size_t slice_bytes = visit_nc_type(
+      g.schema().get_variable("concentration").type,
+      [](auto tag) { return sizeof(typename decltype(tag)::type); });
+    for (std::size_t d = 2; d < dims.size(); ++d) {
+      slice_bytes *= dims[d].second;
+    }
+    // Each client reads at most an eighth of the hyperslab cache ahead,
+    // so a few of them playing can't push everything else out of it
+    const std::size_t depth = std::min(opts.read_ahead,
+      opts.cache_bytes / 8 / std::max<std::size_t>(slice_bytes, 1));
+    playback->observe(req.remote_ip_address + " " + stream,
+      time_index, dims[0].second, depth,
+      [pinned = pin::get_shared(), fetch](std::size_t t) {
+        pin::scope scope(pinned);
+        fetch(t);
+      });
+  }
+
+  // The part of a /get-image frame's key after its time index
+  static std::string image_key(
+      uint64_t z_index, const std::string& range,
+      uint64_t width, uint64_t height) {
+    return std::to_string(z_index) + "/" + range + "/" +
+      std::to_string(width) + "x" + std::to_string(height);
+  }
+
+  /**
+   * Renders the /get-image frame into rendered_images, reading what it
+   * needs in the background
+   */
+  void render_image_ahead(
+      uint64_t time_index, uint64_t z_index, const std::string& range,
+      uint64_t width, uint64_t height) {
+    const std::string key = versioned(gen(), std::to_string(time_index) +
+      "/" + image_key(z_index, range, width, height));
+    if (rendered_images.get(key)) {
+      return;
+    }
+    contour_plot plot = get_contour_plot(
+      time_index, z_index, io_scheduler::priority::background);
+    if (range == "global") {
+      plot.range = get_global_range("concentration");
+    }
+    auto png = std::make_shared<const std::string>(
+      png_encoder::encode(contour_renderer::render(plot, width, height)));
+    rendered_images.put(key, png, sizeof(std::string) + png->size());
+  }
+
+  /**
+   * Returns the dimensions of the variable for stats_reducer, reducing
+   * those named in the comma separated 'reduce_list', or all of them
+   * when it is nullptr.
+   */
+  std::vector<stats_reducer::dimension> get_stats_dimensions(
+      const std::string& variable_name,
+      const char* reduce_list) {
+    auto var_dims = gen().schema().get_variable_dimensions(variable_name);
+
+    std::vector<stats_reducer::dimension> dims;
+    for (auto& [name, size]: var_dims) {
+      dims.push_back({name, size, reduce_list == nullptr});
+    }
+    if (reduce_list != nullptr) {
+      std::stringstream list(reduce_list);
+      std::string name;
+      while (std::getline(list, name, ',')) {
+        auto it = std::find_if(dims.begin(), dims.end(),
+          [&](auto& d) { return d.name == name; });
+        if (it == dims.end()) {
+          throw std::invalid_argument(
+            "Variable name '" + variable_name +
+            "': has no dimension '" + name + "'");
+        }
+        it->reduce = true;
+      }
+    }
+    return dims;
+  }
+
+  /**
+   * Runs stats_reducer over the variable.  The slabs are read on the
+   * I/O threads (or directly for classic files) but bypass the hyperslab
+   * cache, so a pass over a whole variable doesn't evict everything else.
+   */
+  stats_reducer::result get_stats(
+      const std::string& variable_name,
+      const std::vector<stats_reducer::dimension>& dims,
+      const std::vector<double>& percentiles) {
+    // The slabs are read from several threads
+    const generation& g = gen();
+    auto threads = workers.acquire(std::thread::hardware_concurrency());
+    return stats_reducer::reduce(dims, percentiles,
+      [&](const hyperslab_query& query) {
+        if (g.classic) {
+          return timed(stages.read, [&]() {
+            return g.classic->read_hyperslab(variable_name.c_str(), query);
+          });
+        }
+        return io.run(g.reader, [&](const dataset_reader& r) {
+          return timed(stages.read, [&]() {
+            return r.read_hyperslab(variable_name.c_str(), query);
+          });
+        }).get();
+      },
+      threads.count());
+  }
+
+  /**
+   * Returns 'count' indices from 'start' along each dimension after
+   * 'time' of every time step from 'time_start', with 'shape' as its
+   * shape, from the variable's timeseries_index if it has been built.
+   * Until then it's read from the files, a read that touches every time
+   * step, and is cached like any other hyperslab.
+   */
+  hyperslab get_timeseries(
+      const std::string& variable_name,
+      const std::vector<std::size_t>& start,
+      const std::vector<std::size_t>& count,
+      std::size_t time_start,
+      const std::vector<std::size_t>& shape) {
+    if (auto index = get_timeseries_index(variable_name)) {
+      return timed(stages.read, [&]() {
+        return index->read(start, count, time_start, shape[0], shape);
+      });
+    }
+    hyperslab_query query;
+    query.start.push_back(time_start);
+    query.start.insert(query.start.end(), start.begin(), start.end());
+    query.count.push_back(shape[0]);
+    query.count.insert(query.count.end(), count.begin(), count.end());
+    query.stride.assign(query.start.size(), 1);
+    hyperslab series = *get_hyperslab(variable_name.c_str(), query);
+    series.shape = shape;
+    return series;
+  }
+
+  /**
+   * Returns the time-major index of the variable for the request's
+   * generation of the files, or nullptr when there isn't one (yet), in
+   * which case it's queued to be built in timeseries_dir.
+   */
+  std::shared_ptr<const timeseries_index> get_timeseries_index(
+      const std::string& variable_name) {
+    if (!timeseries_builds) {
+      return nullptr;
+    }
+    const generation& g = gen();
+    {
+      std::lock_guard<std::mutex> lock(g.timeseries_indexes_mutex);
+      auto it = g.timeseries_indexes.find(variable_name);
+      if (it != g.timeseries_indexes.end()) {
+        return it->second;
+      }
+    }
+    // Named after the files, so that they're rebuilt when they change
+    const std::string& identity = g.data->get_identity();
+    const std::string path =
+      opts.timeseries_dir + "/" + variable_name + "-" + identity + ".tseries";
+    if (std::shared_ptr<const timeseries_index> index =
+          timeseries_index::open(path, identity)) {
+      std::lock_guard<std::mutex> lock(g.timeseries_indexes_mutex);
+      g.timeseries_indexes[variable_name] = index;
+      return index;
+    }
+
+    std::weak_ptr<const generation> pinned = pin::get_shared();
+    timeseries_builds->submit(path,
+      [this, pinned, path, variable_name](const std::atomic<bool>& stopping) {
+        auto g = pinned.lock();
+        if (!g || g != std::atomic_load(&current)) {
+          // The files changed before it got a chance to start
+          return;
+        }
+        std::vector<std::size_t> sizes;
+        for (auto& d: g->schema().get_variable_dimensions(variable_name)) {
+          sizes.push_back(d.second);
+        }
+        logger::info("Building the timeseries index of '", variable_name,
+          "' in ", path);
+        bool built = timeseries_index::build(path, g->data->get_identity(),
+          g->schema().get_variable(variable_name).type, sizes,
+          [&](const hyperslab_query& query) {
+            return g->classic ?
+              g->classic->read_hyperslab(variable_name.c_str(), query) :
+              g->reader->read_hyperslab(variable_name.c_str(), query);
+          },
+          stopping);
+        if (built) {
+          logger::info("Built the timeseries index of '", variable_name, "'");
+        }
+      });
+    return nullptr;
+  }
+
+  /**
+   * Returns the minimum and maximum of the whole variable, which are
+   * worked out once and remembered
+   */
+  std::pair<double, double> get_global_range(const std::string& variable_name) {
+    const generation& g = gen();
+    {
+      std::lock_guard<std::mutex> lock(g.global_ranges_mutex);
+      auto it = g.global_ranges.find(variable_name);
+      if (it != g.global_ranges.end()) {
+        return it->second;
+      }
+    }
+    auto dims = get_stats_dimensions(variable_name, nullptr);
+    auto stats = get_stats(variable_name, dims, {});
+    std::pair<double, double> range = {stats.min[0], stats.max[0]};
+    if (!std::isfinite(range.first)) {
+      // No valid values at all
+      range = {0, 0};
+    }
+    std::lock_guard<std::mutex> lock(g.global_ranges_mutex);
+    g.global_ranges[variable_name] = range;
+    return range;
+  }
+
+  /**
+   * Returns the dimensions of a variable that can be tiled, ie one with
+   * at least 2 dimensions, the last two of which are y and x
+   */
+  std::vector<std::pair<std::string, std::size_t>> get_tile_dimensions(
+      const std::string& variable_name) {
+    auto dims = gen().schema().get_variable_dimensions(variable_name);
+    if (dims.size() < 2) {
+      throw std::invalid_argument(
+        "Variable name '" + variable_name + "': has " +
+        std::to_string(dims.size()) + " dimensions, tiles need at least 2");
+    }
+    return dims;
+  }
+
+  /**
+   * Returns "xmin,ymin,xmax,ymax", the coordinates of the centres of the
+   * first and last cells of the tile, or an empty string if the slice's
+   * dimensions don't have coordinate variables (variables with the same
+   * name as the dimension, following the CF conventions).
+   */
+  std::string get_tile_bounds(
+      const std::string& y_name, const std::string& x_name,
+      std::size_t level, std::size_t levels,
+      std::size_t tx, std::size_t ty) {
+    std::vector<double> x, y;
+    try {
+      x = get_hyperslab(x_name.c_str(), hyperslab_query())->to_doubles();
+      y = get_hyperslab(y_name.c_str(), hyperslab_query())->to_doubles();
+    }
+    catch (std::invalid_argument&) {
+      return "";
+    }
+    for (std::size_t l = level + 1; l < levels; ++l) {
+      x = tile_pyramid::downsample_coordinates(x);
+      y = tile_pyramid::downsample_coordinates(y);
+    }
+    const std::size_t n = tile_pyramid::tile_size;
+    if (tx * n >= x.size() || ty * n >= y.size()) {
+      return "";
+    }
+    std::string result;
+    for (double v: {
+        x[tx * n], y[ty * n],
+        x[std::min(x.size(), (tx + 1) * n) - 1],
+        y[std::min(y.size(), (ty + 1) * n) - 1]}) {
+      result += (result.empty() ? "" : ",") +
+        json_writer::to_json(make_hyperslab({v}, {}));
+    }
+    return result;
+  }
+
+  /**
+   * Returns level 'level' of the tile pyramid of the slice of the
+   * variable at (time_index, z_index).  Each level is built from the
+   * next finer one the first time it's needed and then cached like any
+   * other hyperslab, so a viewer zooming out of a slice only ever reads
+   * the slice once.
+   */
+  std::shared_ptr<const hyperslab> get_tile_level(
+      const std::string& variable_name,
+      uint64_t time_index, uint64_t z_index,
+      tile_pyramid::pooling pool,
+      std::size_t level, std::size_t levels) {
+    const bool finest = level + 1 == levels;
+    // The finest level is the same for every kind of pooling
+    const std::string key = versioned(gen(),
+      variable_name + "/" + std::to_string(time_index) +
+      "/" + std::to_string(z_index) + "#tiles/" +
+      (finest ? "" : pool == tile_pyramid::pooling::max ? "max/" : "mean/") +
+      std::to_string(level));
+    if (auto cached = hyperslab_cache.get(key)) {
+      return cached;
+    }
+    auto slab = std::make_shared<const hyperslab>(finest ?
+      tile_pyramid::full_resolution(
+        *get_hyperslab(variable_name.c_str(), {time_index, z_index})) :
+      tile_pyramid::downsample(
+        *get_tile_level(variable_name, time_index, z_index,
+          pool, level + 1, levels),
+        pool));
+    hyperslab_cache.put(key, slab, hyperslab_bytes(*slab));
+    return slab;
+  }
+
+  /**
+   * Returns the size {ny, nx} that /get-data is asked to resample the
+   * concentration's slices to: 'width' and / or 'height', the other
+   * keeping the slice's aspect ratio when only one is given, or
+   * 'spacing' between the cells in the units of the x and y
+   * coordinates.  Returns nullopt when it isn't asked to.
+   */
+  std::optional<std::pair<std::size_t, std::size_t>> get_output_size(
+      const crow::request& req) {
+    const bool sized = req.url_params.get("width") ||
+      req.url_params.get("height");
+    const char* spacing = req.url_params.get("spacing");
+    if (!sized && !spacing) {
+      return std::nullopt;
+    }
+    if (sized && spacing) {
+      throw std::invalid_argument(
+        "Only one of width / height and spacing can be used");
+    }
+    auto dims = gen().schema().get_variable_dimensions("concentration");
+    const std::size_t ny = dims[dims.size() - 2].second;
+    const std::size_t nx = dims[dims.size() - 1].second;
+
+    std::size_t out_ny, out_nx;
+    if (spacing) {
+      std::tie(out_ny, out_nx) = get_cells_at_spacing(spacing);
+    }
+    else {
+      out_nx = req.url_params.get("width") ?
+        get_url_param_as_uint64(req, "width") : 0;
+      out_ny = req.url_params.get("height") ?
+        get_url_param_as_uint64(req, "height") : 0;
+      if (!req.url_params.get("height")) {
+        out_ny = std::max<std::size_t>(1, std::llround(
+          (double)out_nx * ny / nx));
+      }
+      else if (!req.url_params.get("width")) {
+        out_nx = std::max<std::size_t>(1, std::llround(
+          (double)out_ny * nx / ny));
+      }
+    }
+    if (out_ny == 0 || out_nx == 0 ||
+        out_ny > resampler::max_size || out_nx > resampler::max_size) {
+      throw std::invalid_argument(
+        "The resampled slice must be between 1 and " +
+        std::to_string(resampler::max_size) + " cells along x and y");
+    }
+    return std::make_pair(out_ny, out_nx);
+  }
+
+  /**
+   * Returns the number of cells {ny, nx} 'spacing' apart (in the units of
+   * the x and y coordinates) that fit in the extent of the coordinates,
+   * saturating just above resampler::max_size
+   */
+  std::pair<std::size_t, std::size_t> get_cells_at_spacing(
+      const char* spacing) {
+    double metres = 0;
+    try {
+      metres = std::stod(spacing);
+    }
+    catch (std::exception& e) {
+      throw std::invalid_argument(
+        std::string("Invalid argument spacing: ") + e.what());
+    }
+    if (!(metres > 0)) {
+      throw std::invalid_argument("spacing must be more than 0");
+    }
+    auto cells = [&](const char* name) -> std::size_t {
+      auto coords = get_hyperslab(name, hyperslab_query())->to_doubles();
+      if (coords.size() < 2) {
+        throw std::invalid_argument(
+          std::string("spacing needs at least 2 ") + name + " coordinates");
+      }
+      const double n = std::fabs(coords.back() - coords.front()) / metres;
+      return n < resampler::max_size ? (std::size_t)n + 1 :
+        resampler::max_size + 1;
+    };
+    return {cells("y"), cells("x")};
+  }
+
+  /**
+   * Returns the concentration at (time_index, z_index) resampled to
+   * 'ny' x 'nx', which is cached like any other hyperslab so a client
+   * asking for the same size again doesn't resample it again
+   */
+  std::shared_ptr<const hyperslab> get_resampled_slice(
+      uint64_t time_index, uint64_t z_index,
+      std::size_t ny, std::size_t nx, resampler::method m) {
+    const std::string key = versioned(gen(),
+      "concentration/" + std::to_string(time_index) +
+      "/" + std::to_string(z_index) + "#resample/" +
+      (m == resampler::method::area ? "area/" : "bilinear/") +
+      std::to_string(ny) + "x" + std::to_string(nx));
+    if (auto cached = hyperslab_cache.get(key)) {
+      return cached;
+    }
+    auto slice = get_hyperslab("concentration", {time_index, z_index});
+    auto slab = std::make_shared<const hyperslab>(
+      timed(stages.resample, [&]() {
+        auto threads = workers.acquire(std::thread::hardware_concurrency());
+        return resampler::resample(*slice, ny, nx, m, threads.count());
+      }));
+    hyperslab_cache.put(key, slab, hyperslab_bytes(*slab));
+    return slab;
+  }
+
+  /**
+   * Returns the generation of the files the request being handled on
+   * this thread uses, see generation_pin
+   */
+  static const generation& gen() {
+    return pin::get();
+  }
+
+  /**
+   * Returns the key under which a hyperslab of the generation is cached
+   * or its read coalesced, so that the generations never mix
+   */
+  static std::string versioned(const generation& g, const std::string& key) {
+    return std::to_string(g.number) + "@" + key;
+  }
+
+  /**
+   * Hashes a versioned key without its generation, so that reload's
+   * rekey keeps each hyperslab in the same shard of the cache and can
+   * rename it there, without it ever going missing
+   */
+  static std::size_t unversioned_hash(const std::string& key) {
+    std::string_view k(key);
+    return std::hash<std::string_view>()(k.substr(k.find('@') + 1));
+  }
+
+  std::shared_ptr<generation> make_generation(
+      std::uint64_t number, std::shared_ptr<const dataset> data) const {
+    auto g = std::make_shared<generation>();
+    g->number = number;
+    g->data = data;
+    // Only a single file is mapped, a dataset of several is read through
+    // the netCDF library
+    if (data->get_files().size() == 1) {
+      g->classic = classic_reader::open(data->get_files()[0].path.c_str());
+    }
+    // The files are leased by the I/O threads, so keeping fewer open than
+    // there are threads would only make them wait
+    g->reader = std::make_shared<const dataset_reader>(
+      data, std::max(opts.max_open_files, opts.io_threads));
+    return g;
+  }
+
+  /**
+   * Starts watching the directory the files are in, reloading them
+   * when they change.  Failing to watch isn't fatal, the files are
+   * simply served as they were when the server started.
+   */
+  void start_watching(const dataset& data) {
+    const std::string directory = data.get_directory();
+    if (data.get_source().empty() || directory.empty()) {
+      logger::warning("Not watching ", data.get_source(),
+        " for changes, its files aren't in a single directory");
+      return;
+    }
+    try {
+      watcher = std::make_unique<file_watcher>(directory,
+        [this](const std::string& name) {
+          return std::atomic_load(&current)->data->is_source_file(name);
+        },
+        [this]() { reload(); });
+      logger::info("Watching ", directory, " for changes");
+    }
+    catch (std::exception& e) {
+      logger::warning(e.what(), ", changes to the files won't be served");
+    }
+  }
+
+  /**
+   * Finds and indexes the files again and, if they've changed, makes a
+   * new generation of them current.  The cached hyperslabs that read
+   * the same values from the new files (see still_valid) are carried
+   * over to it and the rest are dropped.  Requests that are already
+   * running finish with the generation they started with.
+   * If the files can't be read, eg one is only half written, the current
+   * generation stays until the next change.
+   * NOTE: entries cached by requests of the old generation while this
+   *   runs are never hit again and simply age out of the cache.
+   * NOTE: the running requests keep reading the old generation's files
+   *   however they've changed.  That's safe even when one has been
+   *   truncated, as every reader (classic_reader included) reads with
+   *   pread rather than through a mapping, so it's a failed read rather
+   *   than a SIGBUS.
+   */
+  void reload() {
+    auto old = std::atomic_load(&current);
+    std::shared_ptr<const dataset> data;
+    try {
+      data = dataset::open(old->data->get_source());
+    }
+    catch (std::exception& e) {
+      logger::warning("Not reloading ", old->data->get_source(), ": ", e.what());
+      return;
+    }
+    if (data->get_identity() == old->data->get_identity()) {
+      return;
+    }
+    auto next = make_generation(old->number + 1, data);
+
+    const std::string old_prefix = versioned(*old, "");
+    const std::size_t kept = hyperslab_cache.rekey([&](const std::string& key) {
+      if (key.compare(0, old_prefix.size(), old_prefix) != 0) {
+        // Left over from an even older generation
+        return std::string();
+      }
+      std::string unversioned = key.substr(old_prefix.size());
+      return still_valid(unversioned, *old, *next) ?
+        versioned(*next, unversioned) : std::string();
+    });
+    {
+      std::lock_guard<std::mutex> lock(old->global_ranges_mutex);
+      for (auto& [name, range]: old->global_ranges) {
+        if (still_valid(name, *old, *next)) {
+          next->global_ranges[name] = range;
+        }
+      }
+    }
+
+    std::atomic_store(&current, std::shared_ptr<const generation>(next));
+    reloads.fetch_add(1, std::memory_order_relaxed);
+    logger::info("Reloaded ", data->get_files().size(), " file(s) from ",
+      data->get_source(), " as generation ", next->number, ", keeping ",
+      kept, " cached hyperslabs");
+  }
+
+  /**
+   * Whether the hyperslab cached under 'key' (without its generation,
+   * see get_hyperslab and get_tile_level for the keys) has the same
+   * values in the next generation, ie the variable has the same shape
+   * apart from along 'time', and every time step it covers comes from
+   * the same index of the same file, which is unchanged or only had
+   * time steps appended to it.
+   * NOTE: this relies on files only changing in place by having time
+   *   steps appended, which is how models write their output.  Anything
+   *   else should replace the file (eg write a new one and rename it over
+   *   the old one), which gives it a new inode so nothing read from the
+   *   old one is kept.
+   */
+  static bool still_valid(
+      const std::string& key, const generation& old, const generation& next) {
+    const std::string name = key.substr(0, key.find_first_of("/?#"));
+    std::vector<std::pair<std::string, std::size_t>> before, after;
+    try {
+      if (old.schema().get_variable(name).type !=
+          next.schema().get_variable(name).type) {
+        return false;
+      }
+      before = old.schema().get_variable_dimensions(name);
+      after = next.schema().get_variable_dimensions(name);
+    }
+    catch (std::invalid_argument&) {
+      return false;
+    }
+    const bool along_time =
+      !before.empty() && before[0].first == dataset::aggregated_dimension;
+    if (before.size() != after.size()) {
+      return false;
+    }
+    for (std::size_t d = 0; d < before.size(); ++d) {
+      if (before[d].first != after[d].first ||
+          (before[d].second != after[d].second && !(along_time && d == 0))) {
+        return false;
+      }
+    }
+
+    const auto& old_files = old.data->get_files();
+    const auto& next_files = next.data->get_files();
+    if (!along_time) {
+      // Read from the first file
+      return is_same_or_appended(old_files[0], next_files[0]);
+    }
+
+    // The time steps the key covers
+    const std::string rest = key.substr(name.size());
+    std::size_t start = 0, count = 0, stride = 1;
+    if (rest.empty() || rest[0] == '?') {
+      std::size_t lists[3] = {SIZE_MAX, SIZE_MAX, SIZE_MAX};
+      if (!rest.empty()) {
+        // "?/start,.../count,.../stride,.../", see hyperslab_query::cache_key
+        std::stringstream items(rest.substr(2));
+        std::string item;
+        for (std::size_t i = 0; i < 3 && std::getline(items, item, '/'); ++i) {
+          if (!item.empty()) {
+            lists[i] = std::stoull(item);
+          }
+        }
+      }
+      start = lists[0] == SIZE_MAX ? 0 : lists[0];
+      stride = lists[2] == SIZE_MAX ? 1 : lists[2];
+      if (lists[1] == SIZE_MAX) {
+        // Every time step from 'start', however many there are
+        if (before[0].second != after[0].second) {
+          return false;
+        }
+        count = start < before[0].second ?
+          (before[0].second - start + stride - 1) / stride : 0;
+      }
+      else {
+        count = lists[1];
+      }
+    }
+    else if (rest[0] == '/') {
+      start = std::stoull(rest.substr(1));
+      count = 1;
+    }
+    else {
+      return false;
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+      const std::size_t t = start + i * stride;
+      if (t >= after[0].second) {
+        return false;
+      }
+      auto [old_file, old_local] = old.data->locate(t);
+      auto [next_file, next_local] = next.data->locate(t);
+      if (old_local != next_local ||
+          !is_same_or_appended(old_files[old_file], next_files[next_file])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool is_same_or_appended(
+      const dataset::file& before, const dataset::file& after) {
+    if (before.path != after.path) {
+      return false;
+    }
+    if (before.identity == after.identity) {
+      return true;
+    }
+    // The identity starts with the inode
+    auto inode = [](const std::string& id) { return id.substr(0, id.find('-')); };
+    return inode(before.identity) == inode(after.identity) &&
+      after.time_size >= before.time_size;
+  }
+
+  /**
+   * Wraps the values in a hyperslab of doubles, eg for json_writer
+   */
+  static hyperslab make_hyperslab(
+      const std::vector<double>& values,
+      const std::vector<std::size_t>& shape) {
+    hyperslab slab;
+    slab.type = NC_DOUBLE;
+    slab.element_size = sizeof(double);
+    slab.shape = shape;
+    slab.data.assign((const char*)values.data(), values.size() * sizeof(double));
+    return slab;
+  }
+
+  /**
+   * Parses a comma separated list of numbers from the url parameter 'name'
+   */
+  static std::vector<double> parse_number_list(
+      const char* name, const std::string& list) {
+    std::vector<double> result;
+    std::stringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+      try {
+        std::size_t used = 0;
+        result.push_back(std::stod(item, &used));
+        if (used != item.size()) {
+          throw std::invalid_argument("Not a number '" + item + "'");
+        }
+      } catch (std::exception& e) {
+        throw std::invalid_argument(
+          std::string("Invalid argument ") + name + ": " + e.what());
+      }
+    }
+    return result;
+  }
+
+  /**
+   * Returns fn(), recording how long it took under the stage
+   */
+  template <typename F>
+  std::invoke_result_t<F> timed(metrics::histogram stage, F&& fn) {
+    auto timer = registry.time(stage);
+    return fn();
+  }
+
+  static std::size_t hyperslab_bytes(const hyperslab& slab) {
+    return sizeof(slab) + slab.data.size();
+  }
+
+  /**
+   * Validates the dimension index against the catalog, see
+   * read_netcdf::validate_dimension_index
+   */
+  void validate_dimension_index(
+      const char* dimension_name,
+      std::size_t attempting_index) {
+    gen().schema().validate_dimension_index(dimension_name, attempting_index);
+  }
 };
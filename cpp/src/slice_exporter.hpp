@@ -0,0 +1,327 @@
+#pragma once
+
+#include "binary_format.hpp"
+#include "classic_reader.hpp"
+#include "contour_renderer.hpp"
+#include "io_scheduler.hpp"
+#include "json_writer.hpp"
+#include "parallel_for.hpp"
+#include "stats_reducer.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Writes every 2d slice of a variable (eg every (time, z) slice of the
+ * concentration) to its own file, for pre-rendering products offline
+ * rather than requesting them one at a time from the server.
+ * The slices are spread over all of the cores, each thread taking the
+ * next slice as soon as it has written the previous one, while the
+ * reads are issued a bounded number of slices ahead of the writers so
+ * that reading overlaps rendering without the whole variable ending up
+ * in memory.
+ */
+class slice_exporter {
+public:
+  enum class format { png, npy, json };
+
+  struct options {
+    std::string out_dir;
+    std::string variable = "concentration";
+    format fmt = format::png;
+    // Colour scale of the png files, fitted to each slice like
+    // /get-image or to the whole variable like /get-image?range=global
+    bool global_range = false;
+    // Threads rendering and writing the slices, 0 means one per cpu
+    std::size_t threads = 0;
+    // Threads doing netCDF reads when the file isn't a classic one
+    std::size_t io_threads = 4;
+    // Most files the I/O threads keep open
+    std::size_t max_open_files = 32;
+    // Slices read ahead of the writers, 0 means 2 per thread
+    std::size_t read_ahead = 0;
+  };
+
+  /**
+   * Exports the slices and returns how many were written
+   */
+  static std::size_t run(
+      std::shared_ptr<const dataset> data, const options& opts) {
+    slice_exporter exporter(data, opts);
+    return exporter.run();
+  }
+
+private:
+  using slab_ptr = std::shared_ptr<const hyperslab>;
+
+  const options opts;
+  std::unique_ptr<const classic_reader> classic;
+  // Only used when the data isn't a single classic format file
+  std::shared_ptr<const dataset_reader> reader;
+  std::optional<io_scheduler> io;
+
+  slice_exporter(std::shared_ptr<const dataset> data, const options& opts):
+    opts(opts),
+    classic(data->get_files().size() == 1 ?
+      classic_reader::open(data->get_files()[0].path.c_str()) : nullptr)
+  {
+    if (!classic) {
+      reader = std::make_shared<const dataset_reader>(
+        data, std::max(opts.max_open_files, opts.io_threads));
+      io.emplace(opts.io_threads);
+    }
+  }
+
+  std::size_t run() {
+    const auto dims = get_variable_dimensions(opts.variable);
+    if (dims.size() < 2) {
+      throw std::invalid_argument(
+        "Variable name '" + opts.variable + "': has " +
+        std::to_string(dims.size()) + " dimensions, slices need at least 2");
+    }
+    // Every dimension but the last two is fixed for each slice
+    const std::vector<std::pair<std::string, std::size_t>> fixed(
+      dims.begin(), dims.end() - 2);
+    const std::size_t count = std::accumulate(
+      fixed.begin(), fixed.end(), (std::size_t)1,
+      [](std::size_t n, auto& d) { return n * d.second; });
+
+    const std::size_t threads = opts.threads > 0 ?
+      opts.threads : std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t read_ahead = opts.read_ahead > 0 ?
+      opts.read_ahead : 2 * threads;
+
+    std::filesystem::create_directories(opts.out_dir);
+
+    contour_plot axes;
+    std::optional<std::pair<double, double>> range;
+    if (opts.fmt == format::png) {
+      axes = get_axes(dims[dims.size() - 2], dims.back());
+      if (opts.global_range) {
+        range = get_global_range(dims, threads);
+      }
+    }
+
+    // Slice i's read is started by whichever thread first needs slices
+    // up to i, and its result is dropped as soon as it has been written,
+    // so at most 'read_ahead' slices (plus one per thread) are held
+    std::vector<std::shared_future<slab_ptr>> slices(count);
+    std::size_t issued = 0;
+    std::mutex issue_mutex;
+    auto issue_up_to = [&](std::size_t end) {
+      std::lock_guard<std::mutex> lock(issue_mutex);
+      for (; issued < std::min(end, count); ++issued) {
+        slices[issued] = start_read(slice_indices(fixed, issued));
+      }
+    };
+
+    parallel_for(count, threads, [&](std::size_t, std::size_t i) {
+      issue_up_to(i + 1 + read_ahead);
+      slab_ptr slab = slices[i].get();
+      slices[i] = {};
+
+      auto indices = slice_indices(fixed, i);
+      std::string body;
+      if (opts.fmt == format::png) {
+        contour_plot plot = axes;
+        plot.values = slab->to_doubles();
+        plot.title = get_title(fixed, indices);
+        plot.range = range;
+        body = contour_renderer::render_png(plot);
+      }
+      else if (opts.fmt == format::npy) {
+        body = binary_format::to_npy(*slab);
+      }
+      else {
+        body = json_writer::to_json(*slab);
+      }
+      write_file(get_file_name(fixed, indices), body);
+    });
+    return count;
+  }
+
+  /**
+   * Returns the indices of the fixed dimensions for slice 'i', with the
+   * last dimension varying fastest
+   */
+  static std::vector<uint64_t> slice_indices(
+      const std::vector<std::pair<std::string, std::size_t>>& fixed,
+      std::size_t i) {
+    std::vector<uint64_t> indices(fixed.size());
+    for (std::size_t d = fixed.size(); d-- > 0;) {
+      indices[d] = i % fixed[d].second;
+      i /= fixed[d].second;
+    }
+    return indices;
+  }
+
+  /**
+   * Starts reading the slice of the variable at 'indices'.
+   * NOTE: classic files are read with a single pread per run of values
+   *   without going through netCDF, so there is little to gain from
+   *   reading ahead, the read is left for the thread that writes the
+   *   slice.
+   */
+  std::shared_future<slab_ptr> start_read(const std::vector<uint64_t>& indices) {
+    const std::string& name = opts.variable;
+    if (classic) {
+      return std::async(std::launch::deferred, [this, name, indices]() {
+        return std::make_shared<const hyperslab>(
+          classic->read_hyperslab(name.c_str(), indices));
+      }).share();
+    }
+    std::string key = name;
+    for (auto i: indices) {
+      key += "/" + std::to_string(i);
+    }
+    return io->read(reader, key, [name, indices](const dataset_reader& r) {
+      return std::make_shared<const hyperslab>(
+        r.read_hyperslab(name.c_str(), indices));
+    });
+  }
+
+  /**
+   * Reads the variable with its first dimensions fixed to 'indices',
+   * waiting for the result
+   */
+  hyperslab read(const std::string& name, const std::vector<uint64_t>& indices) {
+    if (classic) {
+      return classic->read_hyperslab(name.c_str(), indices);
+    }
+    return io->run(reader, [&](const dataset_reader& r) {
+      return r.read_hyperslab(name.c_str(), indices);
+    }).get();
+  }
+
+  std::vector<std::pair<std::string, std::size_t>> get_variable_dimensions(
+      const std::string& name) {
+    if (classic) {
+      return classic->get_variable_dimensions(name.c_str());
+    }
+    return io->run(reader, [&](const dataset_reader& r) {
+      return r.get_variable_dimensions(name.c_str());
+    }).get();
+  }
+
+  /**
+   * Returns the coordinates of a dimension, from the variable of the
+   * same name when there is one (following the CF conventions) and
+   * otherwise simply the indices along it
+   */
+  std::vector<double> get_coordinates(
+      const std::pair<std::string, std::size_t>& dim) {
+    try {
+      std::vector<double> values = read(dim.first, {}).to_doubles();
+      if (values.size() == dim.second) {
+        return values;
+      }
+    }
+    catch (std::invalid_argument&) {
+    }
+    std::vector<double> indices(dim.second);
+    std::iota(indices.begin(), indices.end(), 0.0);
+    return indices;
+  }
+
+  /**
+   * Returns a contour_plot with just the coordinates and axis labels,
+   * which are the same for every slice
+   */
+  contour_plot get_axes(
+      const std::pair<std::string, std::size_t>& y_dim,
+      const std::pair<std::string, std::size_t>& x_dim) {
+    contour_plot plot;
+    plot.x = get_coordinates(x_dim);
+    plot.y = get_coordinates(y_dim);
+    plot.xlabel = x_dim.first;
+    plot.ylabel = y_dim.first;
+    return plot;
+  }
+
+  /**
+   * Returns the minimum and maximum of the whole variable, see
+   * rest_server::get_global_range
+   */
+  std::pair<double, double> get_global_range(
+      const std::vector<std::pair<std::string, std::size_t>>& dims,
+      std::size_t threads) {
+    std::vector<stats_reducer::dimension> reduce;
+    for (auto& [name, size]: dims) {
+      reduce.push_back({name, size, true});
+    }
+    const std::string& name = opts.variable;
+    auto stats = stats_reducer::reduce(reduce, {},
+      [&](const hyperslab_query& query) {
+        if (classic) {
+          return classic->read_hyperslab(name.c_str(), query);
+        }
+        return io->run(reader, [&](const dataset_reader& r) {
+          return r.read_hyperslab(name.c_str(), query);
+        }).get();
+      },
+      threads);
+    if (!std::isfinite(stats.min[0])) {
+      // No valid values at all
+      return {0, 0};
+    }
+    return {stats.min[0], stats.max[0]};
+  }
+
+  /**
+   * Returns eg "concentration at time 3600, z 0", using the coordinate
+   * values of the fixed dimensions where they have them
+   */
+  std::string get_title(
+      const std::vector<std::pair<std::string, std::size_t>>& fixed,
+      const std::vector<uint64_t>& indices) {
+    std::string title = opts.variable;
+    for (std::size_t d = 0; d < fixed.size(); ++d) {
+      std::string value = std::to_string(indices[d]);
+      try {
+        value = json_writer::to_json(read(fixed[d].first, {indices[d]}));
+      }
+      catch (std::invalid_argument&) {
+      }
+      title += (d == 0 ? " at " : ", ") + fixed[d].first + " " + value;
+    }
+    return title;
+  }
+
+  /**
+   * Returns eg "out/concentration_time003_z0.png", with the indices
+   * padded so that the files list in order
+   */
+  std::string get_file_name(
+      const std::vector<std::pair<std::string, std::size_t>>& fixed,
+      const std::vector<uint64_t>& indices) const {
+    std::string name = opts.variable;
+    for (std::size_t d = 0; d < fixed.size(); ++d) {
+      std::string index = std::to_string(indices[d]);
+      std::size_t width = std::to_string(fixed[d].second - 1).size();
+      name += "_" + fixed[d].first +
+        std::string(width - index.size(), '0') + index;
+    }
+    const char* extension =
+      opts.fmt == format::png ? ".png" :
+      opts.fmt == format::npy ? ".npy" : ".json";
+    return (std::filesystem::path(opts.out_dir) / (name + extension)).string();
+  }
+
+  static void write_file(const std::string& path, const std::string& body) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(body.data(), body.size());
+    if (!out) {
+      throw std::runtime_error("Unable to write " + path);
+    }
+  }
+};
@@ -0,0 +1,496 @@
+#pragma once
+
+#include "hyperslab.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Computes summary statistics of a variable over any subset of its
+ * dimensions, eg the total at each time step (reducing z, y and x) or
+ * the maximum at each (y, x) over time (reducing time and z).
+ * The variable is streamed through as a sequence of hyperslabs, read on
+ * several threads at once, so only a few slabs plus the per-output
+ * accumulators are ever in memory.  Missing values (the _FillValue, or
+ * NaN) are skipped.
+ * Percentiles are approximate: they need a second pass over the data,
+ * which fills a histogram for each output value between its minimum and
+ * maximum, and the result is interpolated within a bin.
+ */
+class stats_reducer {
+public:
+  struct dimension {
+    std::string name;
+    std::size_t size;
+    // Whether the statistics are computed across this dimension, the
+    // dimensions that are not reduced make up the shape of the result
+    bool reduce;
+  };
+
+  struct result {
+    std::vector<std::string> dimensions;
+    std::vector<std::size_t> shape;
+    // One value per element of 'shape' for each of these, the
+    // statistics of a value with no valid data are NaN
+    std::vector<double> count;
+    std::vector<double> min;
+    std::vector<double> max;
+    std::vector<double> sum;
+    std::vector<double> mean;
+    // The population standard deviation
+    std::vector<double> std;
+    // For each requested percentile (0 - 100), its values
+    std::vector<std::pair<double, std::vector<double>>> percentiles;
+  };
+
+  using read_function = std::function<hyperslab(const hyperslab_query&)>;
+
+  // Slabs are made about this many elements or fewer, by fixing as many
+  // of the leading dimensions as necessary to a single index
+  static constexpr std::size_t slab_elements = 1 << 20;
+
+  // The most histogram bins we'll allocate across all output values for
+  // the percentiles, and the range of bins we'll use for each one
+  static constexpr std::size_t histogram_budget = 16 << 20;
+  static constexpr std::size_t max_bins = 1024;
+  static constexpr std::size_t min_bins = 16;
+
+  // The most bytes of accumulators (one set per output value for each
+  // thread) we'll allocate, fewer threads are used to stay within it
+  static constexpr std::size_t accumulator_budget = 256 << 20;
+
+  /**
+   * Reduces the variable with the specified dimensions, calling 'read'
+   * (from up to 'thread_count' threads at once) for each slab.
+   */
+  static result reduce(
+      const std::vector<dimension>& dims,
+      const std::vector<double>& percentiles,
+      const read_function& read,
+      std::size_t thread_count) {
+    for (double p: percentiles) {
+      if (!(p >= 0 && p <= 100)) {
+        throw std::invalid_argument("percentiles must be between 0 and 100");
+      }
+    }
+
+    layout l(dims);
+    result r;
+    for (auto& d: dims) {
+      if (!d.reduce) {
+        r.dimensions.push_back(d.name);
+        r.shape.push_back(d.size);
+      }
+    }
+
+    std::size_t bins = 0;
+    if (!percentiles.empty()) {
+      bins = std::min(max_bins, histogram_budget / std::max<std::size_t>(l.cells, 1));
+      if (bins < min_bins) {
+        throw std::invalid_argument(
+          "Too many output values (" + std::to_string(l.cells) +
+          ") to compute percentiles, reduce more dimensions");
+      }
+    }
+    const std::size_t accumulator_bytes = l.cells * moments::bytes_per_cell;
+    if (accumulator_bytes > accumulator_budget) {
+      throw std::invalid_argument(
+        "Too many output values (" + std::to_string(l.cells) +
+        ") to compute statistics, reduce more dimensions");
+    }
+    thread_count = std::max<std::size_t>(std::min({thread_count, l.slabs,
+      accumulator_budget / std::max<std::size_t>(accumulator_bytes, 1)}), 1);
+
+    // Pass 1: count, sum, min, max and the moments, each thread keeping
+    // its own accumulators which are merged at the end
+    std::vector<moments> partials;
+    partials.reserve(thread_count);
+    for (std::size_t t = 0; t < thread_count; ++t) {
+      partials.emplace_back(l.cells);
+    }
+    for_each_slab(l, read, thread_count,
+      [&](std::size_t thread, std::size_t slab, const std::vector<double>& v) {
+        add_slab(l, slab, v, partials[thread]);
+      });
+    moments& total = partials[0];
+    for (std::size_t t = 1; t < partials.size(); ++t) {
+      total.merge(partials[t], 0, l.cells, 0);
+    }
+
+    const double missing = NAN;
+    r.count = total.count;
+    r.sum = total.sum;
+    r.mean = total.mean;
+    r.min = total.min;
+    r.max = total.max;
+    r.std.resize(l.cells);
+    for (std::size_t c = 0; c < l.cells; ++c) {
+      bool any = total.count[c] > 0;
+      r.std[c] = any ? std::sqrt(total.m2[c] / total.count[c]) : missing;
+      r.mean[c] = any ? r.mean[c] : missing;
+      r.sum[c] = any ? r.sum[c] : missing;
+      r.min[c] = any ? r.min[c] : missing;
+      r.max[c] = any ? r.max[c] : missing;
+    }
+
+    // Pass 2: the histograms for the percentiles, which are shared by
+    // all of the threads since they can be large
+    if (!percentiles.empty()) {
+      histogram h(r.min, r.max, bins);
+      std::mutex h_mutex;
+      for_each_slab(l, read, thread_count,
+        [&](std::size_t, std::size_t slab, const std::vector<double>& v) {
+          std::lock_guard<std::mutex> lock(h_mutex);
+          for_each_row(l, slab, v, [&](const double* row, std::size_t cell) {
+            h.add(row, l.row_length, cell, l.row_cell_step);
+          });
+        });
+      for (double p: percentiles) {
+        r.percentiles.emplace_back(p, h.percentile(p, r.count));
+      }
+    }
+    return r;
+  }
+
+private:
+  /**
+   * How the elements of the variable map to slabs and output cells
+   */
+  struct layout {
+    std::vector<std::size_t> sizes;
+    // The stride of each dimension in the output, or 0 if it's reduced
+    std::vector<std::size_t> cell_strides;
+    std::size_t cells = 1;
+    // The number of leading dimensions fixed to a single index per slab
+    std::size_t fixed = 0;
+    std::size_t slabs = 1;
+    std::size_t row_length = 1;
+    std::size_t row_cell_step = 0;
+
+    explicit layout(const std::vector<dimension>& dims)
+      : cell_strides(dims.size(), 0)
+    {
+      for (auto& d: dims) {
+        sizes.push_back(d.size);
+      }
+      for (std::size_t d = dims.size(); d-- > 0; ) {
+        if (!dims[d].reduce) {
+          cell_strides[d] = cells;
+          cells *= dims[d].size;
+        }
+      }
+      std::size_t elements = 1;
+      for (auto s: sizes) {
+        elements *= s;
+      }
+      while (fixed + 1 < sizes.size() && elements > slab_elements) {
+        elements /= std::max<std::size_t>(sizes[fixed], 1);
+        slabs *= sizes[fixed];
+        ++fixed;
+      }
+      if (elements == 0) {
+        slabs = 0;
+      }
+      if (!sizes.empty()) {
+        row_length = sizes.back();
+        row_cell_step = cell_strides.back();
+      }
+    }
+
+    /**
+     * The selection of the variable for slab 's'
+     */
+    hyperslab_query query(std::size_t s) const {
+      hyperslab_query q;
+      q.start.assign(sizes.size(), 0);
+      q.count = sizes;
+      for (std::size_t d = fixed; d-- > 0; ) {
+        q.start[d] = s % sizes[d];
+        q.count[d] = 1;
+        s /= sizes[d];
+      }
+      return q;
+    }
+  };
+
+  /**
+   * Calls 'fn(row, cell)' for each run of 'row_length' values along the
+   * last dimension of the slab, with the output cell of its first value.
+   */
+  template <typename F>
+  static void for_each_row(
+      const layout& l, std::size_t slab,
+      const std::vector<double>& values, F&& fn) {
+    const std::size_t dims = l.sizes.size();
+    hyperslab_query q = l.query(slab);
+    std::size_t base = 0;
+    for (std::size_t d = 0; d < l.fixed; ++d) {
+      base += q.start[d] * l.cell_strides[d];
+    }
+    if (dims == 0) {
+      fn(values.data(), 0);
+      return;
+    }
+    // Odometer over the dimensions between the fixed ones and the last
+    std::vector<std::size_t> index(dims, 0);
+    for (std::size_t i = 0; i < values.size(); i += l.row_length) {
+      std::size_t cell = base;
+      for (std::size_t d = l.fixed; d + 1 < dims; ++d) {
+        cell += index[d] * l.cell_strides[d];
+      }
+      fn(values.data() + i, cell);
+      for (std::size_t d = dims - 1; d-- > l.fixed; ) {
+        if (++index[d] < l.sizes[d]) {
+          break;
+        }
+        index[d] = 0;
+      }
+    }
+  }
+
+  /**
+   * Reads every slab, spreading them over 'thread_count' threads, and
+   * calls 'fn(thread, slab, values)' with the slab's values as doubles.
+   */
+  template <typename F>
+  static void for_each_slab(
+      const layout& l, const read_function& read,
+      std::size_t thread_count, F&& fn) {
+    parallel_for(l.slabs, thread_count, [&](std::size_t thread, std::size_t s) {
+      fn(thread, s, read(l.query(s)).to_doubles());
+    });
+  }
+
+  /**
+   * Count, sum, min, max, mean and sum of squared deviations (m2) for
+   * each output cell.  Counts are kept as doubles so that all of the
+   * kernels work on one type.
+   */
+  struct moments {
+    std::vector<double> count, sum, min, max, mean, m2;
+    static constexpr std::size_t bytes_per_cell = 6 * sizeof(double);
+
+    explicit moments(std::size_t cells)
+      : count(cells, 0), sum(cells, 0),
+        min(cells, INFINITY), max(cells, -INFINITY),
+        mean(cells, 0), m2(cells, 0) {}
+
+    /**
+     * Combines the moments of two sets of values for the cells in
+     * [begin, end), where cell c is at c - offset in 'o'.  See Chan et
+     * al's parallel variance algorithm
+     * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Parallel_algorithm
+     */
+    void merge(
+        const moments& o, std::size_t begin, std::size_t end,
+        std::size_t offset) {
+      for (std::size_t c = begin; c < end; ++c) {
+        const std::size_t i = c - offset;
+        double n = count[c] + o.count[i];
+        double delta = o.mean[i] - mean[c];
+        double f = n > 0 ? o.count[i] / n : 0;
+        mean[c] += delta * f;
+        m2[c] += o.m2[i] + delta * delta * count[c] * f;
+        count[c] = n;
+        sum[c] += o.sum[i];
+        min[c] = o.min[i] < min[c] ? o.min[i] : min[c];
+        max[c] = o.max[i] > max[c] ? o.max[i] : max[c];
+      }
+    }
+  };
+
+  /**
+   * Adds one slab to 'acc'.  The slab's own moments are computed in two
+   * passes over its values (first the sums, then the squared deviations
+   * from the slab's mean) which is both accurate and easy to vectorize,
+   * then merged into the running totals.
+   */
+  static void add_slab(
+      const layout& l, std::size_t slab,
+      const std::vector<double>& values, moments& acc) {
+    // The slab only touches a contiguous range of cells, which is the
+    // only part of its moments we need to initialize and merge
+    hyperslab_query q = l.query(slab);
+    std::size_t begin = 0, end = 1;
+    for (std::size_t d = 0; d < l.sizes.size(); ++d) {
+      begin += q.start[d] * l.cell_strides[d];
+      end += (q.count[d] - 1) * l.cell_strides[d];
+    }
+    end += begin;
+
+    // Indexed from 'begin' rather than 0
+    moments m(end - begin);
+    for_each_row(l, slab, values, [&](const double* row, std::size_t cell) {
+      cell -= begin;
+      if (l.row_cell_step == 1) {
+        kernels::add(row, l.row_length,
+          &m.count[cell], &m.sum[cell], &m.min[cell], &m.max[cell]);
+      }
+      else {
+        kernels::add_reduced(row, l.row_length,
+          m.count[cell], m.sum[cell], m.min[cell], m.max[cell]);
+      }
+    });
+    for (std::size_t c = 0; c < m.mean.size(); ++c) {
+      m.mean[c] = m.count[c] > 0 ? m.sum[c] / m.count[c] : 0;
+    }
+    for_each_row(l, slab, values, [&](const double* row, std::size_t cell) {
+      cell -= begin;
+      if (l.row_cell_step == 1) {
+        kernels::add_squares(row, l.row_length, &m.mean[cell], &m.m2[cell]);
+      }
+      else {
+        kernels::add_squares_reduced(
+          row, l.row_length, m.mean[cell], m.m2[cell]);
+      }
+    });
+    acc.merge(m, begin, end, begin);
+  }
+
+  /**
+   * The inner loops, which are all branch free so that the compiler can
+   * vectorize them.  A NaN (missing) value compares false to everything,
+   * which is what the min/max selects rely on, and is masked out of the
+   * sums.  The "reduced" versions fold a whole row into a single cell:
+   * they accumulate into 'lanes' independent partial results so that
+   * they vectorize without -ffast-math (which would be needed to let the
+   * compiler reorder the additions itself).
+   */
+  struct kernels {
+    static constexpr std::size_t lanes = 8;
+
+    static void add(
+        const double* x, std::size_t n,
+        double* count, double* sum, double* min, double* max) {
+      // NOTE: these are separate loops because GCC gives up on
+      //   vectorizing ("control flow in loop") when the count and sum
+      //   selects share a loop, while each loop on its own vectorizes
+      for (std::size_t j = 0; j < n; ++j) {
+        count[j] += x[j] == x[j] ? 1.0 : 0.0;
+      }
+      for (std::size_t j = 0; j < n; ++j) {
+        sum[j] += x[j] == x[j] ? x[j] : 0.0;
+      }
+      for (std::size_t j = 0; j < n; ++j) {
+        double v = x[j];
+        double lo = min[j];
+        double hi = max[j];
+        min[j] = v < lo ? v : lo;
+        max[j] = v > hi ? v : hi;
+      }
+    }
+
+    static void add_squares(
+        const double* x, std::size_t n, const double* mean, double* m2) {
+      for (std::size_t j = 0; j < n; ++j) {
+        // The result is NaN exactly when the value is missing.  Doing
+        // all of the arithmetic first and only selecting at the end is
+        // the form GCC will vectorize without -fno-trapping-math.
+        double d = x[j] - mean[j];
+        double total = m2[j] + d * d;
+        m2[j] = total == total ? total : m2[j];
+      }
+    }
+
+    static void add_reduced(
+        const double* x, std::size_t n,
+        double& count, double& sum, double& min, double& max) {
+      double c[lanes] = {}, s[lanes] = {};
+      double lo[lanes], hi[lanes];
+      std::fill(lo, lo + lanes, INFINITY);
+      std::fill(hi, hi + lanes, -INFINITY);
+      std::size_t j = 0;
+      for (; j + lanes <= n; j += lanes) {
+        add(x + j, lanes, c, s, lo, hi);
+      }
+      add(x + j, n - j, c, s, lo, hi);
+      for (std::size_t k = 0; k < lanes; ++k) {
+        count += c[k];
+        sum += s[k];
+        min = lo[k] < min ? lo[k] : min;
+        max = hi[k] > max ? hi[k] : max;
+      }
+    }
+
+    static void add_squares_reduced(
+        const double* x, std::size_t n, double mean, double& m2) {
+      double means[lanes], m[lanes] = {};
+      std::fill(means, means + lanes, mean);
+      std::size_t j = 0;
+      for (; j + lanes <= n; j += lanes) {
+        add_squares(x + j, lanes, means, m);
+      }
+      add_squares(x + j, n - j, means, m);
+      for (std::size_t k = 0; k < lanes; ++k) {
+        m2 += m[k];
+      }
+    }
+  };
+
+  /**
+   * Fixed width bins spanning [min, max] of each output cell
+   */
+  struct histogram {
+    const std::vector<double>& min;
+    const std::vector<double>& max;
+    std::size_t bins;
+    std::vector<std::uint32_t> counts;
+    std::vector<double> scale;
+
+    histogram(
+        const std::vector<double>& min, const std::vector<double>& max,
+        std::size_t bins)
+      : min(min), max(max), bins(bins),
+        counts(min.size() * bins, 0), scale(min.size(), 0)
+    {
+      for (std::size_t c = 0; c < min.size(); ++c) {
+        double width = max[c] - min[c];
+        scale[c] = width > 0 ? bins / width : 0;
+      }
+    }
+
+    void add(const double* x, std::size_t n, std::size_t cell, std::size_t step) {
+      for (std::size_t j = 0; j < n; ++j, cell += step) {
+        double v = x[j];
+        if (v == v) {
+          double position = std::max((v - min[cell]) * scale[cell], 0.0);
+          std::size_t b = std::min<std::size_t>(
+            (std::size_t)position, bins - 1);
+          ++counts[cell * bins + b];
+        }
+      }
+    }
+
+    std::vector<double> percentile(
+        double p, const std::vector<double>& count) const {
+      std::vector<double> result(min.size(), NAN);
+      for (std::size_t c = 0; c < min.size(); ++c) {
+        if (count[c] == 0) {
+          continue;
+        }
+        if (scale[c] == 0) {
+          result[c] = min[c];
+          continue;
+        }
+        const std::uint32_t* h = counts.data() + c * bins;
+        double target = p / 100 * count[c];
+        double seen = 0;
+        std::size_t b = 0;
+        while (b + 1 < bins && seen + h[b] < target) {
+          seen += h[b++];
+        }
+        double within = h[b] > 0 ? (target - seen) / h[b] : 0;
+        double v = min[c] + (b + std::clamp(within, 0.0, 1.0)) / scale[c];
+        result[c] = std::clamp(v, min[c], max[c]);
+      }
+      return result;
+    }
+  };
+};
@@ -0,0 +1,78 @@
+#include "contour_renderer.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+bool is_scale(const std::vector<double>& ticks) {
+  if (ticks.size() < 2 ||
+      ticks.size() > (std::size_t)contour_renderer::max_ticks) {
+    return false;
+  }
+  for (std::size_t i = 1; i < ticks.size(); ++i) {
+    if (!std::isfinite(ticks[i]) || !(ticks[i] > ticks[i - 1])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+contour_plot flat_plot(double a, double b) {
+  contour_plot plot;
+  plot.x = {0, 1};
+  plot.y = {0, 1};
+  plot.values = {a, b, a, b};
+  return plot;
+}
+
+}
+
+/**
+ * nice_ticks used to loop forever on these, hanging the thread rendering
+ * the image
+ */
+int main() {
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const double inf = std::numeric_limits<double>::infinity();
+
+  check(is_scale(contour_renderer::nice_ticks(0, 0, 10)), "all zero");
+  check(is_scale(contour_renderer::nice_ticks(3.5, 3.5, 10)), "flat");
+  check(is_scale(contour_renderer::nice_ticks(-2, -2, 10)), "flat negative");
+  check(is_scale(contour_renderer::nice_ticks(
+    0.1, std::nextafter(0.1, 1.0), 10)), "1 ULP apart");
+  check(is_scale(contour_renderer::nice_ticks(
+    1e300, std::nextafter(1e300, inf), 10)), "1 ULP apart, large");
+  check(is_scale(contour_renderer::nice_ticks(inf, -inf, 10)), "all missing");
+  check(is_scale(contour_renderer::nice_ticks(nan, nan, 10)), "NaN range");
+  check(is_scale(contour_renderer::nice_ticks(-1e308, 1e308, 10)),
+    "range overflows");
+
+  auto ticks = contour_renderer::nice_ticks(0, 1, 10);
+  check(is_scale(ticks) && ticks.front() == 0 && ticks.back() == 1,
+    "ordinary range");
+
+  // The whole render, as /get-image does it
+  contour_renderer::render(flat_plot(0.1, std::nextafter(0.1, 1.0)));
+  contour_renderer::render(flat_plot(nan, nan));
+  contour_plot ranged = flat_plot(1, 2);
+  ranged.range = std::make_pair(inf, -inf);
+  contour_renderer::render(ranged);
+
+  if (failures == 0) {
+    std::cout << "OK" << std::endl;
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,67 @@
+#include "http_cache.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+}
+
+int main() {
+  const std::string etag = "\"1234-5678-abcdef\"";
+  const std::string gzip_etag = "\"1234-5678-abcdef-gzip\"";
+  const std::string deflate_etag = "\"1234-5678-abcdef-deflate\"";
+
+  // If-None-Match
+  check(http_cache::matching_etag("", etag).empty(), "no If-None-Match");
+  check(http_cache::matching_etag(etag, etag) == etag, "the plain tag");
+  check(http_cache::matching_etag(gzip_etag, etag) == gzip_etag,
+    "the gzip tag");
+  check(http_cache::matching_etag(deflate_etag, etag) == deflate_etag,
+    "the deflate tag");
+  check(http_cache::matching_etag("W/" + etag, etag) == etag,
+    "a weak tag");
+  check(http_cache::matching_etag(
+    "\"other\", W/\"another\",  " + gzip_etag + " ", etag) == gzip_etag,
+    "a list with the tag last");
+  check(http_cache::matching_etag("\"other\", W/\"another\"", etag).empty(),
+    "a list without the tag");
+  check(http_cache::matching_etag("*", etag).empty(),
+    "* isn't a match");
+  check(http_cache::matching_etag("*, " + etag, etag) == etag,
+    "a list with * and the tag");
+  check(http_cache::matching_etag("\"1234-5678-abcdef-br\"", etag).empty(),
+    "an encoding this server doesn't send");
+  check(http_cache::matching_etag("1234-5678-abcdef", etag).empty(),
+    "an unquoted tag");
+
+  // Accept-Encoding
+  check(http_cache::choose_encoding("").empty(), "no Accept-Encoding");
+  check(http_cache::choose_encoding("gzip, deflate, br") == "gzip",
+    "gzip is preferred");
+  check(http_cache::choose_encoding("deflate, gzip") == "gzip",
+    "gzip is preferred whatever the order");
+  check(http_cache::choose_encoding("br, deflate") == "deflate",
+    "deflate");
+  check(http_cache::choose_encoding("gzip;q=0, deflate;q=0.5") == "deflate",
+    "q=0 refuses an encoding");
+  check(http_cache::choose_encoding("gzip;q=0").empty(),
+    "nothing acceptable");
+  check(http_cache::choose_encoding("identity, br").empty(),
+    "neither encoding");
+
+  if (failures == 0) {
+    std::cout << "OK" << std::endl;
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
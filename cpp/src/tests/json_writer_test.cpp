@@ -0,0 +1,129 @@
+#include "json_writer.hpp"
+#include "read_netcdf.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+template <typename T>
+hyperslab make_slab(
+    nc_type type, const std::vector<T>& values,
+    const std::vector<std::size_t>& shape) {
+  hyperslab slab;
+  slab.type = type;
+  slab.element_size = sizeof(T);
+  slab.shape = shape;
+  slab.data.assign((const char*)values.data(), values.size() * sizeof(T));
+  return slab;
+}
+
+template <typename T>
+void set_fill_value(hyperslab& slab, T fill) {
+  slab.packing.fill_value.assign((const char*)&fill, sizeof(T));
+}
+
+// json_writer must write exactly what the json tree's dump() does
+void check_same(const hyperslab& slab, const std::string& what) {
+  const std::string expected = read_netcdf::to_json(slab).dump();
+  const std::string actual = json_writer::to_json(slab);
+  if (expected != actual) {
+    std::cerr << "  tree:   " << expected.substr(0, 200) << std::endl;
+    std::cerr << "  writer: " << actual.substr(0, 200) << std::endl;
+  }
+  check(expected == actual, what);
+}
+
+}
+
+int main() {
+  std::mt19937_64 rng(12345);
+
+  // Every numeric type, with its extremes and random values, unpacked
+  // and packed, with and without a fill value, in several shapes
+  for (nc_type type: {NC_BYTE, NC_UBYTE, NC_SHORT, NC_USHORT, NC_INT,
+      NC_UINT, NC_INT64, NC_UINT64, NC_FLOAT, NC_DOUBLE}) {
+    visit_nc_type(type, [&](auto tag) {
+      using T = typename decltype(tag)::type;
+      using limits = std::numeric_limits<T>;
+      const std::string name = nc_type_name(type);
+
+      std::vector<T> values = {limits::lowest(), limits::max(), T(0), T(1)};
+      if constexpr (std::is_floating_point_v<T>) {
+        values.insert(values.end(), {
+          limits::min(), limits::denorm_min(), T(-0.0), T(0.1), T(1e6),
+          T(1234567), T(1e7), T(16777216), T(1e15), T(1e16), T(1e17),
+          T(-999999.9), limits::quiet_NaN(), limits::infinity(),
+          -limits::infinity()});
+        std::uniform_real_distribution<double> exponent(
+          limits::min_exponent10, limits::max_exponent10);
+        while (values.size() < 4096) {
+          values.push_back(T((rng() % 2 ? 1 : -1) *
+            std::pow(10.0, exponent(rng))));
+        }
+      }
+      else {
+        while (values.size() < 4096) {
+          T v;
+          std::uint64_t bits = rng();
+          memcpy(&v, &bits, sizeof(T));
+          values.push_back(v);
+        }
+      }
+
+      for (auto shape: std::vector<std::vector<std::size_t>>{
+          {4096}, {16, 256}, {4, 4, 16, 16}, {1, 4096}}) {
+        hyperslab slab = make_slab(type, values, shape);
+        check_same(slab, name + " values");
+
+        set_fill_value(slab, values[3]);
+        check_same(slab, name + " with a fill value");
+
+        slab.packing.packed = true;
+        slab.packing.scale_factor = 0.01;
+        slab.packing.add_offset = 273.15;
+        check_same(slab, name + " packed with a fill value");
+
+        slab.packing.fill_value.clear();
+        check_same(slab, name + " packed");
+      }
+
+      // A single value, and a selection with nothing in it
+      std::vector<T> one = {values[1]};
+      check_same(make_slab(type, one, {}), name + " scalar");
+      hyperslab scalar_fill = make_slab(type, one, {});
+      set_fill_value(scalar_fill, values[1]);
+      check_same(scalar_fill, name + " scalar fill value");
+      check_same(make_slab(type, std::vector<T>(), {3, 0}), name + " empty");
+    });
+  }
+
+  // Floats print as the double of their shortest form, in the double's
+  // notation
+  auto floats = [](std::vector<float> values) {
+    return json_writer::to_json(
+      make_slab(NC_FLOAT, values, {values.size()}));
+  };
+  check(floats({0.1f, 1234567.0f, 1e7f, NAN}) ==
+    "[0.1,1234567.0,10000000.0,null]", "float notation");
+
+  if (failures == 0) {
+    std::cout << "OK" << std::endl;
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
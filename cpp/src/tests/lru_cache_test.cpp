@@ -0,0 +1,156 @@
+#include "lru_cache.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+std::shared_ptr<const std::string> value(const std::string& v) {
+  return std::make_shared<const std::string>(v);
+}
+
+bool cached(lru_cache<std::string>& cache, const std::string& key) {
+  return cache.get(key) != nullptr;
+}
+
+// Like rest_server's, hashes keys "N@key" without the generation so that
+// renaming them between generations keeps them in the same shard
+std::size_t unversioned_hash(const std::string& key) {
+  std::string_view k(key);
+  return std::hash<std::string_view>()(k.substr(k.find('@') + 1));
+}
+
+// Renames "1@key" to "2@key", dropping keys starting with "drop"
+std::string next_generation(const std::string& key) {
+  if (key.compare(0, 2, "1@") != 0 || key.compare(2, 4, "drop") == 0) {
+    return "";
+  }
+  return "2@" + key.substr(2);
+}
+
+}
+
+int main() {
+  // A budget of 0 caches nothing
+  {
+    lru_cache<std::string> cache(0);
+    cache.put("a", value("a"), 1);
+    check(!cached(cache, "a"), "no budget");
+  }
+
+  // The budget is shared by all the shards, and the least recently used
+  // entries of the whole cache are evicted to stay within it
+  {
+    lru_cache<std::string> cache(1000, 16);
+    for (int i = 0; i < 10; ++i) {
+      cache.put("k" + std::to_string(i), value("v"), 150);
+    }
+    auto stats = cache.get_stats();
+    check(stats.bytes == 900 && stats.entries == 6, "within the budget");
+    check(stats.evictions == 4, "evictions counted");
+    bool oldest_gone = true, newest_kept = true;
+    for (int i = 0; i < 10; ++i) {
+      bool present = cached(cache, "k" + std::to_string(i));
+      oldest_gone = oldest_gone && (i >= 4 || !present);
+      newest_kept = newest_kept && (i < 4 || present);
+    }
+    check(oldest_gone && newest_kept, "least recently used evicted first");
+  }
+
+  // A hit makes an entry the most recently used
+  {
+    lru_cache<std::string> cache(1000, 16);
+    cache.put("a", value("a"), 300);
+    cache.put("b", value("b"), 300);
+    cache.put("c", value("c"), 300);
+    cache.get("a");
+    cache.put("d", value("d"), 300);
+    check(cached(cache, "a") && !cached(cache, "b") &&
+      cached(cache, "c") && cached(cache, "d"), "hits refresh entries");
+  }
+
+  // Anything up to the whole budget is cached, whatever the shard count,
+  // and larger values are counted as rejected
+  {
+    lru_cache<std::string> cache(1000, 16);
+    cache.put("small", value("s"), 100);
+    cache.put("large", value("l"), 600);
+    check(cached(cache, "large"), "a value larger than one shard's share");
+    cache.put("huge", value("h"), 1001);
+    check(!cached(cache, "huge") && cache.get_stats().rejected == 1,
+      "a value larger than the budget");
+    cache.put("large", value("L"), 200);
+    check(*cache.get("large") == "L" && cache.get_stats().bytes == 300,
+      "replacing a value");
+  }
+
+  // Hits and misses
+  {
+    lru_cache<std::string> cache(1000);
+    cache.put("a", value("a"), 1);
+    cache.get("a");
+    cache.get("b");
+    int loads = 0;
+    cache.get_or_load("c", [&]() { ++loads; return std::string("c"); },
+      [](const std::string&) { return 1; });
+    cache.get_or_load("c", [&]() { ++loads; return std::string("c"); },
+      [](const std::string&) { return 1; });
+    auto stats = cache.get_stats();
+    check(stats.hits == 2 && stats.misses == 2 && loads == 1,
+      "hits and misses");
+  }
+
+  // rekey keeps the values under their new keys, in place with a hash
+  // that ignores what changes and moved between shards without one
+  for (bool in_place: {true, false}) {
+    lru_cache<std::string> cache(10000, 16, in_place ?
+      lru_cache<std::string>::hash_function(unversioned_hash) :
+      lru_cache<std::string>::hash_function(std::hash<std::string>()));
+    for (int i = 0; i < 50; ++i) {
+      cache.put("1@k" + std::to_string(i), value(std::to_string(i)), 10);
+    }
+    cache.put("1@drop", value("x"), 10);
+    cache.put("0@old", value("x"), 10);
+    const std::size_t kept = cache.rekey(next_generation);
+    bool renamed = true;
+    for (int i = 0; i < 50; ++i) {
+      auto v = cache.get("2@k" + std::to_string(i));
+      renamed = renamed && v && *v == std::to_string(i) &&
+        !cached(cache, "1@k" + std::to_string(i));
+    }
+    auto stats = cache.get_stats();
+    check(kept == 50 && renamed, in_place ?
+      "rekey in place" : "rekey across shards");
+    check(!cached(cache, "2@drop") && !cached(cache, "0@old") &&
+      stats.entries == 50 && stats.bytes == 500, in_place ?
+      "rekey drops entries in place" : "rekey drops entries across shards");
+  }
+
+  // Two entries renamed to the same key keep the more recently used
+  {
+    lru_cache<std::string> cache(1000, 1);
+    cache.put("a", value("older"), 10);
+    cache.put("b", value("newer"), 10);
+    cache.rekey([](const std::string&) { return std::string("c"); });
+    auto c = cache.get("c");
+    check(c && *c == "newer" && cache.get_stats().bytes == 10,
+      "rekey onto the same key");
+  }
+
+  if (failures == 0) {
+    std::cout << "OK" << std::endl;
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,130 @@
+#include "resampler.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+template <typename F>
+bool throws(F&& f) {
+  try {
+    f();
+    return false;
+  }
+  catch (std::invalid_argument&) {
+    return true;
+  }
+}
+
+std::vector<double> ramp(std::size_t ny, std::size_t nx) {
+  std::vector<double> values(ny * nx);
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    values[i] = (i / nx) * 10.0 + (i % nx);
+  }
+  return values;
+}
+
+bool same(const std::vector<double>& a, const std::vector<double>& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    if (!(a[i] == b[i] || (std::isnan(a[i]) && std::isnan(b[i])))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}
+
+int main() {
+  using method = resampler::method;
+  const auto values = ramp(6, 8);
+
+  // Sizes that can't be resampled
+  check(throws([&]() {
+    resampler::resample(values, 6, 8, 0, 4, method::area);
+  }), "an empty output");
+  check(throws([&]() {
+    resampler::resample(values, 6, 8, 4, resampler::max_size + 1, method::area);
+  }), "an output larger than max_size");
+  check(throws([&]() {
+    resampler::resample(values, 6, 7, 4, 4, method::area);
+  }), "values that don't match the shape");
+  check(throws([&]() {
+    resampler::resample(std::vector<double>(), 0, 0, 4, 4, method::bilinear);
+  }), "no values");
+  hyperslab three_d;
+  three_d.type = NC_DOUBLE;
+  three_d.element_size = sizeof(double);
+  three_d.shape = {1, 6, 8};
+  three_d.data.assign((const char*)values.data(), values.size() * sizeof(double));
+  check(throws([&]() {
+    resampler::resample(three_d, 4, 4, method::area);
+  }), "a slice that isn't 2d");
+  check(resampler::resample(values, 6, 8, 1, resampler::max_size,
+    method::bilinear).size() == resampler::max_size, "max_size is allowed");
+
+  // The same size leaves the values alone
+  check(same(resampler::resample(values, 6, 8, 6, 8, method::area), values),
+    "area at the same size");
+  check(same(resampler::resample(values, 6, 8, 6, 8, method::bilinear), values),
+    "bilinear at the same size");
+
+  // Halving averages each 2x2 block
+  auto halved = resampler::resample(values, 6, 8, 3, 4, method::area);
+  check(halved.size() == 12 && halved[0] == (0 + 1 + 10 + 11) / 4.0 &&
+    halved[11] == (46 + 47 + 56 + 57) / 4.0, "area halving");
+
+  // Missing values are ignored by area, and missing only when all are
+  std::vector<double> holes = {NAN, 2, NAN, NAN, 4, 6, NAN, NAN};
+  auto filled = resampler::resample(holes, 2, 4, 1, 2, method::area);
+  check(filled[0] == (2 + 4 + 6) / 3.0 && std::isnan(filled[1]),
+    "area with missing values");
+  auto interpolated = resampler::resample(holes, 2, 4, 4, 8, method::bilinear);
+  check(std::isnan(interpolated[0]), "bilinear next to a missing value");
+
+  // Growing stays within the values, and reaches the corners
+  auto grown = resampler::resample(values, 6, 8, 60, 80, method::bilinear);
+  bool within = true;
+  for (double v: grown) {
+    within = within && v >= values.front() && v <= values.back();
+  }
+  check(within && grown.front() == values.front() &&
+    grown.back() == values.back(), "bilinear growing");
+  auto single = resampler::resample(std::vector<double>{7}, 1, 1, 5, 3,
+    method::bilinear);
+  check(same(single, std::vector<double>(15, 7)), "growing a single value");
+
+  // Threads don't change the result
+  const auto big = ramp(300, 500);
+  for (method m: {method::area, method::bilinear}) {
+    check(same(resampler::resample(big, 300, 500, 77, 123, m, 1),
+      resampler::resample(big, 300, 500, 77, 123, m, 8)), "threads");
+  }
+
+  // Coordinates at the centres of the output cells
+  auto coords = resampler::resample_coordinates({0, 1, 2, 3}, 2);
+  check(coords.size() == 2 && coords[0] == 0.5 && coords[1] == 2.5,
+    "coordinates");
+  check(resampler::resample_coordinates({5}, 3) ==
+    std::vector<double>({5, 5, 5}), "a single coordinate");
+
+  if (failures == 0) {
+    std::cout << "OK" << std::endl;
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,179 @@
+#include "transport_encoding.hpp"
+
+#include <zlib.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+bool parse_fails(const std::string& encoding) {
+  try {
+    transport_encoding::parse(encoding);
+    return false;
+  }
+  catch (std::invalid_argument&) {
+    return true;
+  }
+}
+
+hyperslab doubles(const std::vector<double>& values) {
+  hyperslab slab;
+  slab.type = NC_DOUBLE;
+  slab.element_size = sizeof(double);
+  slab.shape = {values.size()};
+  slab.data.assign((const char*)values.data(), values.size() * sizeof(double));
+  return slab;
+}
+
+std::string header(
+    const std::vector<std::pair<std::string, std::string>>& headers,
+    const std::string& name) {
+  for (auto& h: headers) {
+    if (h.first == name) {
+      return h.second;
+    }
+  }
+  return "";
+}
+
+// The values a client decodes from a q8 / q16 response
+template <typename Q>
+std::vector<double> dequantize(
+    const hyperslab& slab,
+    const std::vector<std::pair<std::string, std::string>>& headers) {
+  const double scale = std::stod(header(headers, "X-Scale"));
+  const double offset = std::stod(header(headers, "X-Offset"));
+  const unsigned long missing = std::stoul(header(headers, "X-Missing"));
+  std::vector<double> result;
+  const Q* q = (const Q*)slab.data.data();
+  for (std::size_t i = 0; i < slab.element_count(); ++i) {
+    result.push_back(q[i] == missing ? NAN : q[i] * scale + offset);
+  }
+  return result;
+}
+
+}
+
+int main() {
+  using spec = transport_encoding::spec;
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  const double inf = std::numeric_limits<double>::infinity();
+
+  // parse
+  check(transport_encoding::parse("").empty(), "empty encoding");
+  auto parsed = transport_encoding::parse("q16,shuffle-deflate");
+  check(parsed.transform == spec::values::q16 && parsed.shuffle_deflate,
+    "q16,shuffle-deflate");
+  check(transport_encoding::parse("f32").transform == spec::values::f32,
+    "f32");
+  check(parse_fails("q8,q16"), "two value transforms");
+  check(parse_fails("q32"), "unknown encoding");
+  check(transport_encoding::describe(parsed) == "shuffle-deflate,q16",
+    "describe in the order to undo");
+
+  // f32
+  {
+    std::vector<std::pair<std::string, std::string>> headers;
+    spec f32;
+    f32.transform = spec::values::f32;
+    auto slab = transport_encoding::encode_values(
+      doubles({0.5, nan, -2}), f32, headers);
+    const float* f = (const float*)slab.data.data();
+    check(slab.type == NC_FLOAT && f[0] == 0.5f && std::isnan(f[1]) &&
+      f[2] == -2.0f, "f32 values");
+  }
+
+  // q8 / q16 round trip within half a step
+  {
+    std::vector<double> values;
+    for (int i = 0; i < 1000; ++i) {
+      values.push_back(std::sin(i * 0.01) * 100);
+    }
+    values.push_back(nan);
+    std::vector<std::pair<std::string, std::string>> headers;
+    spec q16;
+    q16.transform = spec::values::q16;
+    auto slab = transport_encoding::encode_values(doubles(values), q16, headers);
+    auto decoded = dequantize<unsigned short>(slab, headers);
+    const double step = std::stod(header(headers, "X-Scale"));
+    bool close = std::isnan(decoded.back());
+    for (std::size_t i = 0; i + 1 < values.size(); ++i) {
+      close = close && std::fabs(decoded[i] - values[i]) <= step / 2 + 1e-9;
+    }
+    check(slab.type == NC_USHORT && close, "q16 round trip");
+  }
+
+  // Infinite values are missing, and don't spoil the scale of the others
+  {
+    std::vector<std::pair<std::string, std::string>> headers;
+    spec q8;
+    q8.transform = spec::values::q8;
+    auto slab = transport_encoding::encode_values(
+      doubles({1, inf, -inf, nan, 2}), q8, headers);
+    auto decoded = dequantize<unsigned char>(slab, headers);
+    check(std::isfinite(std::stod(header(headers, "X-Scale"))),
+      "q8 scale with infinities");
+    check(std::fabs(decoded[0] - 1) < 1e-12 && std::fabs(decoded[4] - 2) < 1e-12,
+      "q8 ends of the range");
+    check(std::isnan(decoded[1]) && std::isnan(decoded[2]) &&
+      std::isnan(decoded[3]), "q8 infinities and NaN are missing");
+  }
+
+  // A range too wide to subtract, and a range with no finite values
+  {
+    std::vector<std::pair<std::string, std::string>> headers;
+    spec q16;
+    q16.transform = spec::values::q16;
+    auto slab = transport_encoding::encode_values(
+      doubles({-1e308, 0, 1e308}), q16, headers);
+    auto decoded = dequantize<unsigned short>(slab, headers);
+    check(std::isfinite(std::stod(header(headers, "X-Scale"))) &&
+      decoded[0] < 0 && decoded[2] > 0, "q16 overflowing range");
+
+    headers.clear();
+    slab = transport_encoding::encode_values(doubles({inf, nan}), q16, headers);
+    decoded = dequantize<unsigned short>(slab, headers);
+    check(std::isnan(decoded[0]) && std::isnan(decoded[1]),
+      "q16 without finite values");
+  }
+
+  // shuffle-deflate inflates and unshuffles back to the bytes
+  {
+    std::vector<double> values = {1.5, -2.25, 0, 1e300, 7};
+    hyperslab slab = doubles(values);
+    std::string body = transport_encoding::shuffle_deflate(slab);
+    std::string shuffled(slab.data.size(), '\0');
+    uLongf length = shuffled.size();
+    check(uncompress((Bytef*)shuffled.data(), &length,
+      (const Bytef*)body.data(), body.size()) == Z_OK &&
+      length == shuffled.size(), "shuffle-deflate inflates");
+    std::string bytes(slab.data.size(), '\0');
+    for (std::size_t i = 0; i < values.size(); ++i) {
+      for (std::size_t b = 0; b < sizeof(double); ++b) {
+        bytes[i * sizeof(double) + b] = shuffled[b * values.size() + i];
+      }
+    }
+    check(bytes == slab.data, "shuffle-deflate unshuffles");
+  }
+
+  if (failures == 0) {
+    std::cout << "OK" << std::endl;
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
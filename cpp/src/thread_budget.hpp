@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+/**
+ * A fixed number of threads shared by every request that spreads its own
+ * work over several (see parallel_for), so that however many requests
+ * are doing so at once there are never more than that many threads
+ * besides the requests' own.  A request only takes the threads that are
+ * free when it starts rather than waiting for more, so it always has at
+ * least its own thread and runs on every cpu when nothing else is.
+ */
+class thread_budget {
+public:
+  /**
+   * The threads a request took, which it gives back when it's destroyed
+   */
+  class lease {
+  public:
+    lease(lease&& other): budget(other.budget), extra(other.extra) {
+      other.extra = 0;
+    }
+    lease(const lease&) = delete;
+    lease& operator=(const lease&) = delete;
+
+    ~lease() {
+      if (extra > 0) {
+        budget->free += extra;
+      }
+    }
+
+    /**
+     * The number of threads to use, including the request's own
+     */
+    std::size_t count() const {
+      return extra + 1;
+    }
+
+  private:
+    friend class thread_budget;
+    lease(thread_budget* budget, std::size_t extra):
+      budget(budget), extra(extra) {}
+
+    thread_budget* budget;
+    std::size_t extra;
+  };
+
+  // One per cpu by default
+  explicit thread_budget(
+      std::size_t threads = std::max(1u, std::thread::hardware_concurrency())):
+    free(threads) {}
+
+  /**
+   * Takes up to 'wanted' threads (counting the caller's own) of those
+   * that are free
+   */
+  lease acquire(std::size_t wanted) {
+    const std::size_t extra_wanted = wanted > 1 ? wanted - 1 : 0;
+    std::size_t available = free.load();
+    std::size_t extra;
+    do {
+      extra = std::min(extra_wanted, available);
+    } while (extra > 0 &&
+      !free.compare_exchange_weak(available, available - extra));
+    return lease(this, extra);
+  }
+
+private:
+  std::atomic<std::size_t> free;
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "colormap.hpp"
+#include "hyperslab.hpp"
+#include "indexed_image.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * The building blocks of the /tiles endpoint, which serves a 2d slice as
+ * fixed size tiles from a pyramid of progressively downsampled levels,
+ * the way map viewers expect.
+ * Level 0 is the coarsest, where the whole slice fits in a single tile,
+ * and each level after it doubles the resolution up to the last level
+ * which is the slice at full resolution.  Each level is made from the
+ * next finer one by pooling every 2x2 block of values into one.
+ * Tiles are numbered TMS style: tx counts along x and ty along y, both
+ * from the first coordinate, so tile (0, 0) is at the minimum x and y.
+ * All levels hold their values as NC_DOUBLE hyperslabs of shape {y, x}
+ * so that they can live in the same cache as everything else.
+ */
+class tile_pyramid {
+public:
+  static constexpr std::size_t tile_size = 256;
+
+  enum class pooling { mean, max };
+
+  /**
+   * Returns the number of levels for a slice of the specified size
+   */
+  static std::size_t level_count(std::size_t ny, std::size_t nx) {
+    std::size_t levels = 1;
+    for (std::size_t n = std::max(ny, nx); n > tile_size; n = (n + 1) / 2) {
+      ++levels;
+    }
+    return levels;
+  }
+
+  /**
+   * Returns the finest level, ie the 2d slice as unpacked doubles with
+   * missing values as NaN
+   */
+  static hyperslab full_resolution(const hyperslab& slice) {
+    if (slice.shape.size() != 2) {
+      throw std::invalid_argument(
+        "Tiles need a 2d slice but the selection has " +
+        std::to_string(slice.shape.size()) + " dimensions");
+    }
+    return make_level(slice.to_doubles(), slice.shape[0], slice.shape[1]);
+  }
+
+  /**
+   * Returns the next coarser level, pooling each 2x2 block of 'finer'
+   * into one value.  Missing values are ignored, so a value is only
+   * missing when its whole block is.  At odd sized edges the blocks are
+   * simply smaller.
+   */
+  static hyperslab downsample(const hyperslab& finer, pooling pool) {
+    const std::size_t fy = finer.shape[0];
+    const std::size_t fx = finer.shape[1];
+    const std::size_t ny = (fy + 1) / 2;
+    const std::size_t nx = (fx + 1) / 2;
+    const double* in = (const double*)finer.buffer();
+    std::vector<double> out(ny * nx);
+
+    for (std::size_t y = 0; y < ny; ++y) {
+      const double* row0 = in + 2 * y * fx;
+      // The last row of an odd height is pooled with itself
+      const double* row1 = 2 * y + 1 < fy ? row0 + fx : row0;
+      for (std::size_t x = 0; x < nx; ++x) {
+        std::size_t x1 = std::min(2 * x + 1, fx - 1);
+        double block[4] = {row0[2 * x], row0[x1], row1[2 * x], row1[x1]};
+        out[y * nx + x] = pool == pooling::max ?
+          pool_max(block) : pool_mean(block);
+      }
+    }
+    return make_level(std::move(out), ny, nx);
+  }
+
+  /**
+   * Returns the coordinates of the cells of the next coarser level, the
+   * mean of the coordinates of the cells pooled into each
+   */
+  static std::vector<double> downsample_coordinates(
+      const std::vector<double>& finer) {
+    std::vector<double> result((finer.size() + 1) / 2);
+    for (std::size_t i = 0; i < result.size(); ++i) {
+      std::size_t i1 = std::min(2 * i + 1, finer.size() - 1);
+      result[i] = (finer[2 * i] + finer[i1]) / 2;
+    }
+    return result;
+  }
+
+  /**
+   * Returns tile (tx, ty) of the level as a tile_size x tile_size
+   * hyperslab, padded with NaN past the edges of the level
+   */
+  static hyperslab extract_tile(
+      const hyperslab& level, std::size_t tx, std::size_t ty) {
+    const std::size_t ny = level.shape[0];
+    const std::size_t nx = level.shape[1];
+    if (tx >= tiles(nx) || ty >= tiles(ny)) {
+      throw std::invalid_argument(
+        "Tile (" + std::to_string(tx) + ", " + std::to_string(ty) +
+        ") is out of range, this level has " + std::to_string(tiles(nx)) +
+        " x " + std::to_string(tiles(ny)) + " tiles");
+    }
+    const double* in = (const double*)level.buffer();
+    std::vector<double> out(tile_size * tile_size, NAN);
+    const std::size_t x0 = tx * tile_size;
+    const std::size_t y0 = ty * tile_size;
+    const std::size_t w = std::min(tile_size, nx - x0);
+    const std::size_t h = std::min(tile_size, ny - y0);
+    for (std::size_t y = 0; y < h; ++y) {
+      memcpy(out.data() + y * tile_size, in + (y0 + y) * nx + x0,
+        w * sizeof(double));
+    }
+    return make_level(std::move(out), tile_size, tile_size);
+  }
+
+  /**
+   * Returns the number of tiles needed to cover 'n' cells
+   */
+  static std::size_t tiles(std::size_t n) {
+    return (n + tile_size - 1) / tile_size;
+  }
+
+  /**
+   * Renders a tile with one pixel per value, coloured along the colormap
+   * between 'min' and 'max'.  Missing values are transparent so tiles
+   * can be laid over a map.  As y increases up the image, the first row
+   * of the tile is the bottom row of pixels.
+   */
+  static indexed_image render(const hyperslab& tile, double min, double max) {
+    const std::size_t ny = tile.shape[0];
+    const std::size_t nx = tile.shape[1];
+    const std::uint8_t missing = 0;
+    const std::size_t colours = 255;
+
+    indexed_image image(nx, ny, missing);
+    image.palette.push_back({0, 0, 0});
+    image.alpha.push_back(0);
+    for (auto& c: colormap::lut(colours)) {
+      image.palette.push_back(c);
+    }
+
+    const double* values = (const double*)tile.buffer();
+    const double scale = max > min ? colours / (max - min) : 0;
+    for (std::size_t y = 0; y < ny; ++y) {
+      std::uint8_t* out = image.pixels.data() + (ny - 1 - y) * nx;
+      for (std::size_t x = 0; x < nx; ++x) {
+        double v = values[y * nx + x];
+        if (std::isfinite(v)) {
+          double i = std::clamp((v - min) * scale, 0.0, colours - 1.0);
+          out[x] = 1 + (std::uint8_t)i;
+        }
+      }
+    }
+    return image;
+  }
+
+private:
+  static hyperslab make_level(
+      std::vector<double> values, std::size_t ny, std::size_t nx) {
+    hyperslab slab;
+    slab.type = NC_DOUBLE;
+    slab.element_size = sizeof(double);
+    slab.shape = {ny, nx};
+    slab.data.assign(
+      (const char*)values.data(), values.size() * sizeof(double));
+    return slab;
+  }
+
+  static double pool_mean(const double (&block)[4]) {
+    double sum = 0;
+    int count = 0;
+    for (double v: block) {
+      if (v == v) {
+        sum += v;
+        ++count;
+      }
+    }
+    return count > 0 ? sum / count : NAN;
+  }
+
+  static double pool_max(const double (&block)[4]) {
+    double result = NAN;
+    for (double v: block) {
+      // NaN compares false, so missing values never win
+      result = v > result || result != result ? v : result;
+    }
+    return result;
+  }
+};
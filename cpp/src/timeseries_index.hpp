@@ -0,0 +1,460 @@
+#pragma once
+
+#include "hyperslab.hpp"
+#include "logger.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * A copy of a variable whose first dimension is 'time', transposed so
+ * that 'time' varies fastest, ie the values of every time step at one
+ * position are next to each other.  The whole history at a point is
+ * then one contiguous read, where the variable itself (time, z, y, x)
+ * has them a whole slice apart, so reading it means touching every
+ * time step.
+ * The copy is a sidecar file, built in the background by `build` and
+ * memory-mapped by `open`, which is made of a header (the magic, then
+ * a NUL terminated json description) padded to 'data_offset' followed
+ * by the values in the variable's own type and the host's byte order.
+ * It records the identity of the files it was built from (see
+ * dataset::get_identity) and is only used for those files.
+ */
+class timeseries_index {
+public:
+  // Where the values start, the header being before them
+  static constexpr std::size_t data_offset = 4096;
+  // The most each read done by `build` reads at once
+  static constexpr std::size_t block_bytes = 64 * 1024 * 1024;
+
+  /**
+   * Maps the index at 'path', or returns nullptr if there isn't a
+   * complete one there for the files with that identity.
+   */
+  static std::unique_ptr<const timeseries_index> open(
+      const std::string& path, const std::string& identity) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    char head[data_offset];
+    if (fstat(fd, &st) != 0 || (std::size_t)st.st_size < data_offset ||
+        pread(fd, head, data_offset, 0) != (ssize_t)data_offset ||
+        memcmp(head, magic, sizeof(magic)) != 0) {
+      ::close(fd);
+      return nullptr;
+    }
+    head[data_offset - 1] = 0;
+
+    std::unique_ptr<timeseries_index> index(new timeseries_index());
+    try {
+      auto header = nlohmann::json::parse(head + sizeof(magic));
+      if (header.at("identity").get<std::string>() != identity) {
+        ::close(fd);
+        return nullptr;
+      }
+      index->type = header.at("type").get<nc_type>();
+      index->sizes = header.at("sizes").get<std::vector<std::size_t>>();
+      index->packing.scale_factor = header.at("scale_factor").get<double>();
+      index->packing.add_offset = header.at("add_offset").get<double>();
+      index->packing.packed = header.at("packed").get<bool>();
+      index->packing.fill_value =
+        from_hex(header.at("fill_value").get<std::string>());
+    }
+    catch (nlohmann::json::exception& e) {
+      ::close(fd);
+      logger::warning("Ignoring ", path, ", its header is invalid: ", e.what());
+      return nullptr;
+    }
+    index->element_size = visit_nc_type(index->type, [](auto tag) {
+      return sizeof(typename decltype(tag)::type);
+    });
+    std::size_t bytes = index->element_size;
+    for (auto s: index->sizes) {
+      bytes *= s;
+    }
+    if ((std::size_t)st.st_size != data_offset + bytes) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error(
+        "Unable to mmap " + path + ": " + strerror(errno));
+    }
+    // Each request reads a few columns from anywhere in the file
+    madvise(mapping, st.st_size, MADV_RANDOM);
+    index->base = (const std::uint8_t*)mapping;
+    index->size = st.st_size;
+    return index;
+  }
+
+  /**
+   * Writes the index of a variable of that type, whose dimensions have
+   * the sizes 'sizes' ('time' first), to 'path'.  'read(query)' reads a
+   * selection of the variable.  The values are read in blocks of up to
+   * 'block_bytes' covering every time step of a range of positions, which
+   * are transposed and written where they go, into a file that is renamed
+   * to 'path' once it's complete, so that `open` never sees half an index.
+   * Returns false if 'stopping' was set before it was done.
+   * Throws runtime_error if the file can't be written.
+   */
+  template <typename Read>
+  static bool build(
+      const std::string& path,
+      const std::string& identity,
+      nc_type type,
+      const std::vector<std::size_t>& sizes,
+      Read&& read,
+      const std::atomic<bool>& stopping) {
+    const std::size_t element_size = visit_nc_type(type, [](auto tag) {
+      return sizeof(typename decltype(tag)::type);
+    });
+    const std::size_t time_count = sizes.at(0);
+    const std::vector<std::size_t> dims(sizes.begin() + 1, sizes.end());
+    const std::size_t step_bytes = std::max<std::size_t>(
+      time_count * element_size, 1);
+
+    // The dimensions from 'split' on are read whole, the one before it
+    // 'rows' indices at a time and the ones before that one at a time
+    std::size_t split = dims.size();
+    std::size_t inner = 1;
+    while (split > 0 && dims[split - 1] * inner * step_bytes <= block_bytes) {
+      inner *= dims[--split];
+    }
+    const std::size_t row_count = split == 0 ? 1 : dims[split - 1];
+    const std::size_t rows = std::clamp<std::size_t>(
+      block_bytes / (inner * step_bytes), 1, row_count);
+    std::size_t outer = 1;
+    for (std::size_t d = 0; d + 1 < split; ++d) {
+      outer *= dims[d];
+    }
+
+    const std::string partial = path + ".partial";
+    int fd = ::open(partial.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error(
+        "Unable to create " + partial + ": " + strerror(errno));
+    }
+    try {
+      packing_attributes packing;
+      std::string transposed;
+      for (std::size_t o = 0; o < outer; ++o) {
+        for (std::size_t r = 0; r < row_count; r += rows) {
+          if (stopping) {
+            ::close(fd);
+            unlink(partial.c_str());
+            return false;
+          }
+          const std::size_t n = std::min(rows, row_count - r);
+          hyperslab_query query;
+          query.start.push_back(0);
+          query.count.push_back(time_count);
+          std::size_t rest = o;
+          std::vector<std::size_t> outer_index(split > 0 ? split - 1 : 0);
+          for (std::size_t d = outer_index.size(); d-- > 0; ) {
+            outer_index[d] = rest % dims[d];
+            rest /= dims[d];
+          }
+          for (auto i: outer_index) {
+            query.start.push_back(i);
+            query.count.push_back(1);
+          }
+          if (split > 0) {
+            query.start.push_back(r);
+            query.count.push_back(n);
+          }
+          for (std::size_t d = split; d < dims.size(); ++d) {
+            query.start.push_back(0);
+            query.count.push_back(dims[d]);
+          }
+          query.stride.assign(query.start.size(), 1);
+
+          hyperslab slab = read(query);
+          const std::size_t positions = n * inner;
+          if (slab.type != type ||
+              slab.data.size() != positions * time_count * element_size) {
+            throw std::runtime_error(
+              "Unexpected read while building " + path);
+          }
+          packing = slab.packing;
+          transposed.resize(slab.data.size());
+          visit_nc_type(type, [&](auto tag) {
+            using T = typename decltype(tag)::type;
+            transpose((const T*)slab.data.data(), (T*)transposed.data(),
+              time_count, positions);
+          });
+          const std::size_t first_position = (o * row_count + r) * inner;
+          write_all(fd, transposed.data(), transposed.size(),
+            data_offset + first_position * time_count * element_size, partial);
+        }
+      }
+
+      nlohmann::json header = {
+        {"identity", identity},
+        {"type", type},
+        {"sizes", dims},
+        {"scale_factor", packing.scale_factor},
+        {"add_offset", packing.add_offset},
+        {"packed", packing.packed},
+        {"fill_value", to_hex(packing.fill_value)},
+      };
+      header["sizes"].push_back(time_count);
+      std::string head(magic, sizeof(magic));
+      head += header.dump();
+      if (head.size() >= data_offset) {
+        throw std::runtime_error("The header of " + path + " is too large");
+      }
+      head.resize(data_offset, '\0');
+      write_all(fd, head.data(), head.size(), 0, partial);
+      if (::close(fd) != 0) {
+        fd = -1;
+        throw std::runtime_error(
+          "Unable to write " + partial + ": " + strerror(errno));
+      }
+      fd = -1;
+      if (rename(partial.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error(
+          "Unable to rename " + partial + ": " + strerror(errno));
+      }
+    }
+    catch (...) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      unlink(partial.c_str());
+      throw;
+    }
+    return true;
+  }
+
+  ~timeseries_index() {
+    munmap((void*)base, size);
+  }
+
+  timeseries_index(const timeseries_index&) = delete;
+  timeseries_index& operator=(const timeseries_index&) = delete;
+
+  /**
+   * Returns the values of 'time_count' time steps from 'time_start' at
+   * every position of the region that starts at 'start' and has 'count'
+   * indices along each dimension after 'time', laid out like a read of
+   * the variable would have them ('time' first), with 'shape' as its
+   * shape.  The caller is responsible for validating the ranges.
+   */
+  hyperslab read(
+      const std::vector<std::size_t>& start,
+      const std::vector<std::size_t>& count,
+      std::size_t time_start, std::size_t time_count,
+      std::vector<std::size_t> shape) const {
+    hyperslab slab;
+    slab.type = type;
+    slab.element_size = element_size;
+    slab.packing = packing;
+    slab.shape = std::move(shape);
+
+    // 'sizes' has 'time' last
+    const std::size_t steps = sizes.back();
+    std::size_t positions = 1;
+    for (auto c: count) {
+      positions *= c;
+    }
+    slab.data.resize(positions * time_count * element_size);
+    char* out = slab.data.data();
+
+    std::vector<std::size_t> index = start;
+    for (std::size_t p = 0; p < positions; ++p) {
+      std::size_t position = 0;
+      for (std::size_t d = 0; d < index.size(); ++d) {
+        position = position * sizes[d] + index[d];
+      }
+      const std::uint8_t* column = base + data_offset +
+        (position * steps + time_start) * element_size;
+      if (positions == 1) {
+        memcpy(out, column, time_count * element_size);
+      }
+      else {
+        for (std::size_t t = 0; t < time_count; ++t) {
+          memcpy(out + (t * positions + p) * element_size,
+            column + t * element_size, element_size);
+        }
+      }
+      // The next position in the region, the last dimension fastest
+      for (std::size_t d = index.size(); d-- > 0; ) {
+        if (++index[d] < start[d] + count[d]) {
+          break;
+        }
+        index[d] = start[d];
+      }
+    }
+    return slab;
+  }
+
+private:
+  static constexpr char magic[8] = {'N', 'C', 'T', 'S', 'I', 'D', 'X', '1'};
+
+  nc_type type = NC_NAT;
+  std::size_t element_size = 0;
+  // The sizes of the dimensions after 'time', then of 'time'
+  std::vector<std::size_t> sizes;
+  packing_attributes packing;
+  const std::uint8_t* base = nullptr;
+  std::size_t size = 0;
+
+  timeseries_index() = default;
+
+  /**
+   * out[c * rows + r] = in[r * cols + c], a tile at a time so that
+   * neither side is walked with a large stride for long
+   */
+  template <typename T>
+  static void transpose(const T* in, T* out, std::size_t rows, std::size_t cols) {
+    constexpr std::size_t tile = 32;
+    for (std::size_t r0 = 0; r0 < rows; r0 += tile) {
+      const std::size_t r1 = std::min(rows, r0 + tile);
+      for (std::size_t c0 = 0; c0 < cols; c0 += tile) {
+        const std::size_t c1 = std::min(cols, c0 + tile);
+        for (std::size_t r = r0; r < r1; ++r) {
+          for (std::size_t c = c0; c < c1; ++c) {
+            out[c * rows + r] = in[r * cols + c];
+          }
+        }
+      }
+    }
+  }
+
+  static void write_all(
+      int fd, const char* data, std::size_t bytes, std::size_t offset,
+      const std::string& path) {
+    while (bytes > 0) {
+      ssize_t n = pwrite(fd, data, bytes, offset);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error(
+          "Unable to write " + path + ": " + strerror(errno));
+      }
+      data += n;
+      bytes -= n;
+      offset += n;
+    }
+  }
+
+  static std::string to_hex(const std::string& bytes) {
+    std::string result;
+    char hex[3];
+    for (unsigned char c: bytes) {
+      snprintf(hex, sizeof(hex), "%02x", c);
+      result += hex;
+    }
+    return result;
+  }
+
+  static std::string from_hex(const std::string& hex) {
+    std::string result;
+    for (std::size_t i = 0; i + 1 < hex.size(); i += 2) {
+      result.push_back((char)std::stoi(hex.substr(i, 2), nullptr, 16));
+    }
+    return result;
+  }
+};
+
+/**
+ * Builds timeseries indexes one at a time on a background thread of its
+ * own, so that a build (which reads the whole variable) never holds up
+ * requests or the I/O threads.  A build that fails is logged and not
+ * tried again.
+ */
+class timeseries_builder {
+public:
+  timeseries_builder() : worker([this]() { run(); }) {}
+
+  ~timeseries_builder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+  }
+
+  timeseries_builder(const timeseries_builder&) = delete;
+  timeseries_builder& operator=(const timeseries_builder&) = delete;
+
+  /**
+   * Queues 'build' unless the index at 'path' has already been queued.
+   * 'build' is passed a flag that is set when the builder is being
+   * destroyed, which it should check as it goes.
+   */
+  void submit(
+      const std::string& path,
+      std::function<void(const std::atomic<bool>&)> build) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!submitted.insert(path).second) {
+        return;
+      }
+      queue.emplace_back(path, std::move(build));
+    }
+    wake.notify_one();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::pair<std::string,
+    std::function<void(const std::atomic<bool>&)>>> queue;
+  // Every path ever queued, so that each index is only built once
+  std::set<std::string> submitted;
+  std::atomic<bool> stopping{false};
+  // Declared last so that everything it uses exists before it starts
+  std::thread worker;
+
+  void run() {
+    while (true) {
+      std::pair<std::string,
+        std::function<void(const std::atomic<bool>&)>> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (stopping) {
+          return;
+        }
+        job = std::move(queue.front());
+        queue.pop_front();
+      }
+      try {
+        job.second(stopping);
+      }
+      catch (std::exception& e) {
+        logger::error("Unable to build ", job.first, ": ", e.what());
+      }
+    }
+  }
+};
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "binary_format.hpp"
+#include "hyperslab.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Compact encodings of a hyperslab's values for clients that don't need
+ * every bit of them, eg to draw them, selected with /get-data's
+ * 'encoding' parameter, a comma separated list of:
+ *   - "f32": the unpacked values as float32, missing values as NaN.
+ *   - "q8" / "q16": the unpacked values quantized to 8 / 16 bit unsigned
+ *     integers over the range of the slice's own values, where
+ *     value = q * X-Scale + X-Offset, and q == X-Missing (the largest
+ *     integer, which is never used for a value) is a missing value.
+ *     Infinite values are missing too, as they have no place on a
+ *     scale spanning the finite ones.
+ *   - "shuffle-deflate": the bytes of the values shuffled so that all
+ *     their first bytes come first, then all their second bytes and so
+ *     on (like netCDF-4's shuffle filter), then compressed as a zlib
+ *     stream.  Fields that are mostly near zero have long runs of the
+ *     same high order bytes, which compress far better once together.
+ * At most one of the first three, which change the values, can be
+ * combined with the last, eg "q16,shuffle-deflate".  X-Dtype and X-Shape
+ * describe the values after inflating and unshuffling, see `describe`.
+ */
+namespace transport_encoding {
+
+struct spec {
+  enum class values { none, f32, q8, q16 };
+  values transform = values::none;
+  bool shuffle_deflate = false;
+
+  bool empty() const {
+    return transform == values::none && !shuffle_deflate;
+  }
+};
+
+/**
+ * Parses the 'encoding' parameter, an empty string being no encoding.
+ * Throws invalid_argument when it isn't valid.
+ */
+inline spec parse(const std::string& encoding) {
+  spec result;
+  std::stringstream list(encoding);
+  std::string item;
+  while (std::getline(list, item, ',')) {
+    spec::values transform = spec::values::none;
+    if (item == "f32") {
+      transform = spec::values::f32;
+    }
+    else if (item == "q8") {
+      transform = spec::values::q8;
+    }
+    else if (item == "q16") {
+      transform = spec::values::q16;
+    }
+    else if (item == "shuffle-deflate") {
+      result.shuffle_deflate = true;
+      continue;
+    }
+    else {
+      throw std::invalid_argument(
+        "Invalid argument encoding: '" + item + "' must be one of f32, " +
+        "q8, q16, shuffle-deflate");
+    }
+    if (result.transform != spec::values::none) {
+      throw std::invalid_argument(
+        "Invalid argument encoding: only one of f32, q8 and q16 can be used");
+    }
+    result.transform = transform;
+  }
+  return result;
+}
+
+/**
+ * Kernels for the encodings, each a single branch-free pass so that the
+ * compiler can vectorize them, like nc_kernels
+ */
+namespace kernels {
+
+inline void narrow(const double* in, std::size_t n, float* out) {
+  for (std::size_t i = 0; i < n; ++i) {
+    out[i] = (float)in[i];
+  }
+}
+
+// x - x is 0 for every finite x, and NaN for NaN and both infinities
+inline bool is_finite(double x) {
+  return x - x == 0;
+}
+
+// The minimum and maximum of the finite values, which are (inf, -inf)
+// when there are none
+inline std::pair<double, double> finite_range(const double* in, std::size_t n) {
+  double min = INFINITY, max = -INFINITY;
+  for (std::size_t i = 0; i < n; ++i) {
+    const double v = is_finite(in[i]) ? in[i] : min;
+    min = v < min ? v : min;
+    max = is_finite(in[i]) && in[i] > max ? in[i] : max;
+  }
+  return {min, max};
+}
+
+// Values that aren't finite are written as 'missing', and the rest are
+// clamped to [0, missing - 1] (NaN, eg from 0 * inf, going to 0) so that
+// only ever a value that fits in Q is converted
+template <typename Q>
+void quantize(
+    const double* in, std::size_t n, Q* out,
+    double offset, double inverse_scale, Q missing) {
+  const double top = missing - 1;
+  for (std::size_t i = 0; i < n; ++i) {
+    double q = (in[i] - offset) * inverse_scale + 0.5;
+    q = q > 0 ? q : 0;
+    q = q < top ? q : top;
+    out[i] = is_finite(in[i]) ? (Q)q : missing;
+  }
+}
+
+inline void shuffle(
+    const char* in, std::size_t n, std::size_t element_size, char* out) {
+  for (std::size_t b = 0; b < element_size; ++b) {
+    char* plane = out + b * n;
+    for (std::size_t i = 0; i < n; ++i) {
+      plane[i] = in[i * element_size + b];
+    }
+  }
+}
+
+}
+
+/**
+ * Returns the slab with its values transformed as the spec says, adding
+ * the response headers a client needs to decode them to 'headers'
+ */
+inline hyperslab encode_values(
+    const hyperslab& slab,
+    const spec& encoding,
+    std::vector<std::pair<std::string, std::string>>& headers) {
+  if (encoding.transform == spec::values::none) {
+    return slab;
+  }
+  const std::vector<double> values = slab.to_doubles();
+  const std::size_t n = values.size();
+  hyperslab result;
+  result.shape = slab.shape;
+
+  if (encoding.transform == spec::values::f32) {
+    result.type = NC_FLOAT;
+    result.element_size = sizeof(float);
+    result.data.resize(n * sizeof(float));
+    kernels::narrow(values.data(), n, (float*)result.data.data());
+    return result;
+  }
+
+  auto quantize = [&](auto tag, nc_type type) {
+    using Q = typename decltype(tag)::type;
+    // The largest integer is left for the missing values
+    const Q missing = (Q)~(Q)0;
+    auto [min, max] = kernels::finite_range(values.data(), n);
+    double offset = 0, scale = 1;
+    if (min <= max) {
+      offset = min;
+      // Divided first, as max - min can overflow when they're both huge
+      scale = max > min ? max / (missing - 1) - min / (missing - 1) : 1;
+    }
+    result.type = type;
+    result.element_size = sizeof(Q);
+    result.data.resize(n * sizeof(Q));
+    kernels::quantize(values.data(), n, (Q*)result.data.data(),
+      offset, 1 / scale, missing);
+
+    char number[32];
+    snprintf(number, sizeof(number), "%.17g", scale);
+    headers.emplace_back("X-Scale", number);
+    snprintf(number, sizeof(number), "%.17g", offset);
+    headers.emplace_back("X-Offset", number);
+    headers.emplace_back("X-Missing", std::to_string(missing));
+  };
+  if (encoding.transform == spec::values::q8) {
+    quantize(nc_type_tag<unsigned char>{}, NC_UBYTE);
+  }
+  else {
+    quantize(nc_type_tag<unsigned short>{}, NC_USHORT);
+  }
+  return result;
+}
+
+/**
+ * Returns the bytes of the values shuffled and compressed, see
+ * "shuffle-deflate" above
+ */
+inline std::string shuffle_deflate(const hyperslab& slab) {
+  std::string shuffled(slab.data.size(), '\0');
+  kernels::shuffle(slab.data.data(), slab.element_count(),
+    std::max<std::size_t>(slab.element_size, 1), shuffled.data());
+
+  uLongf length = compressBound(shuffled.size());
+  std::string result(length, '\0');
+  if (compress2((Bytef*)result.data(), &length,
+        (const Bytef*)shuffled.data(), shuffled.size(),
+        Z_DEFAULT_COMPRESSION) != Z_OK) {
+    throw std::runtime_error("Unable to compress the values");
+  }
+  result.resize(length);
+  return result;
+}
+
+/**
+ * Returns the X-Encoding header's value, the encodings in the order a
+ * client undoes them: eg "shuffle-deflate" then "q16"
+ */
+inline std::string describe(const spec& encoding) {
+  std::string result = encoding.shuffle_deflate ? "shuffle-deflate" : "";
+  const char* transform =
+    encoding.transform == spec::values::f32 ? "f32" :
+    encoding.transform == spec::values::q8 ? "q8" :
+    encoding.transform == spec::values::q16 ? "q16" : "";
+  if (*transform) {
+    result += (result.empty() ? "" : ",") + std::string(transform);
+  }
+  return result;
+}
+
+}